@@ -0,0 +1,307 @@
+#include <pthread.h>
+
+#include "cache.h"
+#include "io_helper.h"
+#include "request.h"
+
+// The cache is split into stripes by path, each with its own lock, table,
+// LRU list and share of the budget, so that requests for different files
+// rarely wait for each other
+#define CACHE_STRIPES 16
+
+struct stripe {
+    pthread_mutex_t lock;
+    struct cache_entry **table;
+    size_t nbuckets;
+    size_t entries;
+    size_t bytes;
+
+    // Most recently used at the head
+    struct cache_entry *head;
+    struct cache_entry *tail;
+};
+
+static struct stripe stripes[CACHE_STRIPES];
+static size_t stripe_budget;
+
+static uint64_t hits;
+static uint64_t misses;
+static uint64_t evictions;
+
+// FNV-1a
+static uint64_t
+hash_path(char *path)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char *p = (unsigned char *)path; *p; p++) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static struct stripe *
+stripe_of(uint64_t hash)
+{
+    return &stripes[(hash >> 32) % CACHE_STRIPES];
+}
+
+//
+// Sets up a cache of at most budget bytes. A budget of 0 turns caching off:
+// cache_get() then opens every file afresh.
+//
+void
+cache_init(size_t budget)
+{
+    stripe_budget = budget / CACHE_STRIPES;
+    for (int i = 0; i < CACHE_STRIPES; i++) {
+        struct stripe *s = &stripes[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->nbuckets = 64;
+        s->table = calloc(s->nbuckets, sizeof(*s->table));
+        assert(s->table != NULL);
+    }
+}
+
+static void
+entry_free(struct cache_entry *e)
+{
+    free(e->path);
+    free(e->header[0]);
+    free(e->header[1]);
+    free(e->body);
+    free(e);
+}
+
+//
+// Drops a reference to an entry returned by cache_get()
+//
+void
+cache_put(struct cache_entry *e)
+{
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        entry_free(e);
+    }
+}
+
+static int
+entry_matches(struct cache_entry *e, struct stat *sbuf)
+{
+    return e->dev == sbuf->st_dev && e->ino == sbuf->st_ino && e->size == sbuf->st_size
+        && e->mtime.tv_sec == sbuf->st_mtim.tv_sec && e->mtime.tv_nsec == sbuf->st_mtim.tv_nsec;
+}
+
+static void
+lru_unlink(struct stripe *s, struct cache_entry *e)
+{
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        s->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        s->tail = e->prev;
+    }
+}
+
+static void
+lru_push(struct stripe *s, struct cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = s->head;
+    if (s->head) {
+        s->head->prev = e;
+    } else {
+        s->tail = e;
+    }
+    s->head = e;
+}
+
+// Takes e out of the stripe and drops the cache's reference to it; requests
+// still sending it keep it alive until they are done
+static void
+stripe_remove(struct stripe *s, struct cache_entry *e)
+{
+    struct cache_entry **pp = &s->table[e->hash & (s->nbuckets - 1)];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    lru_unlink(s, e);
+    s->entries--;
+    s->bytes -= e->charge;
+    cache_put(e);
+}
+
+static struct cache_entry *
+stripe_find(struct stripe *s, char *path, uint64_t hash)
+{
+    struct cache_entry *e = s->table[hash & (s->nbuckets - 1)];
+    while (e && (e->hash != hash || strcmp(e->path, path))) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+static void
+stripe_grow(struct stripe *s)
+{
+    size_t nbuckets = s->nbuckets * 2;
+    struct cache_entry **table = calloc(nbuckets, sizeof(*table));
+    if (table == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < s->nbuckets; i++) {
+        struct cache_entry *e, *next;
+        for (e = s->table[i]; e; e = next) {
+            next = e->hnext;
+            e->hnext = table[e->hash & (nbuckets - 1)];
+            table[e->hash & (nbuckets - 1)] = e;
+        }
+    }
+    free(s->table);
+    s->table = table;
+    s->nbuckets = nbuckets;
+}
+
+// Adds e, which holds a reference for the cache, evicting the least recently
+// used entries to stay within the budget
+static void
+stripe_insert(struct stripe *s, struct cache_entry *e)
+{
+    if (s->entries >= s->nbuckets) {
+        stripe_grow(s);
+    }
+    size_t b = e->hash & (s->nbuckets - 1);
+    e->hnext = s->table[b];
+    s->table[b] = e;
+    lru_push(s, e);
+    s->entries++;
+    s->bytes += e->charge;
+
+    while (s->bytes > stripe_budget && s->tail != e) {
+        stripe_remove(s, s->tail);
+        __atomic_add_fetch(&evictions, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Reads path into a new entry with one reference, or returns NULL if the
+// file cannot be opened
+static struct cache_entry *
+entry_load(char *path, uint64_t hash)
+{
+    struct stat sbuf;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    // The entry describes what was read, even if the file changed since the
+    // caller looked at it
+    fstat_or_die(fd, &sbuf);
+
+    struct cache_entry *e = malloc_or_die(sizeof(*e));
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    assert(e->path != NULL);
+    e->hash = hash;
+    e->dev = sbuf.st_dev;
+    e->ino = sbuf.st_ino;
+    e->size = sbuf.st_size;
+    e->mtime = sbuf.st_mtim;
+    e->refs = 1;
+
+    char buf[MAXBUF];
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+        e->headerlen[keep_alive] = request_format_static(buf, path, e->size, keep_alive);
+        e->header[keep_alive] = malloc_or_die(e->headerlen[keep_alive]);
+        memcpy(e->header[keep_alive], buf, e->headerlen[keep_alive]);
+    }
+
+    // A body that could not stay in the cache would only be read to be
+    // thrown away, so such files are sent from disk
+    e->charge = sizeof(*e) + strlen(path) + 1 + e->headerlen[0] + e->headerlen[1];
+    if (e->size <= CACHE_MAX_BODY && e->charge + e->size <= stripe_budget) {
+        e->body = malloc_or_die(e->size + 1);
+        off_t off = 0;
+        while (off < e->size) {
+            ssize_t n = pread(fd, e->body + off, e->size - off, off);
+            if (n <= 0 && !(n < 0 && errno == EINTR)) {
+                break;
+            }
+            off += n > 0 ? n : 0;
+        }
+        if (off < e->size) {
+            // It shrank while being read; send it from disk instead
+            free(e->body);
+            e->body = NULL;
+        }
+    }
+    close_or_die(fd);
+
+    if (e->body) {
+        e->charge += e->size;
+    }
+    return e;
+}
+
+//
+// Returns the entry for the file at path, which the caller found with stat()
+// to be as in sbuf, reading it in if it is not cached or has changed since.
+// The entry must be handed back with cache_put(). Returns NULL if the file
+// cannot be opened.
+//
+struct cache_entry *
+cache_get(char *path, struct stat *sbuf)
+{
+    uint64_t hash = hash_path(path);
+    struct stripe *s = stripe_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    struct cache_entry *e = stripe_find(s, path, hash);
+    if (e && entry_matches(e, sbuf)) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        lru_unlink(s, e);
+        lru_push(s, e);
+        pthread_mutex_unlock(&s->lock);
+        __atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+        return e;
+    }
+    if (e) {
+        stripe_remove(s, e);
+    }
+    pthread_mutex_unlock(&s->lock);
+    __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+
+    // The file is read without the lock held; if another request cached it
+    // in the meantime, the newer of the two stays
+    e = entry_load(path, hash);
+    if (e == NULL || e->charge > stripe_budget) {
+        return e;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    struct cache_entry *old = stripe_find(s, path, hash);
+    if (old) {
+        stripe_remove(s, old);
+    }
+    e->refs++;
+    stripe_insert(s, e);
+    pthread_mutex_unlock(&s->lock);
+    return e;
+}
+
+void
+cache_stats(struct cache_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    st->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+    st->evictions = __atomic_load_n(&evictions, __ATOMIC_RELAXED);
+    for (int i = 0; i < CACHE_STRIPES; i++) {
+        pthread_mutex_lock(&stripes[i].lock);
+        st->entries += stripes[i].entries;
+        st->bytes += stripes[i].bytes;
+        pthread_mutex_unlock(&stripes[i].lock);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Files up to this size are kept in memory; larger ones are sent from disk
+// with sendfile() and only their metadata and headers are cached
+#define CACHE_MAX_BODY (256 * 1024)
+
+// A static file as it was when it was cached: what fstat() said about it,
+// the headers of a response for it and, for small files, its contents
+struct cache_entry {
+    char *path;
+    uint64_t hash;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    // The header of a response that closes the connection, [0], and of one
+    // that keeps it open, [1]
+    char *header[2];
+    int headerlen[2];
+
+    // The contents of the file, or NULL if it is larger than CACHE_MAX_BODY
+    char *body;
+
+    // Memory charged to the cache, and references held by the cache and by
+    // the requests using the entry
+    size_t charge;
+    int refs;
+
+    struct cache_entry *hnext;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+};
+
+struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+};
+
+void cache_init(size_t budget);
+struct cache_entry *cache_get(char *path, struct stat *sbuf);
+void cache_put(struct cache_entry *e);
+void cache_stats(struct cache_stats *st);
+
+#endif // __CACHE_H__
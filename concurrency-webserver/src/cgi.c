@@ -0,0 +1,182 @@
+#include <stdint.h>
+
+#include "cgi.h"
+#include "io_helper.h"
+#include "request.h"
+
+// CGI programs can be started by runners: small processes forked before the
+// server has started any threads or filled its cache. Forking one of them
+// costs far less than forking the whole server, and several do it at once.
+// Each runner takes requests over a Unix-domain socket, one message per
+// program, with the descriptor for the program's output attached.
+static int *runners;
+static int nrunners;
+static unsigned next_runner;
+
+// A request to a runner: the two strings, each with its '\0', follow
+struct cgi_msg {
+    uint32_t filename_len;
+    uint32_t cgiargs_len;
+};
+
+// Turns the calling process, a child of the server, into the program
+static void
+cgi_exec(char *filename, char *cgiargs, int out_fd)
+{
+    char *argv[] = { NULL };
+    extern char **environ;
+
+    // undo what the server set up for itself
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    setenv_or_die("QUERY_STRING", cgiargs, 1);
+    dup2_or_die(out_fd, STDOUT_FILENO);
+    // The program expects to block on its output, like it would on a
+    // socket, even if the server reads the other end without blocking
+    fcntl(STDOUT_FILENO, F_SETFL, 0);
+    execve_or_die(filename, argv, environ);
+}
+
+// Receives a request into buf, and the output descriptor into *out_fd.
+// Returns the length of the request, or 0 once the server has gone.
+static ssize_t
+runner_recv(int sock, char *buf, size_t len, int *out_fd)
+{
+    struct iovec iov = { buf, len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0) {
+        return 0;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        *out_fd = -1;
+    } else {
+        memcpy(out_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return n;
+}
+
+// The life of a runner: start each program it is asked for, with the
+// descriptor it was given as its output. The kernel reaps the programs.
+static void
+runner_main(int sock)
+{
+    char buf[sizeof(struct cgi_msg) + 2 * MAXBUF];
+    int out_fd;
+    ssize_t n;
+
+    signal(SIGCHLD, SIG_IGN);
+    while ((n = runner_recv(sock, buf, sizeof(buf), &out_fd)) > 0) {
+        struct cgi_msg *m = (struct cgi_msg *)buf;
+        if (out_fd < 0 || n != sizeof(*m) + m->filename_len + m->cgiargs_len) {
+            continue;
+        }
+        char *filename = buf + sizeof(*m);
+        char *cgiargs = filename + m->filename_len;
+
+        if (fork_or_die() == 0) {
+            close_or_die(sock);
+            cgi_exec(filename, cgiargs, out_fd);
+        }
+        close_or_die(out_fd);
+    }
+    exit(0);
+}
+
+//
+// Forks nrunners runners. Must be called before the server starts any
+// threads, and before it opens anything the programs should not inherit.
+//
+void
+cgi_init(int n)
+{
+    runners = malloc_or_die(n * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        int sv[2];
+        // each message is a whole request, so threads can share a runner
+        int rc = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+        assert(rc == 0);
+        if (fork_or_die() == 0) {
+            for (int j = 0; j < i; j++) {
+                close_or_die(runners[j]);
+            }
+            close_or_die(sv[0]);
+            runner_main(sv[1]);
+        }
+        close_or_die(sv[1]);
+        runners[i] = sv[0];
+    }
+    nrunners = n;
+}
+
+// Asks a runner to start the program. Returns 0 if it could not be reached.
+static int
+runner_send(int sock, char *filename, char *cgiargs, int out_fd)
+{
+    struct cgi_msg m = { strlen(filename) + 1, strlen(cgiargs) + 1 };
+    struct iovec iov[3] = {
+        { &m, sizeof(m) },
+        { filename, m.filename_len },
+        { cgiargs, m.cgiargs_len },
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 3,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &out_fd, sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return n == sizeof(m) + m.filename_len + m.cgiargs_len;
+}
+
+//
+// Starts the CGI program filename, with cgiargs as its query string and
+// out_fd as its output. The caller still closes out_fd. Returns the pid of
+// the program if the server had to fork it itself, for the caller to reap,
+// or 0 if a runner started it.
+//
+pid_t
+cgi_spawn(char *filename, char *cgiargs, int out_fd)
+{
+    if (nrunners > 0) {
+        unsigned i = __atomic_fetch_add(&next_runner, 1, __ATOMIC_RELAXED) % nrunners;
+        if (runner_send(runners[i], filename, cgiargs, out_fd)) {
+            return 0;
+        }
+    }
+
+    pid_t pid = fork_or_die();
+    if (pid == 0) {
+        cgi_exec(filename, cgiargs, out_fd);
+    }
+    return pid;
+}
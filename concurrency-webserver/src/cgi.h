@@ -0,0 +1,9 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+
+#include <sys/types.h>
+
+void cgi_init(int nrunners);
+pid_t cgi_spawn(char *filename, char *cgiargs, int out_fd);
+
+#endif // __CGI_H__
@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#include "cgicache.h"
+#include "io_helper.h"
+
+// Seconds output is served again for, unless the program says otherwise; 0
+// turns the cache off
+static int ttl;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cgicache_entry **table;
+static size_t nbuckets;
+static size_t entries;
+static size_t bytes;
+
+static uint64_t hits;
+static uint64_t coalesced;
+static uint64_t runs;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a, as in cache.c
+static uint64_t
+hash_key(char *key, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+//
+// Keeps the output of CGI programs for ttl seconds, or for as long as a
+// program's Cache-Control header says. With a ttl of 0, every request runs
+// its program.
+//
+void
+cgicache_init(int t)
+{
+    ttl = t;
+    nbuckets = 64;
+    table = calloc(nbuckets, sizeof(*table));
+    assert(table != NULL);
+}
+
+//
+// Drops a reference to an entry returned by cgicache_get()
+//
+void
+cgicache_put(struct cgicache_entry *e)
+{
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close_or_die(e->fd);
+        free(e->key);
+        free(e->out);
+        free(e);
+    }
+}
+
+// Takes e out of the table and drops the table's reference to it; requests
+// still sending its output keep it alive until they are done
+static void
+table_remove(struct cgicache_entry *e)
+{
+    struct cgicache_entry **pp = &table[e->hash & (nbuckets - 1)];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    e->cached = 0;
+    entries--;
+    bytes -= e->len;
+    cgicache_put(e);
+}
+
+static struct cgicache_entry *
+table_find(char *key, size_t keylen, uint64_t hash)
+{
+    struct cgicache_entry *e = table[hash & (nbuckets - 1)];
+    while (e && (e->hash != hash || e->keylen != keylen || memcmp(e->key, key, keylen))) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+static void
+table_insert(struct cgicache_entry *e)
+{
+    if (entries >= nbuckets) {
+        size_t n = nbuckets * 2;
+        struct cgicache_entry **t = calloc(n, sizeof(*t));
+        if (t != NULL) {
+            for (size_t i = 0; i < nbuckets; i++) {
+                struct cgicache_entry *p, *next;
+                for (p = table[i]; p; p = next) {
+                    next = p->hnext;
+                    p->hnext = t[p->hash & (n - 1)];
+                    t[p->hash & (n - 1)] = p;
+                }
+            }
+            free(table);
+            table = t;
+            nbuckets = n;
+        }
+    }
+    size_t b = e->hash & (nbuckets - 1);
+    e->hnext = table[b];
+    table[b] = e;
+    e->cached = 1;
+    entries++;
+}
+
+// Drops the entries that have expired, to make room
+static void
+table_sweep(uint64_t now)
+{
+    for (size_t i = 0; i < nbuckets; i++) {
+        struct cgicache_entry *e, *next;
+        for (e = table[i]; e; e = next) {
+            next = e->hnext;
+            if (e->ready && e->expires_ms <= now) {
+                table_remove(e);
+            }
+        }
+    }
+}
+
+// Returns how many seconds the program's output may be served again for:
+// what its Cache-Control header says, or ttl without one. Output without a
+// complete header is not kept, as it cannot be framed for keep-alive either.
+static int
+output_ttl(char *out, size_t len)
+{
+    char *p = out, *end = out + len, *nl;
+    int secs = ttl, nostore = 0;
+
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        if (nl == p || (nl == p + 1 && *p == '\r')) {
+            return nostore ? 0 : secs;
+        }
+        if (nl - p > 14 && strncasecmp(p, "Cache-Control:", 14) == 0) {
+            char value[256];
+            size_t n = nl - p - 14 < sizeof(value) - 1 ? nl - p - 14 : sizeof(value) - 1;
+            memcpy(value, p + 14, n);
+            value[n] = '\0';
+            char *age = strcasestr(value, "max-age=");
+            if (strcasestr(value, "no-store") || strcasestr(value, "no-cache")
+                || strcasestr(value, "private")) {
+                nostore = 1;
+            } else if (age) {
+                secs = atoi(age + 8);
+            }
+        }
+        p = nl + 1;
+    }
+    return 0;
+}
+
+//
+// Looks up the output of filename run with cgiargs. Returns NULL if the
+// cache is off. Otherwise returns an entry, to be handed back with
+// cgicache_put(), and sets *run: if 1, the caller is to run the program and
+// hand its output to cgicache_fill(), and requests for the same output wait
+// for it meanwhile; if 0, the output is ready, or will be once the entry's
+// ready flag is set.
+//
+struct cgicache_entry *
+cgicache_get(char *filename, char *cgiargs, int *run)
+{
+    if (ttl <= 0) {
+        return NULL;
+    }
+
+    size_t flen = strlen(filename), alen = strlen(cgiargs);
+    size_t keylen = flen + 1 + alen;
+    char *key = malloc_or_die(keylen);
+    memcpy(key, filename, flen + 1);
+    memcpy(key + flen + 1, cgiargs, alen);
+    uint64_t hash = hash_key(key, keylen);
+
+    pthread_mutex_lock(&lock);
+    struct cgicache_entry *e = table_find(key, keylen, hash);
+    if (e && e->ready && e->expires_ms <= now_ms()) {
+        table_remove(e);
+        e = NULL;
+    }
+    if (e) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        int ready = e->ready;
+        pthread_mutex_unlock(&lock);
+        __atomic_add_fetch(ready ? &hits : &coalesced, 1, __ATOMIC_RELAXED);
+        free(key);
+        *run = 0;
+        return e;
+    }
+
+    e = malloc_or_die(sizeof(*e));
+    memset(e, 0, sizeof(*e));
+    e->key = key;
+    e->keylen = keylen;
+    e->hash = hash;
+    e->fd = eventfd(0, EFD_CLOEXEC);
+    assert(e->fd >= 0);
+    e->refs = 2;
+    table_insert(e);
+    pthread_mutex_unlock(&lock);
+    __atomic_add_fetch(&runs, 1, __ATOMIC_RELAXED);
+    *run = 1;
+    return e;
+}
+
+//
+// Hands the output of the program the caller ran for e to the requests
+// waiting for it, and keeps it for later ones if the program allows
+//
+void
+cgicache_fill(struct cgicache_entry *e, char *out, size_t len)
+{
+    int secs = output_ttl(out, len);
+    char *copy = malloc_or_die(len + 1);
+    memcpy(copy, out, len);
+
+    pthread_mutex_lock(&lock);
+    uint64_t now = now_ms();
+    e->out = copy;
+    e->len = len;
+    e->expires_ms = now + (uint64_t)(secs > 0 ? secs : 0) * 1000;
+    bytes += len;
+    if (bytes > CGICACHE_BUDGET) {
+        table_sweep(now);
+    }
+    if (e->cached && (secs <= 0 || bytes > CGICACHE_BUDGET)) {
+        table_remove(e);
+    }
+    __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+
+    // Nobody reads the eventfd, so it stays readable for every waiter
+    uint64_t one = 1;
+    ssize_t n = write(e->fd, &one, sizeof(one));
+    assert(n == sizeof(one));
+}
+
+//
+// Waits for the output of e to be ready
+//
+void
+cgicache_wait(struct cgicache_entry *e)
+{
+    struct pollfd pfd = { .fd = e->fd, .events = POLLIN };
+    while (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+        poll(&pfd, 1, -1);
+    }
+}
+
+//
+// Returns a descriptor of its own for the caller to watch, which becomes
+// readable once the output of e is ready. The caller closes it.
+//
+int
+cgicache_watch(struct cgicache_entry *e)
+{
+    int fd = fcntl(e->fd, F_DUPFD_CLOEXEC, 0);
+    assert(fd >= 0);
+    return fd;
+}
+
+void
+cgicache_stats(struct cgicache_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    st->coalesced = __atomic_load_n(&coalesced, __ATOMIC_RELAXED);
+    st->runs = __atomic_load_n(&runs, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&lock);
+    st->entries = entries;
+    st->bytes = bytes;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,44 @@
+#ifndef __CGICACHE_H__
+#define __CGICACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory the cached output of CGI programs may take up in all; output that
+// does not fit is still shared by the requests waiting for it, but not kept
+#define CGICACHE_BUDGET (16 << 20)
+
+// The output of one run of a CGI program with one query string. While the
+// program runs, requests for the same output wait for it rather than run it
+// again; once ready is set, out holds all of it and does not change.
+struct cgicache_entry {
+    char *key;                  // the filename, '\0', the query string
+    size_t keylen;
+    uint64_t hash;
+    int fd;                     // an eventfd, readable once the output is in
+    int ready;
+    char *out;
+    size_t len;
+    uint64_t expires_ms;
+    int cached;                 // in the table, for later requests to find
+    int refs;
+    struct cgicache_entry *hnext;
+};
+
+struct cgicache_stats {
+    uint64_t hits;
+    uint64_t coalesced;         // waited for a run already under way
+    uint64_t runs;
+    size_t entries;
+    size_t bytes;
+};
+
+void cgicache_init(int ttl);
+struct cgicache_entry *cgicache_get(char *filename, char *cgiargs, int *run);
+void cgicache_fill(struct cgicache_entry *e, char *out, size_t len);
+void cgicache_wait(struct cgicache_entry *e);
+int cgicache_watch(struct cgicache_entry *e);
+void cgicache_put(struct cgicache_entry *e);
+void cgicache_stats(struct cgicache_stats *st);
+
+#endif // __CGICACHE_H__
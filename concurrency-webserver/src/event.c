@@ -0,0 +1,738 @@
+#define _GNU_SOURCE
+
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <time.h>
+
+#include "cache.h"
+#include "cgi.h"
+#include "cgicache.h"
+#include "event.h"
+#include "http.h"
+#include "io_helper.h"
+#include "log.h"
+#include "request.h"
+#include "stats.h"
+
+// Events handled per epoll_wait() call
+#define MAXEVENTS 256
+
+// How long a loop stops accepting after running out of descriptors or memory
+#define ACCEPT_BACKOFF_MS 100
+
+// Requests start out in a small buffer that grows up to MAXBUF, so idle
+// connections cost little memory
+#define INBUF_MIN 1024
+
+enum conn_state {
+    CONN_READING,
+    CONN_CGI,
+    CONN_WRITING,
+};
+
+struct conn;
+
+// What an epoll event refers to: a client socket or the pipe a CGI program
+// writes its output to
+struct source {
+    enum { SRC_SOCKET, SRC_PIPE } type;
+    struct conn *conn;
+};
+
+// An event loop. The connections waiting for a request are listed in order
+// of their last activity, so those idle for too long are found at the head.
+struct loop {
+    int epfd;
+    int listen_fd;
+    struct conn *idle_head;
+    struct conn *idle_tail;
+
+    // When the loop goes back to accepting, 0 while the listening socket is
+    // in the epoll set
+    uint64_t accept_resume_ms;
+};
+
+struct conn {
+    int fd;
+    struct loop *loop;
+    enum conn_state state;
+    struct source sock;
+    struct source pipe;
+    int pipe_fd;
+
+    // The CGI cache entry for the output, and whether this connection runs
+    // the program for it or waits on pipe_fd for another run to finish
+    struct cgicache_entry *cgi;
+    int cgi_run;
+
+    // What the socket is watched for, 0 while it is not in the epoll set
+    uint32_t events;
+
+    // Place in the loop's idle list, for as long as the state is
+    // CONN_READING
+    struct conn *prev;
+    struct conn *next;
+    uint64_t last_ms;
+
+    // Requests answered so far, and whether the connection stays open after
+    // the current one
+    int nrequests;
+    int keep_alive;
+
+    // What the current request is for, and when the server took it up
+    enum stats_kind kind;
+    uint64_t start;
+
+    // The input, and how far the next request in it has been parsed
+    char *in;
+    size_t inlen;
+    size_t incap;
+    struct http_request http;
+
+    // The response: out holds the header, or all of it for errors and CGI
+    // output. The body of a static response comes from the cache entry, or
+    // from body_fd with sendfile() if the entry does not hold it; either way
+    // from body_off on.
+    char *out;
+    size_t outlen;
+    size_t outcap;
+    size_t sent;
+    struct cache_entry *entry;
+    int body_fd;
+    off_t body_off;
+    off_t bodylen;
+};
+
+static struct source listener = { SRC_SOCKET, NULL };
+static int nloops_started;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+epoll_add(int epfd, int fd, uint32_t events, struct source *src)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = src };
+    int rc = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    assert(rc == 0);
+}
+
+// Closing a descriptor only takes it out of the epoll set once no process
+// has it open, and a CGI program forked by the server has its own copies
+// until it execs, so pipes and sockets are taken out first
+static void
+epoll_del(int epfd, int fd)
+{
+    int rc = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    assert(rc == 0);
+}
+
+// Watches the socket for events, or takes it out of the epoll set for 0
+static void
+conn_watch(struct conn *c, uint32_t events)
+{
+    if (events == c->events) {
+        return;
+    }
+
+    struct epoll_event ev = { .events = events, .data.ptr = &c->sock };
+    int op = c->events == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    int rc = epoll_ctl(c->loop->epfd, op, c->fd, &ev);
+    assert(rc == 0);
+    c->events = events;
+}
+
+// Puts the connection at the tail of the idle list, as the one most recently
+// heard from
+static void
+idle_link(struct conn *c)
+{
+    struct loop *l = c->loop;
+    c->last_ms = now_ms();
+    c->next = NULL;
+    c->prev = l->idle_tail;
+    if (l->idle_tail) {
+        l->idle_tail->next = c;
+    } else {
+        l->idle_head = c;
+    }
+    l->idle_tail = c;
+}
+
+static void
+idle_unlink(struct conn *c)
+{
+    struct loop *l = c->loop;
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        l->idle_head = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        l->idle_tail = c->prev;
+    }
+    c->prev = c->next = NULL;
+}
+
+// Puts the listening socket back into the epoll set
+static void
+loop_resume_accept(struct loop *l)
+{
+    if (l->accept_resume_ms) {
+        epoll_add(l->epfd, l->listen_fd, EPOLLIN | EPOLLEXCLUSIVE, &listener);
+        l->accept_resume_ms = 0;
+    }
+}
+
+static void
+conn_close(struct conn *c)
+{
+    if (c->state == CONN_READING) {
+        idle_unlink(c);
+    }
+
+    if (c->pipe_fd >= 0) {
+        epoll_del(c->loop->epfd, c->pipe_fd);
+        close_or_die(c->pipe_fd);
+    }
+    if (c->body_fd >= 0) {
+        close_or_die(c->body_fd);
+    }
+    if (c->entry) {
+        cache_put(c->entry);
+    }
+    conn_watch(c, 0);
+    close_or_die(c->fd);
+    // A descriptor is free again for a connection waiting to be accepted
+    loop_resume_accept(c->loop);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void
+conn_reserve(struct conn *c, size_t len)
+{
+    if (c->outlen + len > c->outcap) {
+        c->outcap = c->outcap ? c->outcap : MAXBUF;
+        while (c->outlen + len > c->outcap) {
+            c->outcap *= 2;
+        }
+        c->out = realloc(c->out, c->outcap);
+        assert(c->out != NULL);
+    }
+}
+
+// Leaves CONN_READING to answer a request
+static void
+conn_answer(struct conn *c)
+{
+    idle_unlink(c);
+    c->state = CONN_WRITING;
+    c->kind = STATS_OTHER;
+    c->start = stats_now();
+}
+
+// Writes as much of the response as the socket takes. Returns 1 once all of
+// it is out.
+static int
+conn_send(struct conn *c)
+{
+    // A body held in memory goes out together with the header
+    while (c->entry && c->entry->body && c->body_off < c->bodylen) {
+        struct iovec iov[2] = {
+            { c->out + c->sent, c->outlen - c->sent },
+            { c->entry->body + c->body_off, c->bodylen - c->body_off },
+        };
+        int done = c->sent == c->outlen;
+        struct msghdr msg = { .msg_iov = iov + done, .msg_iovlen = 2 - done };
+        ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            c->keep_alive = 0;
+            return 1;
+        }
+        size_t hdr = n < c->outlen - c->sent ? n : c->outlen - c->sent;
+        c->sent += hdr;
+        c->body_off += n - hdr;
+    }
+
+    while (c->sent < c->outlen) {
+        // With a body to follow, MSG_MORE holds the header back so that it
+        // shares a segment with the start of the file
+        int flags = MSG_NOSIGNAL | (c->body_off < c->bodylen ? MSG_MORE : 0);
+        ssize_t n = send(c->fd, c->out + c->sent, c->outlen - c->sent, flags);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            // The client went away, there is no one left to answer
+            c->keep_alive = 0;
+            return 1;
+        }
+        c->sent += n;
+    }
+
+    while (c->body_off < c->bodylen) {
+        ssize_t n = sendfile(c->fd, c->body_fd, &c->body_off, c->bodylen - c->body_off);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return 0;
+        }
+        if (n <= 0) {
+            // The client went away, or the file shrank under us
+            c->keep_alive = 0;
+            return 1;
+        }
+    }
+    return 1;
+}
+
+// Ends the response that has just gone out. Returns 1 if the connection is
+// open for the next request, 0 if it was closed.
+static int
+conn_finish(struct conn *c)
+{
+    // Every response starts with its status line
+    stats_request(c->kind, atoi(c->out + 9), c->sent + c->body_off, c->start);
+
+    if (!c->keep_alive) {
+        conn_close(c);
+        return 0;
+    }
+
+    if (c->body_fd >= 0) {
+        close_or_die(c->body_fd);
+        c->body_fd = -1;
+    }
+    if (c->entry) {
+        cache_put(c->entry);
+        c->entry = NULL;
+    }
+    c->body_off = c->bodylen = 0;
+    c->outlen = c->sent = 0;
+    c->state = CONN_READING;
+    idle_link(c);
+    conn_watch(c, EPOLLIN);
+    return 1;
+}
+
+// Starts sending the response, or waits for the socket to become writable.
+// Returns 1 if it went out at once and the connection is open for the next
+// request.
+static int
+conn_respond(struct conn *c)
+{
+    if (conn_send(c)) {
+        return conn_finish(c);
+    }
+
+    conn_watch(c, EPOLLOUT);
+    return 0;
+}
+
+static int
+conn_serve_static(struct conn *c, char *filename, struct stat *sbuf)
+{
+    struct cache_entry *e = cache_get(filename, sbuf);
+    int fd = -1;
+    if (e && !e->body) {
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+    }
+    if (e == NULL || (!e->body && fd < 0)) {
+        // Gone since request_resolve() looked
+        if (e) {
+            cache_put(e);
+        }
+        c->outlen = request_format_error(c->out, filename, "404", "Not found",
+            "server could not find this file", c->keep_alive);
+        return conn_respond(c);
+    }
+
+    int len = e->headerlen[c->keep_alive];
+    conn_reserve(c, len);
+    memcpy(c->out, e->header[c->keep_alive], len);
+    c->outlen = len;
+    c->entry = e;
+    c->body_fd = fd;
+    c->bodylen = e->size;
+    return conn_respond(c);
+}
+
+static int
+conn_serve_stats(struct conn *c)
+{
+    size_t len;
+    char *body = stats_report(&len);
+    conn_reserve(c, MAXBUF + len);
+    c->outlen = request_format_static(c->out, "stats.txt", len, c->keep_alive);
+    memcpy(c->out + c->outlen, body, len);
+    c->outlen += len;
+    free(body);
+    return conn_respond(c);
+}
+
+// Frames the CGI program's output, which is in out, and starts sending it.
+// Returns 1 if it went out at once and the connection is open for the next
+// request.
+static int
+conn_respond_cgi(struct conn *c)
+{
+    // As in request_serve_dynamic(), the program writes the rest of the
+    // header, behind the part the server puts in front of it
+    char hdr[MAXBUF];
+    int hlen = request_format_dynamic(hdr, c->out, c->outlen, &c->keep_alive);
+    conn_reserve(c, hlen);
+    memmove(c->out + hlen, c->out, c->outlen);
+    memcpy(c->out, hdr, hlen);
+    c->outlen += hlen;
+    return conn_respond(c);
+}
+
+// Takes the output of a CGI program out of the cache entry
+static int
+conn_respond_cached(struct conn *c)
+{
+    conn_reserve(c, c->cgi->len);
+    memcpy(c->out, c->cgi->out, c->cgi->len);
+    c->outlen = c->cgi->len;
+    cgicache_put(c->cgi);
+    c->cgi = NULL;
+    return conn_respond_cgi(c);
+}
+
+// Runs the CGI program with its output going to a pipe, which the event loop
+// drains into the response as the program writes it. With the CGI cache on,
+// the output may be ready already, or the connection may wait for another
+// run of the program to finish. Returns 1 if the response went out at once
+// and the connection is open for the next request.
+static int
+conn_serve_dynamic(struct conn *c, char *filename, char *cgiargs)
+{
+    c->cgi_run = 1;
+    c->cgi = cgicache_get(filename, cgiargs, &c->cgi_run);
+    if (c->cgi && !c->cgi_run && __atomic_load_n(&c->cgi->ready, __ATOMIC_ACQUIRE)) {
+        return conn_respond_cached(c);
+    }
+
+    if (c->cgi_run) {
+        int fds[2];
+        int rc = pipe2(fds, O_CLOEXEC | O_NONBLOCK);
+        assert(rc == 0);
+
+        cgi_spawn(filename, cgiargs, fds[1]);
+        close_or_die(fds[1]);
+        c->pipe_fd = fds[0];
+    } else {
+        c->pipe_fd = cgicache_watch(c->cgi);
+    }
+
+    // Only the pipe is watched until the program is done, so that no single
+    // batch of events can refer to the connection twice
+    c->state = CONN_CGI;
+    conn_watch(c, 0);
+    epoll_add(c->loop->epfd, c->pipe_fd, EPOLLIN, &c->pipe);
+    return 0;
+}
+
+// Drains the CGI program's output, or takes it from the cache once another
+// run has finished. Returns 1 once the response has gone out and the
+// connection is open for the next request.
+static int
+conn_read_cgi(struct conn *c)
+{
+    while (c->cgi_run) {
+        conn_reserve(c, MAXBUF);
+        ssize_t n = read(c->pipe_fd, c->out + c->outlen, c->outcap - c->outlen);
+        if (n > 0) {
+            c->outlen += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return 0;
+        }
+        break;
+    }
+
+    // The program is done; SIGCHLD is ignored, so it needs no reaping
+    epoll_del(c->loop->epfd, c->pipe_fd);
+    close_or_die(c->pipe_fd);
+    c->pipe_fd = -1;
+    c->state = CONN_WRITING;
+
+    if (!c->cgi_run) {
+        return conn_respond_cached(c);
+    }
+    if (c->cgi) {
+        cgicache_fill(c->cgi, c->out, c->outlen);
+        cgicache_put(c->cgi);
+        c->cgi = NULL;
+    }
+    return conn_respond_cgi(c);
+}
+
+// Sets up the response to the request the parser has found at the start of
+// the input, len bytes long, or to a malformed one for -1, and takes it out
+// of the buffer. Returns 1 if the response went out at once and the
+// connection is open for the next request.
+static int
+conn_request(struct conn *c, ssize_t len)
+{
+    char filename[MAXBUF], cgiargs[MAXBUF];
+    struct http_request *h = &c->http;
+    struct stat sbuf;
+    int errlen;
+
+    conn_answer(c);
+    if (len > 0) {
+        log_printf("method:%.*s uri:%.*s version:%.*s\n", (int)h->method.len, h->method.p,
+            (int)h->target.len, h->target.p, (int)h->version.len, h->version.p);
+    }
+
+    // As in request_read(), a body or a malformed request ends the
+    // connection
+    c->keep_alive = len > 0 && h->keep_alive && !h->has_body
+        && ++c->nrequests < request_keepalive_max;
+
+    conn_reserve(c, MAXBUF);
+    int is_static = request_resolve(h, filename, cgiargs, &sbuf, c->out, &errlen,
+        c->keep_alive);
+
+    // Pipelined requests stay behind for when this one is answered
+    if (len > 0) {
+        c->inlen -= len;
+        memmove(c->in, c->in + len, c->inlen);
+        http_init(h, MAXBUF);
+    }
+
+    if (is_static < 0) {
+        c->outlen = errlen;
+        return conn_respond(c);
+    } else if (is_static == REQUEST_STATS) {
+        return conn_serve_stats(c);
+    } else if (is_static) {
+        c->kind = STATS_STATIC;
+        return conn_serve_static(c, filename, &sbuf);
+    } else {
+        c->kind = STATS_DYNAMIC;
+        return conn_serve_dynamic(c, filename, cgiargs);
+    }
+}
+
+// Answers the requests already in the input buffer, one after another for as
+// long as each answer goes out at once. Returns 1 if the connection is left
+// waiting for more input.
+static int
+conn_process(struct conn *c)
+{
+    while (1) {
+        // The parser carries on from where it stopped the last time, so each
+        // byte is looked at once however the request was split up
+        ssize_t len = http_parse(&c->http, c->in, c->inlen);
+        if (len == 0) {
+            return 1;
+        }
+        if (!conn_request(c, len)) {
+            return 0;
+        }
+    }
+}
+
+static void
+conn_read(struct conn *c)
+{
+    while (1) {
+        // The parser refuses requests longer than MAXBUF before the buffer
+        // would have to grow past it
+        if (c->inlen == c->incap) {
+            c->incap *= 2;
+            c->in = realloc(c->in, c->incap);
+            assert(c->in != NULL);
+        }
+
+        ssize_t n = read(c->fd, c->in + c->inlen, c->incap - c->inlen);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            conn_close(c);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                return;
+            }
+            continue;
+        }
+
+        idle_unlink(c);
+        idle_link(c);
+
+        c->inlen += n;
+        if (!conn_process(c)) {
+            return;
+        }
+    }
+}
+
+static void
+loop_accept(struct loop *l)
+{
+    while (1) {
+        int fd = accept4(l->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            // EAGAIN once the backlog is drained, or another loop got there
+            // first. Out of descriptors or memory, the connection stays in
+            // the backlog, and the listening socket would wake the loop again
+            // at once, so the loop stops watching it until a connection
+            // closes or a little while has passed.
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                epoll_del(l->epfd, l->listen_fd);
+                l->accept_resume_ms = now_ms() + ACCEPT_BACKOFF_MS;
+            }
+            return;
+        }
+
+        // As in request_init(), answers to pipelined requests go out
+        // without waiting for acks
+        int one = 1;
+        setsockopt_or_die(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct conn *c = malloc_or_die(sizeof(*c));
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->loop = l;
+        c->state = CONN_READING;
+        c->sock.type = SRC_SOCKET;
+        c->sock.conn = c;
+        c->pipe.type = SRC_PIPE;
+        c->pipe.conn = c;
+        c->pipe_fd = -1;
+        c->body_fd = -1;
+        c->incap = INBUF_MIN;
+        c->in = malloc_or_die(c->incap);
+        http_init(&c->http, MAXBUF);
+        idle_link(c);
+        conn_watch(c, EPOLLIN);
+    }
+}
+
+// Closes the connections that have waited longer than the keep-alive timeout
+// for a request, and goes back to accepting once it is time. Returns how long
+// epoll_wait() may sleep until the next of those is due, -1 for as long as it
+// takes.
+static int
+loop_expire(struct loop *l)
+{
+    uint64_t now = now_ms();
+    int timeout = -1;
+    if (request_keepalive_timeout > 0) {
+        uint64_t timeout_ms = (uint64_t)request_keepalive_timeout * 1000;
+        while (l->idle_head && l->idle_head->last_ms + timeout_ms <= now) {
+            conn_close(l->idle_head);
+        }
+        if (l->idle_head) {
+            timeout = l->idle_head->last_ms + timeout_ms - now;
+        }
+    }
+
+    if (l->accept_resume_ms && l->accept_resume_ms <= now) {
+        loop_resume_accept(l);
+    } else if (l->accept_resume_ms) {
+        int wait = l->accept_resume_ms - now;
+        timeout = timeout < 0 || wait < timeout ? wait : timeout;
+    }
+    return timeout;
+}
+
+static void *
+loop_run(void *arg)
+{
+    struct loop l = { 0 };
+    l.listen_fd = *(int *)arg;
+    l.epfd = epoll_create1(EPOLL_CLOEXEC);
+    assert(l.epfd >= 0);
+
+    // Every loop waits on the listening socket; EPOLLEXCLUSIVE wakes just
+    // one of them per incoming connection
+    epoll_add(l.epfd, l.listen_fd, EPOLLIN | EPOLLEXCLUSIVE, &listener);
+
+    stats_thread("loop %d", __atomic_fetch_add(&nloops_started, 1, __ATOMIC_RELAXED));
+    struct epoll_event events[MAXEVENTS];
+    while (1) {
+        int timeout = loop_expire(&l);
+        stats_idle();
+        int n = epoll_wait(l.epfd, events, MAXEVENTS, timeout);
+        stats_busy();
+        if (n < 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct source *src = events[i].data.ptr;
+            struct conn *c = src->conn;
+            if (src == &listener) {
+                loop_accept(&l);
+            } else if (src->type == SRC_PIPE) {
+                if (conn_read_cgi(c)) {
+                    conn_process(c);
+                }
+            } else if (c->state == CONN_READING) {
+                conn_read(c);
+            } else if (c->state == CONN_WRITING) {
+                // Requests that came in pipelined behind this one are
+                // answered next
+                if (conn_send(c) && conn_finish(c)) {
+                    conn_process(c);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+//
+// Serves connections on listen_fd with nloops event loops, each in a thread of
+// its own. Does not return.
+//
+void
+event_serve(int listen_fd, int nloops)
+{
+    // Many idle connections need many descriptors
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // Clients going away mid-response are noticed through send() errors,
+    // and CGI programs are reaped by the kernel
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+
+    int flags = fcntl(listen_fd, F_GETFL);
+    assert(flags >= 0);
+    int rc = fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+    assert(rc == 0);
+
+    pthread_t *threads = malloc_or_die(nloops * sizeof(pthread_t));
+    for (int i = 0; i < nloops; i++) {
+        if (pthread_create(&threads[i], NULL, loop_run, &listen_fd)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nloops; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
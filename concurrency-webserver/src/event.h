@@ -0,0 +1,6 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_serve(int listen_fd, int nloops);
+
+#endif // __EVENT_H__
@@ -0,0 +1,49 @@
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+
+// Latency histograms over values in microseconds: exact up to 2 * HIST_SUB,
+// and above that in HIST_SUB buckets for each power of two, each within
+// about 3% of the values it holds
+#define HIST_BITS 5
+#define HIST_SUB (1 << HIST_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+static inline int
+hist_bucket(uint64_t v)
+{
+    if (v < 2 * HIST_SUB) {
+        return v;
+    }
+    int shift = 63 - __builtin_clzll(v) - HIST_BITS;
+    return shift * HIST_SUB + (v >> shift);
+}
+
+// The largest value the bucket holds, which is what is reported for it
+static inline uint64_t
+hist_value(int i)
+{
+    if (i < 2 * HIST_SUB) {
+        return i;
+    }
+    int shift = i / HIST_SUB - 1;
+    return ((uint64_t)(i - shift * HIST_SUB + 1) << shift) - 1;
+}
+
+// The value below which pct percent of the n values counted fall
+static inline uint64_t
+hist_percentile(uint64_t *counts, uint64_t n, double pct)
+{
+    uint64_t want = n * pct / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > want) {
+            return hist_value(i);
+        }
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+#endif // __HIST_H__
@@ -0,0 +1,443 @@
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+
+// The parser takes a request a byte at a time, as far as its input goes,
+// and picks up where it left off once more has been read. It never copies:
+// what it finds is kept as slices of the input, which the caller's buffer
+// must hold until the request has been answered.
+enum {
+    S_START,                // skipping empty lines before the request
+    S_METHOD,
+    S_PATH,
+    S_QUERY,
+    S_VERSION,
+    S_EOL,                  // at the '\r' or '\n' ending a line
+    S_LF,                   // past the '\r', at the '\n'
+    S_HEADER,               // at the start of a header line, or the empty one
+    S_NAME,
+    S_SPACE,                // between the ':' and the value
+    S_VALUE,
+    S_DONE,
+    S_ERROR,
+};
+
+// Characters of methods and header names
+static const char token[256] = {
+    ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1,
+    ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1,
+    ['~'] = 1,
+};
+
+// Characters of the target: the visible ones
+static inline int
+target_char(unsigned char c)
+{
+    return c > ' ' && c < 0x7f;
+}
+
+// Characters of header values: anything but the control characters
+static inline int
+value_char(unsigned char c)
+{
+    return (c >= ' ' && c != 0x7f) || c == '\t';
+}
+
+// The target and header values make up most of a request, and are scanned
+// eight bytes at a time. These flag the bytes of x that are below n, above
+// n or equal to it: a flag can be wrong only above a right one, so the
+// lowest flag always marks the first such byte.
+#define ONES 0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+
+// Macros rather than functions, as the server is built without optimization
+#define any_below(x, n) (((x) - ONES * (n)) & ~(x) & HIGHS)
+#define any_above(x, n) ((((x) + ONES * (127 - (n))) | (x)) & HIGHS)
+#define any_equal(x, n) any_below((x) ^ (ONES * (n)), 1)
+
+// Loads the eight bytes at p with the first of them lowest
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define load(p) ({ uint64_t x_; memcpy(&x_, (p), 8); __builtin_bswap64(x_); })
+#else
+#define load(p) ({ uint64_t x_; memcpy(&x_, (p), 8); x_; })
+#endif
+
+// Returns the end of the run of target characters at i, before a '?' too
+// for the path
+static size_t
+skip_target(const char *buf, size_t i, size_t len, int path)
+{
+    while (i + 8 <= len) {
+        uint64_t x = load(buf + i);
+        uint64_t stop = any_below(x, '!') | any_above(x, 0x7e) | (path ? any_equal(x, '?') : 0);
+        if (stop) {
+            return i + __builtin_ctzll(stop) / 8;
+        }
+        i += 8;
+    }
+    while (i < len && target_char(buf[i]) && !(path && buf[i] == '?')) {
+        i++;
+    }
+    return i;
+}
+
+// Returns the end of the run of value characters at i
+static size_t
+skip_value(const char *buf, size_t i, size_t len)
+{
+    while (i + 8 <= len) {
+        uint64_t x = load(buf + i);
+        uint64_t stop = any_below(x, ' ') | any_equal(x, 0x7f);
+        if (stop) {
+            // Tabs are the only control characters values may hold
+            i += __builtin_ctzll(stop) / 8;
+            if (buf[i] != '\t') {
+                return i;
+            }
+            i++;
+            continue;
+        }
+        i += 8;
+    }
+    while (i < len && value_char(buf[i])) {
+        i++;
+    }
+    return i;
+}
+
+static struct http_slice
+slice(const char *buf, size_t from, size_t to)
+{
+    return (struct http_slice){ buf + from, to - from };
+}
+
+// The caller may have moved the input since the last call, to make room
+// for more of it; the old buffer may be gone, so only its address is used
+static void
+move_slice(struct http_slice *s, const char *from, const char *to)
+{
+    if (s->p) {
+        s->p = to + ((uintptr_t)s->p - (uintptr_t)from);
+    }
+}
+
+static void
+move(struct http_request *r, const char *to)
+{
+    move_slice(&r->method, r->base, to);
+    move_slice(&r->target, r->base, to);
+    move_slice(&r->path, r->base, to);
+    move_slice(&r->query, r->base, to);
+    move_slice(&r->version, r->base, to);
+    for (int i = 0; i < r->nheaders; i++) {
+        move_slice(&r->headers[i].name, r->base, to);
+        move_slice(&r->headers[i].value, r->base, to);
+    }
+}
+
+static ssize_t
+fail(struct http_request *r, int status, const char *error)
+{
+    r->state = S_ERROR;
+    r->status = status;
+    r->error = error;
+    return -1;
+}
+
+//
+// Returns whether s is str, ignoring case
+//
+int
+http_slice_is(struct http_slice s, const char *str)
+{
+    return strlen(str) == s.len && strncasecmp(s.p, str, s.len) == 0;
+}
+
+// Returns whether s holds str anywhere, ignoring case
+static int
+slice_has(struct http_slice s, const char *str)
+{
+    size_t n = strlen(str);
+    for (size_t i = 0; i + n <= s.len; i++) {
+        if (strncasecmp(s.p + i, str, n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Takes note of the headers that decide whether the connection can carry
+// another request. Returns -1 if the header is malformed.
+static int
+header(struct http_request *r, struct http_header *h)
+{
+    // None of the others is as long as one of these
+    if (h->name.len != 10 && h->name.len != 14 && h->name.len != 17) {
+        return 0;
+    }
+    if (http_slice_is(h->name, "Connection")) {
+        if (slice_has(h->value, "close")) {
+            r->keep_alive = 0;
+        } else if (slice_has(h->value, "keep-alive")) {
+            r->keep_alive = 1;
+        }
+    } else if (http_slice_is(h->name, "Content-Length")) {
+        if (h->value.len == 0) {
+            return fail(r, 400, "Content-Length is not a number");
+        }
+        for (size_t i = 0; i < h->value.len; i++) {
+            char c = h->value.p[i];
+            if (c < '0' || c > '9') {
+                return fail(r, 400, "Content-Length is not a number");
+            }
+            if (c != '0') {
+                r->has_body = 1;
+            }
+        }
+    } else if (http_slice_is(h->name, "Transfer-Encoding")) {
+        r->has_body = 1;
+    }
+    return 0;
+}
+
+//
+// Readies r for the next request, which may be up to max bytes long
+//
+void
+http_init(struct http_request *r, size_t max)
+{
+    memset(r, 0, offsetof(struct http_request, headers));
+    r->state = S_START;
+    r->max = max;
+}
+
+//
+// Parses the request at the start of buf, of which len bytes have been read
+// so far. buf must start where it did in the previous call, but may have
+// moved. Returns the length of the request once it is complete, including
+// any empty lines in front of it, with its parts filled in, 0 while more of
+// it is needed, or -1 if it is malformed or too long, with r->status and
+// r->error saying why.
+//
+ssize_t
+http_parse(struct http_request *r, const char *buf, size_t len)
+{
+    if (r->state == S_DONE) {
+        return r->pos;
+    }
+    if (r->state == S_ERROR) {
+        return -1;
+    }
+    if (r->base != buf) {
+        if (r->base) {
+            move(r, buf);
+        }
+        r->base = buf;
+    }
+    // Nothing beyond max is looked at
+    if (len > r->max) {
+        len = r->max;
+    }
+
+    size_t i = r->pos;
+    while (i < len) {
+        unsigned char c = buf[i];
+        switch (r->state) {
+        case S_START:
+            if (c == '\r' || c == '\n') {
+                i++;
+                continue;
+            }
+            r->mark = i;
+            r->state = S_METHOD;
+            continue;
+
+        case S_METHOD:
+            while (i < len && token[(unsigned char)buf[i]]) {
+                i++;
+            }
+            if (i == len) {
+                continue;
+            }
+            if (buf[i] != ' ' || i == r->mark) {
+                return fail(r, 400, "the request line is malformed");
+            }
+            r->method = slice(buf, r->mark, i);
+            r->mark = ++i;
+            r->state = S_PATH;
+            continue;
+
+        case S_PATH:
+            if (i == r->mark && c != '/') {
+                return fail(r, 400, "the request target is not a path");
+            }
+            i = skip_target(buf, i, len, 1);
+            if (i == len) {
+                continue;
+            }
+            r->path = slice(buf, r->mark, i);
+            if (buf[i] == '?') {
+                r->mark = ++i;
+                r->state = S_QUERY;
+                continue;
+            }
+            r->mark = i;
+            r->state = S_QUERY;
+            continue;
+
+        case S_QUERY:
+            i = skip_target(buf, i, len, 0);
+            if (i == len) {
+                continue;
+            }
+            if (buf[i] != ' ') {
+                return fail(r, 400, "the request target is malformed");
+            }
+            r->query = slice(buf, r->mark, i);
+            r->target = (struct http_slice){ r->path.p, buf + i - r->path.p };
+            r->mark = ++i;
+            r->state = S_VERSION;
+            continue;
+
+        case S_VERSION:
+            while (i < len && buf[i] != '\r' && buf[i] != '\n') {
+                if (++i - r->mark > 8) {
+                    return fail(r, 400, "the HTTP version is malformed");
+                }
+            }
+            if (i == len) {
+                continue;
+            }
+            const char *v = buf + r->mark;
+            if (i - r->mark != 8 || memcmp(v, "HTTP/", 5) != 0 || v[5] < '0' || v[5] > '9'
+                || v[6] != '.' || v[7] < '0' || v[7] > '9') {
+                return fail(r, 400, "the HTTP version is malformed");
+            }
+            if (v[5] != '1') {
+                return fail(r, 505, "only HTTP/1.x is supported");
+            }
+            r->version = slice(buf, r->mark, i);
+            r->minor = v[7] - '0';
+            r->keep_alive = r->minor >= 1;
+            r->after_lf = S_HEADER;
+            r->state = S_EOL;
+            continue;
+
+        case S_HEADER:
+            if (c == '\r' || c == '\n') {
+                r->after_lf = S_DONE;
+                r->state = S_EOL;
+                continue;
+            }
+            if (c == ' ' || c == '\t') {
+                return fail(r, 400, "folded header lines are not supported");
+            }
+            if (r->nheaders == HTTP_MAX_HEADERS) {
+                return fail(r, 431, "the request has too many header lines");
+            }
+            r->mark = i;
+            r->state = S_NAME;
+            // A header line usually comes whole, and is taken in one go
+            // fall through
+        case S_NAME:
+            while (i + 4 <= len && token[(unsigned char)buf[i]] && token[(unsigned char)buf[i + 1]]
+                && token[(unsigned char)buf[i + 2]] && token[(unsigned char)buf[i + 3]]) {
+                i += 4;
+            }
+            while (i < len && token[(unsigned char)buf[i]]) {
+                i++;
+            }
+            if (i == len) {
+                continue;
+            }
+            if (buf[i] != ':' || i == r->mark) {
+                return fail(r, 400, "a header line is malformed");
+            }
+            r->headers[r->nheaders].name = slice(buf, r->mark, i);
+            r->headers[r->nheaders].value = (struct http_slice){ NULL, 0 };
+            r->nheaders++;
+            i++;
+            r->state = S_SPACE;
+            // fall through
+        case S_SPACE:
+            while (i < len && (buf[i] == ' ' || buf[i] == '\t')) {
+                i++;
+            }
+            if (i == len) {
+                continue;
+            }
+            r->mark = i;
+            r->state = S_VALUE;
+            // fall through
+        case S_VALUE:
+            i = skip_value(buf, i, len);
+            if (i == len) {
+                continue;
+            }
+            if (buf[i] != '\r' && buf[i] != '\n') {
+                return fail(r, 400, "a header value holds a control character");
+            }
+            size_t end = i;
+            while (end > r->mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t')) {
+                end--;
+            }
+            struct http_header *h = &r->headers[r->nheaders - 1];
+            h->value = slice(buf, r->mark, end);
+            if (header(r, h) < 0) {
+                return -1;
+            }
+            r->after_lf = S_HEADER;
+            r->state = S_EOL;
+            // fall through
+        case S_EOL:
+            if (buf[i] == '\r' && ++i == len) {
+                r->state = S_LF;
+                continue;
+            }
+            // fall through
+        case S_LF:
+            if (buf[i] != '\n') {
+                return fail(r, 400, "a line ends in a bare carriage return");
+            }
+            i++;
+            r->state = r->after_lf;
+            if (r->state == S_DONE) {
+                r->pos = i;
+                return i;
+            }
+            continue;
+        }
+    }
+    r->pos = i;
+
+    if (i == r->max) {
+        if (r->state == S_METHOD || r->state == S_PATH || r->state == S_QUERY) {
+            return fail(r, 414, "the request line is too long");
+        }
+        return fail(r, 431, "the request header is too long");
+    }
+    return 0;
+}
+
+//
+// Returns the reason phrase for a status the parser refuses requests with
+//
+const char *
+http_reason(int status)
+{
+    switch (status) {
+    case 400:
+        return "Bad Request";
+    case 414:
+        return "URI Too Long";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 505:
+        return "HTTP Version Not Supported";
+    default:
+        return "Error";
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Header lines kept per request, more are refused
+#define HTTP_MAX_HEADERS 32
+
+// Bytes of a connection's input, which the parser points into rather than
+// copies out of
+struct http_slice {
+    const char *p;
+    size_t len;
+};
+
+struct http_header {
+    struct http_slice name;
+    struct http_slice value;
+};
+
+// A request as the parser finds it, which may take several calls as more of
+// it arrives
+struct http_request {
+    struct http_slice method;
+    struct http_slice target;   // the path and query, as sent
+    struct http_slice path;
+    struct http_slice query;    // after the '?', empty if there is none
+    struct http_slice version;
+    int minor;                  // of HTTP/1.x
+    int nheaders;
+    int keep_alive;             // after the version and Connection header
+    int has_body;               // a body follows, which the server does not read
+
+    // Why the request was refused
+    int status;
+    const char *error;
+
+    // Where the parser got to: bytes looked at, the start of the token
+    // being read, how far it may look, and the buffer the slices point into
+    int state;
+    int after_lf;               // the state to go to once a line has ended
+    size_t pos;
+    size_t mark;
+    size_t max;
+    const char *base;
+
+    // Last, as only the first nheaders are ever looked at
+    struct http_header headers[HTTP_MAX_HEADERS];
+};
+
+void http_init(struct http_request *r, size_t max);
+ssize_t http_parse(struct http_request *r, const char *buf, size_t len);
+int http_slice_is(struct http_slice s, const char *str);
+const char *http_reason(int status);
+
+#endif // __HTTP_H__
@@ -1,29 +1,110 @@
 #include "io_helper.h"
 
-ssize_t readline(int fd, void *buf, size_t maxlen) {
-    char c;
+void rio_init(rio_t *rp, int fd) {
+    rp->fd = fd;
+    rp->bufp = rp->buf;
+    rp->cnt = 0;
+}
+
+// refills the buffer if it is empty; returns the number of unread bytes,
+// 0 at EOF or -1 on error
+static ssize_t rio_fill(rio_t *rp) {
+    while (rp->cnt <= 0) {
+	rp->cnt = read(rp->fd, rp->buf, sizeof(rp->buf));
+	if (rp->cnt < 0) {
+	    if (errno != EINTR)
+		return -1;
+	} else if (rp->cnt == 0) {
+	    return 0;
+	} else {
+	    rp->bufp = rp->buf;
+	}
+    }
+    return rp->cnt;
+}
+
+//
+// Reads a line of at most maxlen - 1 bytes, including the '\n', into buf
+// and terminates it with '\0'. Returns its length, 0 at EOF or -1 on error.
+//
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen) {
     char *bufp = buf;
-    int n;
-    for (n = 0; n < maxlen - 1; n++) { // leave room at end for '\0'
-	int rc;
-        if ((rc = read_or_die(fd, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
-            }
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
+    size_t n = 0;
+    while (n < maxlen - 1) {
+	ssize_t rc = rio_fill(rp);
+	if (rc < 0)
+	    return -1;
+	if (rc == 0)
+	    break;    /* EOF */
+	
+	// copy up to and including the newline straight out of the buffer
+	size_t len = maxlen - 1 - n;
+	if (len > rc)
+	    len = rc;
+	char *nl = memchr(rp->bufp, '\n', len);
+	if (nl != NULL)
+	    len = nl - rp->bufp + 1;
+	memcpy(bufp + n, rp->bufp, len);
+	rp->bufp += len;
+	rp->cnt -= len;
+	n += len;
+	if (nl != NULL)
+	    break;
+    }
+    bufp[n] = '\0';
+    return n;
+}
+
+//
+// Reads up to n bytes into buf, taking whatever is buffered first. Returns
+// the number of bytes read, 0 at EOF or -1 on error.
+//
+ssize_t rio_read(rio_t *rp, void *buf, size_t n) {
+    if (rp->cnt <= 0 && n >= sizeof(rp->buf)) {
+	// nothing buffered and a large read: skip the copy
+	ssize_t rc;
+	while ((rc = read(rp->fd, buf, n)) < 0 && errno == EINTR)
+	    ;
+	return rc;
     }
-    *bufp = '\0';
+    ssize_t rc = rio_fill(rp);
+    if (rc <= 0)
+	return rc;
+    if (n > rc)
+	n = rc;
+    memcpy(buf, rp->bufp, n);
+    rp->bufp += n;
+    rp->cnt -= n;
     return n;
 }
 
+//
+// Reads more after the unread bytes, moving them to the front of the buffer
+// first, for callers that look at them in place. Returns the number of bytes
+// read, 0 at EOF or if the buffer is full, or -1 on error.
+//
+ssize_t rio_more(rio_t *rp) {
+    if (rp->bufp != rp->buf) {
+	memmove(rp->buf, rp->bufp, rp->cnt);
+	rp->bufp = rp->buf;
+    }
+    if (rp->cnt == sizeof(rp->buf))
+	return 0;
+    ssize_t rc;
+    while ((rc = read(rp->fd, rp->buf + rp->cnt, sizeof(rp->buf) - rp->cnt)) < 0 && errno == EINTR)
+	;
+    if (rc > 0)
+	rp->cnt += rc;
+    return rc;
+}
+
+//
+// Takes n of the unread bytes, which the caller has looked at in place
+//
+void rio_consume(rio_t *rp, size_t n) {
+    rp->bufp += n;
+    rp->cnt -= n;
+}
 
 int open_client_fd(char *hostname, int port) {
     int client_fd;
@@ -48,7 +129,11 @@ int open_client_fd(char *hostname, int port) {
     return client_fd;
 }
 
-int open_listen_fd(int port) {
+//
+// With reuseport set, other sockets may bind to the same port if they set it
+// too, and the kernel spreads new connections across all of them
+//
+int open_listen_fd(int port, int reuseport) {
     // Create a socket descriptor 
     int listen_fd;
     if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -62,6 +147,10 @@ int open_listen_fd(int port) {
 	fprintf(stderr, "setsockopt() failed\n");
 	return -1;
     }
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int)) < 0) {
+	fprintf(stderr, "setsockopt() failed\n");
+	return -1;
+    }
     
     // Listen_fd will be an endpoint for all requests to port on any IP address for this host
     struct sockaddr_in server_addr;
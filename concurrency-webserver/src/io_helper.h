@@ -83,17 +83,36 @@ typedef struct sockaddr sockaddr_t;
 #define malloc_or_die(size) \
     ({ void *p = malloc(size); assert(p != NULL); p; })
 
+// buffered reader: reads from fd a buffer at a time, so that reading a
+// request or response line by line costs a system call per buffer rather
+// than per byte. Use one per connection and read only through it once
+// started, since it may hold bytes beyond the line just returned.
+#define RIO_BUFSIZE (8192)
+typedef struct {
+    int fd;
+    char *bufp;          // next unread byte in buf
+    ssize_t cnt;         // number of unread bytes in buf
+    char buf[RIO_BUFSIZE];
+} rio_t;
+
+void rio_init(rio_t *rp, int fd);
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen);
+ssize_t rio_read(rio_t *rp, void *buf, size_t n);
+ssize_t rio_more(rio_t *rp);
+void rio_consume(rio_t *rp, size_t n);
+
 // client/server helper functions 
-ssize_t readline(int fd, void *buf, size_t maxlen);
 int open_client_fd(char *hostname, int portno);
-int open_listen_fd(int portno);
+int open_listen_fd(int portno, int reuseport);
 
 // wrappers for above
-#define readline_or_die(fd, buf, maxlen) \
-    ({ ssize_t rc = readline(fd, buf, maxlen); assert(rc >= 0); rc; })
+#define rio_readline_or_die(rp, buf, maxlen) \
+    ({ ssize_t rc = rio_readline(rp, buf, maxlen); assert(rc >= 0); rc; })
+#define rio_read_or_die(rp, buf, n) \
+    ({ ssize_t rc = rio_read(rp, buf, n); assert(rc >= 0); rc; })
 #define open_client_fd_or_die(hostname, port) \
     ({ int rc = open_client_fd(hostname, port); assert(rc >= 0); rc; })
-#define open_listen_fd_or_die(port) \
-    ({ int rc = open_listen_fd(port); assert(rc >= 0); rc; })
+#define open_listen_fd_or_die(port, reuseport) \
+    ({ int rc = open_listen_fd(port, reuseport); assert(rc >= 0); rc; })
 
 #endif // __IO_HELPER__
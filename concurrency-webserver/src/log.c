@@ -0,0 +1,152 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "io_helper.h"
+#include "log.h"
+
+// Bytes of log lines each thread can have waiting
+#define LOG_RING (64 * 1024)
+// The longest line, longer ones are cut short
+#define LOG_LINE 1024
+// How long the logger sleeps when it finds nothing to write
+#define LOG_IDLE_NS (10 * 1000 * 1000)
+
+// Each thread that logs gets a ring of its own, which only it adds to and
+// only the logger takes from, so adding a line takes no lock and never
+// waits on stdout. Lines from different threads come out in the order the
+// logger gets to them, which is not quite the order they were logged in.
+struct log_ring {
+    uint64_t head __attribute__((aligned(64)));     // bytes written out
+    uint64_t tail __attribute__((aligned(64)));     // bytes added
+    uint64_t dropped;
+    struct log_ring *next;
+    char buf[LOG_RING];
+};
+
+static __thread struct log_ring *my_ring;
+static struct log_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+// Held while writing out, by the logger or by log_flush()
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct log_ring *
+ring_get(void)
+{
+    if (my_ring == NULL) {
+        my_ring = aligned_alloc(64, sizeof(struct log_ring));
+        assert(my_ring != NULL);
+        memset(my_ring, 0, sizeof(*my_ring));
+        pthread_mutex_lock(&rings_lock);
+        my_ring->next = rings;
+        __atomic_store_n(&rings, my_ring, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&rings_lock);
+    }
+    return my_ring;
+}
+
+//
+// Logs a line for the logger thread to write to stdout. If the calling
+// thread has logged more than the logger has kept up with, the line is
+// dropped and counted instead.
+//
+void
+log_printf(const char *fmt, ...)
+{
+    char line[LOG_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    struct log_ring *r = ring_get();
+    uint64_t tail = r->tail;
+    if (tail + len - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > LOG_RING) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t at = tail % LOG_RING;
+    size_t first = len < LOG_RING - at ? len : LOG_RING - at;
+    memcpy(r->buf + at, line, first);
+    memcpy(r->buf, line + first, len - first);
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+}
+
+// Writes out what every ring holds. Returns the number of bytes written.
+static size_t
+drain(void)
+{
+    size_t total = 0;
+    pthread_mutex_lock(&drain_lock);
+    for (struct log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t head = r->head;
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            continue;
+        }
+        size_t at = head % LOG_RING;
+        size_t len = tail - head;
+        size_t first = len < LOG_RING - at ? len : LOG_RING - at;
+        fwrite(r->buf + at, 1, first, stdout);
+        fwrite(r->buf, 1, len - first, stdout);
+        __atomic_store_n(&r->head, tail, __ATOMIC_RELEASE);
+        total += len;
+    }
+    if (total) {
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return total;
+}
+
+static void *
+logger(void *arg)
+{
+    struct timespec idle = { 0, LOG_IDLE_NS };
+    while (1) {
+        if (drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+//
+// Starts the logger thread
+//
+void
+log_init(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, logger, NULL)) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+//
+// Writes out whatever has been logged so far, before the server exits
+//
+void
+log_flush(void)
+{
+    drain();
+}
+
+//
+// Returns the number of lines dropped for want of room
+//
+uint64_t
+log_dropped(void)
+{
+    uint64_t n = 0;
+    for (struct log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    return n;
+}
@@ -0,0 +1,11 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+
+void log_init(void);
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_flush(void);
+uint64_t log_dropped(void);
+
+#endif // __LOG_H__
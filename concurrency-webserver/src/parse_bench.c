@@ -0,0 +1,390 @@
+// Measures how fast requests are parsed, by wserver's parser and by the
+// line-by-line copying it replaced, and fuzzes the parser.
+//
+//     make bench
+//     ./parse_bench 1000000
+//     ./parse_bench -f 1000000 [seed]
+//
+// The benchmark parses a few typical requests the given number of times
+// each: whole, and as if they arrived a byte at a time. The fuzzer mutates
+// them at random and checks that the parser stays within its input and
+// finds the same request however the input is split up and moved between
+// calls. Built with -fsanitize=address,undefined it catches stray reads;
+// with -DLIBFUZZER and clang's -fsanitize=fuzzer it runs under libFuzzer.
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "http.h"
+
+#define MAXBUF 8192
+
+static const char *samples[] = {
+    // as wload and wclient send them
+    "GET /1k.bin HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "\r\n",
+
+    "GET /spin.cgi?1 HTTP/1.1\r\n"
+    "Host: localhost:10000\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+
+    // as a browser sends them
+    "GET /docs/index.html?lang=en&page=2 HTTP/1.1\r\n"
+    "Host: www.example.com:10000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://www.example.com:10000/docs/\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Priority: u=0, i\r\n"
+    "\r\n",
+};
+#define NSAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What request_read() did before the parser: copy each line out of the
+// reader's buffer, split the request line with sscanf(), look at each
+// header line, and copy the uri into the file name and arguments
+struct legacy {
+    char method[MAXBUF], uri[MAXBUF], version[MAXBUF];
+    // room for "." and "index.html" around the longest uri
+    char filename[MAXBUF + sizeof("index.html")], cgiargs[MAXBUF];
+    int keep_alive;
+};
+
+static size_t
+legacy_readline(const char **p, const char *end, char *buf)
+{
+    const char *nl = memchr(*p, '\n', end - *p);
+    size_t len = nl ? nl + 1 - *p : end - *p;
+    if (len > MAXBUF - 1) {
+        len = MAXBUF - 1;
+    }
+    memcpy(buf, *p, len);
+    buf[len] = '\0';
+    *p += len;
+    return len;
+}
+
+static void
+legacy_parse(struct legacy *l, const char *req, size_t len)
+{
+    char buf[MAXBUF];
+    const char *p = req, *end = req + len;
+
+    legacy_readline(&p, end, buf);
+    l->method[0] = l->uri[0] = l->version[0] = '\0';
+    sscanf(buf, "%s %s %s", l->method, l->uri, l->version);
+    l->keep_alive = strcasecmp(l->version, "HTTP/1.1") == 0;
+    while (legacy_readline(&p, end, buf) > 0 && strcmp(buf, "\r\n") != 0) {
+        if (strncasecmp(buf, "Connection:", 11) == 0) {
+            if (strcasestr(buf + 11, "close")) {
+                l->keep_alive = 0;
+            } else if (strcasestr(buf + 11, "keep-alive")) {
+                l->keep_alive = 1;
+            }
+        } else if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0) {
+            l->keep_alive = -1;
+        } else if (strncasecmp(buf, "Content-Length:", 15) == 0 && atoll(buf + 15) != 0) {
+            l->keep_alive = -1;
+        }
+    }
+
+    if (!strstr(l->uri, "cgi")) {
+        strcpy(l->cgiargs, "");
+        snprintf(l->filename, sizeof(l->filename), ".%s", l->uri);
+        if (l->uri[strlen(l->uri) - 1] == '/') {
+            strcat(l->filename, "index.html");
+        }
+    } else {
+        char *q = index(l->uri, '?');
+        if (q) {
+            strcpy(l->cgiargs, q + 1);
+            *q = '\0';
+        } else {
+            strcpy(l->cgiargs, "");
+        }
+        snprintf(l->filename, sizeof(l->filename), ".%s", l->uri);
+    }
+}
+
+// Keeps the compiler from optimizing the parsing away
+static volatile size_t sink;
+
+static void
+bench(long n)
+{
+    static struct legacy l;
+    struct http_request h;
+
+    for (int s = 0; s < NSAMPLES; s++) {
+        const char *req = samples[s];
+        size_t len = strlen(req);
+        int nl = 0;
+        for (size_t i = 0; i < len; i++) {
+            nl += req[i] == '\n';
+        }
+        printf("%zu bytes, %d lines:\n", len, nl);
+
+        double t = now();
+        for (long i = 0; i < n; i++) {
+            legacy_parse(&l, req, len);
+            sink += l.filename[1];
+        }
+        t = now() - t;
+        printf("  line by line     %12.0f parses/s\n", n / t);
+
+        t = now();
+        for (long i = 0; i < n; i++) {
+            http_init(&h, MAXBUF);
+            ssize_t rc = http_parse(&h, req, len);
+            assert(rc == len);
+            sink += h.path.len;
+        }
+        t = now() - t;
+        printf("  parser, whole    %12.0f parses/s\n", n / t);
+
+        // The parser is called once per byte, and picks up where it stopped
+        long m = n / 10 > 0 ? n / 10 : 1;
+        t = now();
+        for (long i = 0; i < m; i++) {
+            http_init(&h, MAXBUF);
+            ssize_t rc = 0;
+            for (size_t j = 1; j <= len && rc == 0; j++) {
+                rc = http_parse(&h, req, j);
+            }
+            assert(rc == len);
+            sink += h.path.len;
+        }
+        t = now() - t;
+        printf("  parser, by bytes %12.0f parses/s\n", m / t);
+    }
+}
+
+static uint64_t rng_state;
+
+static uint64_t
+rng(void)
+{
+    // xorshift64
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rng_state = x;
+}
+
+// Returns the offset of s into buf, for slices of different buffers to be
+// compared, or -1 for a slice that was never set
+static long
+offset(struct http_slice s, const char *buf, size_t len)
+{
+    if (s.p == NULL) {
+        return -1;
+    }
+    assert(s.p >= buf && s.p + s.len <= buf + len);
+    return s.p - buf;
+}
+
+static void
+check_same(struct http_slice a, const char *abuf, struct http_slice b, const char *bbuf,
+    size_t len)
+{
+    assert(offset(a, abuf, len) == offset(b, bbuf, len));
+    assert(a.len == b.len);
+}
+
+//
+// Parses data whole, then again in pieces, each in a buffer of its own as
+// if the connection's had grown, and checks that both come to the same
+//
+static void
+fuzz_one(const uint8_t *data, size_t len, size_t max, uint64_t seed)
+{
+    struct http_request whole, split;
+
+    // Exactly as long as the input, so that reading past it is caught
+    char *a = malloc(len ? len : 1);
+    memcpy(a, data, len);
+    http_init(&whole, max);
+    ssize_t rc = http_parse(&whole, a, len);
+    assert(rc >= -1 && rc <= (ssize_t)len && rc <= (ssize_t)max);
+    assert(rc != -1 || (whole.status >= 400 && whole.error != NULL));
+
+    rng_state = seed | 1;
+    http_init(&split, max);
+    char *b = NULL;
+    size_t have = 0;
+    ssize_t src = 0;
+    while (src == 0 && have < len) {
+        have += 1 + rng() % (len - have);
+        char *moved = malloc(have);
+        memcpy(moved, data, have);
+        free(b);
+        b = moved;
+        src = http_parse(&split, b, have);
+    }
+    assert(src == rc);
+    assert(split.status == whole.status);
+
+    if (rc > 0) {
+        check_same(whole.method, a, split.method, b, rc);
+        check_same(whole.target, a, split.target, b, rc);
+        check_same(whole.path, a, split.path, b, rc);
+        check_same(whole.query, a, split.query, b, rc);
+        check_same(whole.version, a, split.version, b, rc);
+        assert(whole.nheaders == split.nheaders);
+        for (int i = 0; i < whole.nheaders; i++) {
+            check_same(whole.headers[i].name, a, split.headers[i].name, b, rc);
+            check_same(whole.headers[i].value, a, split.headers[i].value, b, rc);
+        }
+        assert(whole.keep_alive == split.keep_alive && whole.has_body == split.has_body);
+
+        assert(whole.method.len > 0 && whole.path.len > 0 && whole.path.p[0] == '/');
+        assert(whole.target.p == whole.path.p);
+        assert(whole.version.len == 8 && memcmp(whole.version.p, "HTTP/1.", 7) == 0);
+        for (size_t i = 0; i < whole.target.len; i++) {
+            assert(whole.target.p[i] > ' ' && whole.target.p[i] < 0x7f);
+        }
+    }
+    free(a);
+    free(b);
+}
+
+#ifdef LIBFUZZER
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+    fuzz_one(data, len, MAXBUF, len * 0x9e3779b97f4a7c15ull);
+    return 0;
+}
+#else
+
+// Characters that mean something to the parser, for mutations to use more
+// often than the others
+static const char special[] = "\r\n :?/\t\0HTTP/1.1";
+
+static size_t
+mutate(uint8_t *buf, size_t len, size_t cap)
+{
+    int n = 1 + rng() % 4;
+    for (int k = 0; k < n; k++) {
+        size_t at = len ? rng() % len : 0;
+        switch (rng() % 6) {
+        case 0:
+            if (len) {
+                buf[at] = rng() % 2 ? special[rng() % (sizeof(special) - 1)] : rng();
+            }
+            break;
+        case 1:
+            if (len < cap) {
+                memmove(buf + at + 1, buf + at, len - at);
+                buf[at] = special[rng() % (sizeof(special) - 1)];
+                len++;
+            }
+            break;
+        case 2:
+            if (len) {
+                memmove(buf + at, buf + at + 1, len - at - 1);
+                len--;
+            }
+            break;
+        case 3: {
+            // repeat a stretch, which makes long lines and many headers
+            uint8_t stretch[256];
+            size_t from = len ? rng() % len : 0;
+            size_t n = len - from < sizeof(stretch) ? len - from : sizeof(stretch);
+            memcpy(stretch, buf + from, n);
+            size_t times = 1 + rng() % 64;
+            for (size_t t = 0; t < times && len + n <= cap; t++) {
+                memmove(buf + at + n, buf + at, len - at);
+                memcpy(buf + at, stretch, n);
+                len += n;
+            }
+            break;
+        }
+        case 4:
+            len = at;
+            break;
+        case 5:
+            if (len) {
+                buf[at] ^= 1 << (rng() % 8);
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+static void
+fuzz(long n, uint64_t seed)
+{
+    size_t cap = 4 * MAXBUF;
+    uint8_t *buf = malloc(cap);
+    long parsed = 0, refused = 0;
+
+    for (long i = 0; i < n; i++) {
+        rng_state = seed + i * 0x9e3779b97f4a7c15ull;
+        rng();
+        const char *s = samples[rng() % NSAMPLES];
+        size_t len = strlen(s);
+        memcpy(buf, s, len);
+        len = mutate(buf, len, cap);
+        // Small limits as well, to hit them on every kind of line
+        size_t max = rng() % 4 ? MAXBUF : 1 + rng() % 512;
+        uint64_t split = rng();
+
+        fuzz_one(buf, len, max, split);
+
+        struct http_request h;
+        http_init(&h, max);
+        ssize_t rc = http_parse(&h, (char *)buf, len);
+        parsed += rc > 0;
+        refused += rc < 0;
+    }
+    printf("%ld inputs: %ld parsed, %ld refused, %ld incomplete\n", n, parsed, refused,
+        n - parsed - refused);
+    free(buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+        uint64_t seed = argc > 3 ? strtoull(argv[3], NULL, 0) : time(NULL);
+        printf("seed %llu\n", (unsigned long long)seed);
+        fuzz(atol(argv[2]), seed);
+        return 0;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s iterations | -f iterations [seed]\n", argv[0]);
+        return 1;
+    }
+    bench(atol(argv[1]));
+    return 0;
+}
+#endif
@@ -1,35 +1,113 @@
 #include <assert.h>
+#include <strings.h>
 
 #include "io_helper.h"
 #include "queue.h"
 
+// Under SFF-AGING a request is worth this many bytes less than every request
+// that arrives after it, so a request for n bytes can be passed by at most
+// n / QUEUE_AGING_STEP later ones
+#define QUEUE_AGING_STEP (64 * 1024)
+
+static uint64_t
+fifo_key(struct queue_item *it)
+{
+    return 0;
+}
+
+static uint64_t
+sff_key(struct queue_item *it)
+{
+    return it->size;
+}
+
+static uint64_t
+sff_aging_key(struct queue_item *it)
+{
+    return it->size + it->seq * QUEUE_AGING_STEP;
+}
+
+static struct queue_policy policies[] = {
+    { "FIFO", false, fifo_key },
+    { "SFF", true, sff_key },
+    { "SFF-AGING", true, sff_aging_key },
+};
+
+//
+// Returns the policy called name, or NULL if there is none
+//
+struct queue_policy *
+queue_policy(char *name)
+{
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (!strcasecmp(policies[i].name, name)) {
+            return &policies[i];
+        }
+    }
+    return NULL;
+}
+
 void
-queue_init(struct queue *q, size_t size)
+queue_init(struct queue *q, size_t size, struct queue_policy *policy)
 {
-    q->data = malloc_or_die(size * sizeof(int));
-    q->read = 0;
-    q->write = 0;
+    q->policy = policy;
+    q->data = malloc_or_die(size * sizeof(struct queue_item));
     q->capacity = size;
     q->len = 0;
+    q->seq = 0;
+}
+
+static bool
+before(struct queue_item *a, struct queue_item *b)
+{
+    return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+static void
+swap(struct queue_item *a, struct queue_item *b)
+{
+    struct queue_item t = *a;
+    *a = *b;
+    *b = t;
 }
 
 void
-queue_push(struct queue *q, int v)
+queue_push(struct queue *q, struct queue_item *it)
 {
     assert(q->len < q->capacity);
-    q->data[q->write] = v;
-    q->write = (q->write + 1) % q->capacity;
-    q->len++;
+    it->seq = q->seq++;
+    it->key = q->policy->key(it);
+
+    size_t i = q->len++;
+    q->data[i] = *it;
+    while (i > 0 && before(&q->data[i], &q->data[(i - 1) / 2])) {
+        swap(&q->data[i], &q->data[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
 }
 
-int
-queue_pop(struct queue *q)
+void
+queue_pop(struct queue *q, struct queue_item *it)
 {
     assert(q->len > 0);
-    int v = q->data[q->read];
-    q->read = (q->read + 1) % q->capacity;
-    q->len--;
-    return v;
+    *it = q->data[0];
+    q->data[0] = q->data[--q->len];
+
+    size_t i = 0;
+    while (1) {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < q->len && before(&q->data[l], &q->data[min])) {
+            min = l;
+        }
+        if (r < q->len && before(&q->data[r], &q->data[min])) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        swap(&q->data[i], &q->data[min]);
+        i = min;
+    }
 }
 
 bool
@@ -37,3 +115,9 @@ queue_empty(struct queue *q)
 {
     return q->len == 0;
 }
+
+bool
+queue_full(struct queue *q)
+{
+    return q->len == q->capacity;
+}
@@ -1,15 +1,46 @@
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A connection waiting for a worker, with what is known about its first
+// request
+struct queue_item {
+    int fd;
+    off_t size;     // of the file asked for, if the policy needs it
+    void *arg;      // the request, once a worker has read it
+
+    // Filled in by the queue
+    uint64_t seq;
+    uint64_t key;
+};
+
+// A scheduling policy orders items by key, lowest first and oldest first
+// among equal keys
+struct queue_policy {
+    char *name;
+    // Whether each first request has to be read to fill in size before the
+    // connection is served
+    bool needs_size;
+    uint64_t (*key)(struct queue_item *it);
+};
 
 struct queue {
-    int *data;
-    size_t read;
-    size_t write;
+    struct queue_policy *policy;
+    struct queue_item *data;    // a binary min-heap
     size_t capacity;
     size_t len;
+    uint64_t seq;
 };
 
-void queue_init(struct queue *q, size_t size);
-void queue_push(struct queue *q, int v);
-int queue_pop(struct queue *q);
+struct queue_policy *queue_policy(char *name);
+void queue_init(struct queue *q, size_t size, struct queue_policy *policy);
+void queue_push(struct queue *q, struct queue_item *it);
+void queue_pop(struct queue *q, struct queue_item *it);
 bool queue_empty(struct queue *q);
+bool queue_full(struct queue *q);
+
+#endif // __QUEUE_H__
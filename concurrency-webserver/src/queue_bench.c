@@ -0,0 +1,168 @@
+// Measures how fast connections can be handed from one acceptor to a
+// number of workers, through a single queue under a mutex, as wserver does
+// for SFF, and through the per-worker rings it uses for FIFO.
+//
+//     make bench
+//     ./queue_bench 1000000 4 16 64
+//
+// The acceptor pushes the given number of items as fast as the queue takes
+// them, and each worker does a little busy work per item, so that the
+// numbers reflect the cost of the hand-off itself.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "io_helper.h"
+#include "queue.h"
+#include "steal.h"
+
+// Iterations of busy work per item
+#define WORK 200
+// Connections that can wait, as wserver's -b
+#define CAPACITY 64
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+static struct queue q;
+static bool stopping;
+
+static struct steal steal;
+
+struct worker {
+    int id;
+    long done;
+    pthread_t thread;
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+work(struct queue_item *it)
+{
+    volatile int x = it->fd;
+    for (int i = 0; i < WORK; i++) {
+        x = x * 31 + i;
+    }
+}
+
+static void *
+run_locked(void *arg)
+{
+    struct worker *w = arg;
+    while (1) {
+        struct queue_item it;
+        pthread_mutex_lock(&lock);
+        while (queue_empty(&q) && !stopping) {
+            pthread_cond_wait(&cv, &lock);
+        }
+        if (queue_empty(&q)) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        queue_pop(&q, &it);
+        pthread_cond_signal(&not_full);
+        pthread_mutex_unlock(&lock);
+        work(&it);
+        w->done++;
+    }
+    return NULL;
+}
+
+static void *
+run_stealing(void *arg)
+{
+    struct worker *w = arg;
+    struct queue_item it;
+    while (steal_pop(&steal, w->id, &it)) {
+        work(&it);
+        w->done++;
+    }
+    return NULL;
+}
+
+static double
+bench(long nitems, int nworkers, bool stealing)
+{
+    struct worker *workers = calloc(nworkers, sizeof(*workers));
+    assert(workers != NULL);
+    stopping = false;
+    if (stealing) {
+        steal_init(&steal, nworkers, CAPACITY);
+    } else {
+        queue_init(&q, CAPACITY, queue_policy("FIFO"));
+    }
+
+    double t0 = now();
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, stealing ? run_stealing : run_locked,
+                &workers[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for (long n = 0; n < nitems; n++) {
+        struct queue_item it = { .fd = n };
+        if (stealing) {
+            steal_push(&steal, &it, true);
+            continue;
+        }
+        pthread_mutex_lock(&lock);
+        while (queue_full(&q)) {
+            pthread_cond_wait(&not_full, &lock);
+        }
+        queue_push(&q, &it);
+        pthread_cond_signal(&cv);
+        pthread_mutex_unlock(&lock);
+    }
+
+    if (stealing) {
+        steal_stop(&steal);
+    } else {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_broadcast(&cv);
+        pthread_mutex_unlock(&lock);
+    }
+    long done = 0;
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        done += workers[i].done;
+    }
+    double t = now() - t0;
+
+    if (done != nitems) {
+        fprintf(stderr, "handed off %ld items but %ld were taken\n", nitems, done);
+        exit(1);
+    }
+    free(workers);
+    return t;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s nitems nworkers...\n", argv[0]);
+        return 1;
+    }
+
+    long nitems = atol(argv[1]);
+    for (int i = 2; i < argc; i++) {
+        int nworkers = atoi(argv[i]);
+        double locked = bench(nitems, nworkers, false);
+        double stealing = bench(nitems, nworkers, true);
+        printf("%3d workers: mutex queue %10.0f items/s, stealing %10.0f items/s\n",
+            nworkers, nitems / locked, nitems / stealing);
+    }
+
+    return 0;
+}
@@ -1,82 +1,112 @@
+#define _GNU_SOURCE
+
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+#include "cgi.h"
+#include "cgicache.h"
+#include "http.h"
 #include "io_helper.h"
+#include "log.h"
 #include "request.h"
+#include "stats.h"
 
 //
 // Some of this code stolen from Bryant/O'Halloran
 // Hopefully this is not a problem ... :)
 //
 
-#define MAXBUF (8192)
+int request_keepalive_timeout = 5;
+int request_keepalive_max = 100;
+
+static char *connection_header(int keep_alive) {
+    return keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
 
-void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
+//
+// Formats a complete error response into buf, which must hold MAXBUF bytes,
+// and returns its length
+//
+int request_format_error(char *buf, char *cause, char *errnum, char *shortmsg, char *longmsg,
+			 int keep_alive) {
+    char body[MAXBUF];
     
     // Create the body of error message first (have to know its length for header)
-    sprintf(body, ""
+    snprintf(body, MAXBUF, ""
 	    "<!doctype html>\r\n"
 	    "<head>\r\n"
 	    "  <title>OSTEP WebServer Error</title>\r\n"
 	    "</head>\r\n"
 	    "<body>\r\n"
 	    "  <h2>%s: %s</h2>\r\n" 
-	    "  <p>%s: %s</p>\r\n"
+	    "  <p>%s: %.1024s</p>\r\n"
 	    "</body>\r\n"
 	    "</html>\r\n", errnum, shortmsg, longmsg, cause);
     
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
+    return snprintf(buf, MAXBUF, ""
+	    "HTTP/1.1 %s %s\r\n"
+	    "%s"
+	    "Content-Type: text/html\r\n"
+	    "Content-Length: %lu\r\n\r\n"
+	    "%s", errnum, shortmsg, connection_header(keep_alive), strlen(body), body);
+}
+
+//
+// Sends len bytes of buf to the client on fd, passing flags on to send().
+// Returns the number that went out, which falls short of len if the client
+// has gone; the connection is then good for nothing more.
+//
+static size_t request_send(int fd, void *buf, size_t len, int flags) {
+    size_t sent = 0;
     
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
+    while (sent < len) {
+	ssize_t n = send(fd, (char *) buf + sent, len - sent, flags | MSG_NOSIGNAL);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	sent += n;
+    }
+    return sent;
 }
 
 //
-// Reads and discards everything up to an empty text line
+// Sends an error response, adding what the client took of it to *bytes.
+// Returns whether the connection can carry another response.
 //
-void request_read_headers(int fd) {
+static int request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg,
+			 int keep_alive, size_t *bytes) {
     char buf[MAXBUF];
     
-    readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n")) {
-	readline_or_die(fd, buf, MAXBUF);
-    }
-    return;
+    int len = request_format_error(buf, cause, errnum, shortmsg, longmsg, keep_alive);
+    size_t sent = request_send(fd, buf, len, 0);
+    *bytes += sent;
+    return sent == len && keep_alive;
 }
 
 //
-// Return 1 if static, 0 if dynamic content
-// Calculates filename (and cgiargs, for dynamic) from uri
+// Return 1 if static, 0 if dynamic content, or -1 if the path is too long
+// Calculates filename (and cgiargs, for dynamic) from the request's path
+// and query; a path with "cgi" in it names a program
 //
-int request_parse_uri(char *uri, char *filename, char *cgiargs) {
-    char *ptr;
+int request_parse_uri(struct http_request *h, char *filename, char *cgiargs) {
+    struct http_slice path = h->path;
+    int is_static = memmem(path.p, path.len, "cgi", 3) == NULL;
+    int n;
     
-    if (!strstr(uri, "cgi")) { 
+    if (is_static) { 
 	// static
-	strcpy(cgiargs, "");
-	sprintf(filename, ".%s", uri);
-	if (uri[strlen(uri)-1] == '/') {
-	    strcat(filename, "index.html");
-	}
-	return 1;
+	cgiargs[0] = '\0';
+	n = snprintf(filename, MAXBUF, ".%.*s%s", (int) path.len, path.p,
+		     path.p[path.len-1] == '/' ? "index.html" : "");
     } else { 
 	// dynamic
-	ptr = index(uri, '?');
-	if (ptr) {
-	    strcpy(cgiargs, ptr+1);
-	    *ptr = '\0';
-	} else {
-	    strcpy(cgiargs, "");
-	}
-	sprintf(filename, ".%s", uri);
-	return 0;
+	snprintf(cgiargs, MAXBUF, "%.*s", (int) h->query.len, h->query.p);
+	n = snprintf(filename, MAXBUF, ".%.*s", (int) path.len, path.p);
     }
+    return n < MAXBUF ? is_static : -1;
 }
 
 //
@@ -93,98 +123,424 @@ void request_get_filetype(char *filename, char *filetype) {
 	strcpy(filetype, "text/plain");
 }
 
-void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
-    char buf[MAXBUF], *argv[] = { NULL };
+//
+// Formats the part of the header the server puts in front of the output of a
+// CGI program, cgiout of len bytes, into buf, which must hold MAXBUF bytes,
+// and returns its length. The program writes the rest of the header itself;
+// if it leaves out Content-Length, one is added here so that the response is
+// framed without closing the connection. *keep_alive is cleared if the
+// output cannot be framed that way.
+//
+int request_format_dynamic(char *buf, char *cgiout, size_t len, int *keep_alive) {
+    char *p = cgiout, *end = cgiout + len, *nl;
+    long long length = -1;
     
-    // The server does only a little bit of the header.  
-    // The CGI script has to finish writing out the header.
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n");
+    // find the empty line ending the program's header, noting Content-Length
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+	if (nl == p || (nl == p + 1 && *p == '\r'))
+	    break;
+	if (nl - p > 15 && strncasecmp(p, "Content-Length:", 15) == 0)
+	    length = strtoll(p + 15, NULL, 10);
+	p = nl + 1;
+    }
+    
+    char clen[64] = "";
+    if (nl == NULL) {
+	*keep_alive = 0;
+    } else if (length < 0) {
+	snprintf(clen, sizeof(clen), "Content-Length: %lld\r\n", (long long) (end - nl - 1));
+    } else if (length != end - nl - 1) {
+	*keep_alive = 0;
+    }
+    
+    return snprintf(buf, MAXBUF, ""
+	    "HTTP/1.1 200 OK\r\n"
+	    "Server: OSTEP WebServer\r\n"
+	    "%s%s", connection_header(*keep_alive), clen);
+}
+
+//
+// Runs the CGI program filename and collects its output into a buffer of its
+// own, setting *len to its length
+//
+static char *request_run_dynamic(char *filename, char *cgiargs, size_t *len) {
+    int fds[2];
+    
+    // close-on-exec, so that programs other threads start do not hold the
+    // write end open and keep us from seeing the end of the output
+    int rc = pipe2(fds, O_CLOEXEC);
+    assert(rc == 0);
+    pid_t pid = cgi_spawn(filename, cgiargs, fds[1]);
+    close_or_die(fds[1]);
     
-    write_or_die(fd, buf, strlen(buf));
+    size_t cap = MAXBUF;
+    char *out = malloc_or_die(cap);
+    ssize_t n;
+    *len = 0;
+    while ((n = read(fds[0], out + *len, cap - *len)) != 0) {
+	if (n < 0) {
+	    assert(errno == EINTR);
+	    continue;
+	}
+	*len += n;
+	if (*len == cap) {
+	    cap *= 2;
+	    out = realloc(out, cap);
+	    assert(out != NULL);
+	}
+    }
+    close_or_die(fds[0]);
+    // reap our own child only; other threads wait for theirs, and runners
+    // reap the programs they start
+    if (pid > 0) {
+	pid_t child = waitpid(pid, NULL, 0);
+	assert(child == pid);
+    }
+    return out;
+}
+
+//
+// Sends the output of the CGI program filename, which is collected through a
+// pipe first so that it can be framed, adding what the client took of it to
+// *bytes. With the CGI cache on, the output may come from an earlier run, or
+// from one another thread has under way. Returns whether the connection can
+// carry another response.
+//
+int request_serve_dynamic(int fd, char *filename, char *cgiargs, int keep_alive, size_t *bytes) {
+    char buf[MAXBUF];
+    char *out;
+    size_t len;
+    int run = 1;
     
-    if (fork_or_die() == 0) {                        // child
-	setenv_or_die("QUERY_STRING", cgiargs, 1);   // args to cgi go here
-	dup2_or_die(fd, STDOUT_FILENO);              // make cgi writes go to socket (not screen)
-	extern char **environ;                       // defined by libc 
-	execve_or_die(filename, argv, environ);
+    struct cgicache_entry *e = cgicache_get(filename, cgiargs, &run);
+    if (run) {
+	out = request_run_dynamic(filename, cgiargs, &len);
+	if (e)
+	    cgicache_fill(e, out, len);
     } else {
-	wait_or_die(NULL);
+	cgicache_wait(e);
+	out = e->out;
+	len = e->len;
     }
+    
+    // The server does only a little bit of the header.  
+    // The CGI script has to finish writing out the header.
+    int hlen = request_format_dynamic(buf, out, len, &keep_alive);
+    size_t sent = request_send(fd, buf, hlen, MSG_MORE);
+    if (sent == hlen)
+	sent += request_send(fd, out, len, 0);
+    if (sent < hlen + len)
+	keep_alive = 0;
+    if (run)
+	free(out);
+    if (e)
+	cgicache_put(e);
+    *bytes += sent;
+    return keep_alive;
 }
 
-void request_serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
+//
+// Formats the header of a static response into buf, which must hold MAXBUF
+// bytes, and returns its length
+//
+int request_format_static(char *buf, char *filename, off_t filesize, int keep_alive) {
+    char filetype[MAXBUF];
     
     request_get_filetype(filename, filetype);
-    srcfd = open_or_die(filename, O_RDONLY, 0);
+    return snprintf(buf, MAXBUF, ""
+	    "HTTP/1.1 200 OK\r\n"
+	    "Server: OSTEP WebServer\r\n"
+	    "%s"
+	    "Content-Length: %lld\r\n"
+	    "Content-Type: %s\r\n\r\n",
+	    connection_header(keep_alive), (long long) filesize, filetype);
+}
+
+//
+// Sends a file from the cache: the header and, for small files, the body
+// from memory with one sendmsg(), or else the body from disk with sendfile().
+// Adds what the client took of the response to *bytes, and returns its status.
+// *keep_alive is cleared if the client goes before it has all of it.
+//
+int request_serve_static(int fd, char *filename, struct stat *sbuf, int *keep_alive, size_t *bytes) {
+    struct cache_entry *e = cache_get(filename, sbuf);
+    if (e == NULL) {
+	// gone since request_resolve() looked
+	*keep_alive = request_error(fd, filename, "404", "Not found", "server could not find this file",
+				    *keep_alive, bytes);
+	return 404;
+    }
     
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    close_or_die(srcfd);
+    if (e->body) {
+	struct iovec iov[2] = {
+	    { e->header[*keep_alive], e->headerlen[*keep_alive] },
+	    { e->body, e->size },
+	};
+	struct msghdr msg = { 0 };
+	struct iovec *v = iov;
+	int nv = 2;
+	while (nv > 0) {
+	    // sendmsg() rather than writev(), for MSG_NOSIGNAL
+	    msg.msg_iov = v;
+	    msg.msg_iovlen = nv;
+	    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    if (n <= 0)
+		break;
+	    *bytes += n;
+	    // skip what went out, in case the socket took only part of it
+	    while (nv > 0 && n >= v->iov_len) {
+		n -= v->iov_len;
+		v++;
+		nv--;
+	    }
+	    if (nv > 0) {
+		v->iov_base = (char *) v->iov_base + n;
+		v->iov_len -= n;
+	    }
+	}
+	if (nv > 0)
+	    *keep_alive = 0;
+	cache_put(e);
+	return 200;
+    }
     
-    // put together response
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n"
-	    "Content-Length: %d\r\n"
-	    "Content-Type: %s\r\n\r\n", 
-	    filesize, filetype);
+    int srcfd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (srcfd < 0) {
+	cache_put(e);
+	*keep_alive = request_error(fd, filename, "404", "Not found", "server could not find this file",
+				    *keep_alive, bytes);
+	return 404;
+    }
     
-    write_or_die(fd, buf, strlen(buf));
+    // MSG_MORE holds the header back so that it goes out in the same segment
+    // as the start of the file
+    size_t hlen = e->headerlen[*keep_alive];
+    size_t sent = request_send(fd, e->header[*keep_alive], hlen, MSG_MORE);
+    int ok = sent == hlen;
     
-    //  Writes out to the client socket the memory-mapped file 
-    size_t offset = 0;
-    ssize_t written;
-    do {
-        written = write_or_die(fd, &srcp[offset], filesize - offset);
-        offset += written;
-    } while (offset < filesize);
-    munmap_or_die(srcp, filesize);
+    // sendfile() copies the file to the socket inside the kernel, without
+    // mapping it or passing it through user space
+    off_t offset = 0;
+    while (ok && offset < e->size) {
+	ssize_t n = sendfile(fd, srcfd, &offset, e->size - offset);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+    }
+    close_or_die(srcfd);
+    *bytes += sent + offset;
+    if (!ok || offset < e->size)
+	*keep_alive = 0;
+    cache_put(e);
+    return 200;
 }
 
-// handle a request
-void request_handle(int fd) {
+//
+// Decides how to answer the request h, as parsed, as far as that can be done
+// without looking at the file. Returns 1 for a static file or 0 for a CGI
+// program, with filename and cgiargs filled in, for request_check() to
+// finish, or REQUEST_STATS for the server's statistics. Returns -1 if the
+// request is to be refused, malformed ones included, with the error response
+// formatted into errbuf (MAXBUF bytes) and its length in *errlen.
+//
+int request_route(struct http_request *h, char *filename, char *cgiargs,
+		  char *errbuf, int *errlen, int keep_alive) {
     int is_static;
-    struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
+    char cause[64], errnum[16];
     
-    readline_or_die(fd, buf, MAXBUF);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    printf("method:%s uri:%s version:%s\n", method, uri, version);
+    if (h->status) {
+	snprintf(errnum, sizeof(errnum), "%d", h->status);
+	*errlen = request_format_error(errbuf, "request", errnum, (char *) http_reason(h->status), (char *) h->error, keep_alive);
+	return -1;
+    }
     
-    if (strcasecmp(method, "GET")) {
-	request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
-	return;
+    if (!http_slice_is(h->method, "GET")) {
+	snprintf(cause, sizeof(cause), "%.*s", (int) h->method.len, h->method.p);
+	*errlen = request_format_error(errbuf, cause, "501", "Not Implemented", "server does not implement this method", keep_alive);
+	return -1;
     }
-    request_read_headers(fd);
     
-    is_static = request_parse_uri(uri, filename, cgiargs);
+    // paths, unlike methods and header names, are case sensitive
+    if (h->path.len == strlen(REQUEST_STATS_URI) && memcmp(h->path.p, REQUEST_STATS_URI, h->path.len) == 0)
+	return REQUEST_STATS;
+    
+    is_static = request_parse_uri(h, filename, cgiargs);
+    if (is_static < 0) {
+	*errlen = request_format_error(errbuf, "request", "414", "URI Too Long", "the path is too long", keep_alive);
+	return -1;
+    }
     if (strncmp("../", filename, 3) == 0) {
-        request_error(fd, filename, "403", "Forbidden", "you do not have access to this file");
-        return;
+        *errlen = request_format_error(errbuf, filename, "403", "Forbidden", "you do not have access to this file", keep_alive);
+        return -1;
     }
+    return is_static;
+}
 
-    if (stat(filename, &sbuf) < 0) {
-	request_error(fd, filename, "404", "Not found", "server could not find this file");
-	return;
+//
+// Finishes deciding how to answer a request for filename, given what stat()
+// found it to be, or NULL if it found nothing. Returns is_static, or -1 as
+// request_route() does.
+//
+int request_check(int is_static, char *filename, struct stat *sbuf,
+		  char *errbuf, int *errlen, int keep_alive) {
+    if (sbuf == NULL) {
+	*errlen = request_format_error(errbuf, filename, "404", "Not found", "server could not find this file", keep_alive);
+	return -1;
     }
     
     if (is_static) {
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not read this file");
-	    return;
+	if (!(S_ISREG(sbuf->st_mode)) || !(S_IRUSR & sbuf->st_mode)) {
+	    *errlen = request_format_error(errbuf, filename, "403", "Forbidden", "server could not read this file", keep_alive);
+	    return -1;
 	}
-	request_serve_static(fd, filename, sbuf.st_size);
     } else {
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not run this CGI program");
-	    return;
+	if (!(S_ISREG(sbuf->st_mode)) || !(S_IXUSR & sbuf->st_mode)) {
+	    *errlen = request_format_error(errbuf, filename, "403", "Forbidden", "server could not run this CGI program", keep_alive);
+	    return -1;
 	}
-	request_serve_dynamic(fd, filename, cgiargs);
     }
+    return is_static;
+}
+
+//
+// Decides how to answer the request h, as request_route() and
+// request_check() do, with sbuf filled in for files
+//
+int request_resolve(struct http_request *h, char *filename, char *cgiargs, struct stat *sbuf,
+		    char *errbuf, int *errlen, int keep_alive) {
+    int is_static = request_route(h, filename, cgiargs, errbuf, errlen, keep_alive);
+    
+    if (is_static == REQUEST_STATS) {
+	sbuf->st_size = 0;
+	return REQUEST_STATS;
+    }
+    if (is_static < 0)
+	return -1;
+    return request_check(is_static, filename, stat(filename, sbuf) == 0 ? sbuf : NULL,
+			 errbuf, errlen, keep_alive);
+}
+
+//
+// Readies connection fd for requests
+//
+void request_init(struct request *r, int fd) {
+    struct timeval tv = { request_keepalive_timeout, 0 };
+    int one = 1;
+    
+    setsockopt_or_die(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // responses to pipelined requests must not wait for the client's
+    // delayed ack of the previous one; MSG_MORE still keeps each header
+    // together with its body
+    setsockopt_or_die(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rio_init(&r->rio, fd);
+    r->nrequests = 0;
+}
+
+//
+// Reads the next request from r's connection and works out how to answer
+// it. Returns 0 if the connection ended instead.
+//
+int request_read(struct request *r) {
+    struct http_request h;
+    rio_t *rp = &r->rio;
+    ssize_t len;
+    int may_keep_alive = ++r->nrequests < request_keepalive_max;
+    
+    // the request is parsed where it lies in the reader's buffer, which
+    // holds the longest one allowed; the connection ends here if the client
+    // closes it or stays idle for too long before it is complete
+    http_init(&h, sizeof(rp->buf));
+    while ((len = http_parse(&h, rp->bufp, rp->cnt)) == 0) {
+	if (rio_more(rp) <= 0)
+	    return 0;
+    }
+    if (len > 0)
+	log_printf("method:%.*s uri:%.*s version:%.*s\n", (int) h.method.len, h.method.p,
+		   (int) h.target.len, h.target.p, (int) h.version.len, h.version.p);
+    
+    // A body is never read and would be taken for the next request, and
+    // after a malformed request there is no telling where the next one
+    // starts, so either ends the connection
+    r->keep_alive = len > 0 && h.keep_alive && !h.has_body && may_keep_alive;
+    r->is_static = request_resolve(&h, r->filename, r->cgiargs, &r->sbuf,
+				   r->errbuf, &r->errlen, r->keep_alive);
+    if (len > 0)
+	rio_consume(rp, len);
+    return 1;
+}
+
+//
+// Sends the server's statistics, adding what the client took to *bytes.
+// Returns whether the connection can carry another response.
+//
+static int request_serve_stats(int fd, int keep_alive, size_t *bytes) {
+    char buf[MAXBUF];
+    size_t len;
+    char *body = stats_report(&len);
+    
+    int hlen = request_format_static(buf, "stats.txt", len, keep_alive);
+    size_t sent = request_send(fd, buf, hlen, MSG_MORE);
+    if (sent == hlen)
+	sent += request_send(fd, body, len, 0);
+    free(body);
+    *bytes += sent;
+    return sent == hlen + len && keep_alive;
+}
+
+//
+// Answers the request read into r. Returns whether the connection can carry
+// another one.
+//
+int request_serve(struct request *r) {
+    int fd = r->rio.fd;
+    uint64_t start = stats_now();
+    size_t sent = 0;
+    
+    if (r->is_static < 0) {
+	sent = request_send(fd, r->errbuf, r->errlen, 0);
+	if (sent < r->errlen)
+	    r->keep_alive = 0;
+	stats_request(STATS_OTHER, atoi(r->errbuf + 9), sent, start);
+    } else if (r->is_static == REQUEST_STATS) {
+	r->keep_alive = request_serve_stats(fd, r->keep_alive, &sent);
+	stats_request(STATS_OTHER, 200, sent, start);
+    } else if (r->is_static) {
+	int status = request_serve_static(fd, r->filename, &r->sbuf, &r->keep_alive, &sent);
+	stats_request(STATS_STATIC, status, sent, start);
+    } else {
+	r->keep_alive = request_serve_dynamic(fd, r->filename, r->cgiargs, r->keep_alive, &sent);
+	stats_request(STATS_DYNAMIC, 200, sent, start);
+    }
+    return r->keep_alive;
+}
+
+//
+// Answers the request read into r, then the ones that follow it on the
+// connection for as long as it stays open: until the client asks for it to
+// be closed or leaves it idle for request_keepalive_timeout seconds, or it
+// has carried request_keepalive_max requests. Pipelined requests wait in the
+// reader's buffer. Returns the number of requests answered.
+//
+int request_continue(struct request *r) {
+    int n = 1;
+    
+    while (request_serve(r) && request_read(r))
+	n++;
+    return n;
+}
+
+//
+// Serves requests on connection fd for as long as it stays open. Returns the
+// number answered.
+//
+int request_handle(int fd) {
+    struct request r;
+    
+    request_init(&r, fd);
+    if (!request_read(&r))
+	return 0;
+    return request_continue(&r);
 }
@@ -1,5 +1,52 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
-void request_handle(int fd);
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "http.h"
+#include "io_helper.h"
+
+#define MAXBUF (8192)
+
+// The server answers this URI with its statistics, rather than a file
+#define REQUEST_STATS_URI "/__stats"
+#define REQUEST_STATS 2
+
+// Persistent connections are closed after this many seconds without a
+// request, or once they have carried this many requests
+extern int request_keepalive_timeout;
+extern int request_keepalive_max;
+
+// A request read from a connection, and how it is to be answered
+struct request {
+    rio_t rio;                // the connection, with whatever followed the request
+    int nrequests;            // read from the connection so far
+    int keep_alive;
+    int is_static;            // 1 for a file, 0 for a CGI program, REQUEST_STATS for
+                              // the statistics, -1 if refused
+    struct stat sbuf;
+    char filename[MAXBUF];
+    char cgiargs[MAXBUF];
+    char errbuf[MAXBUF];      // the response to a refused request
+    int errlen;
+};
+
+void request_init(struct request *r, int fd);
+int request_read(struct request *r);
+int request_serve(struct request *r);
+int request_continue(struct request *r);
+int request_handle(int fd);
+int request_parse_uri(struct http_request *h, char *filename, char *cgiargs);
+int request_route(struct http_request *h, char *filename, char *cgiargs,
+		  char *errbuf, int *errlen, int keep_alive);
+int request_check(int is_static, char *filename, struct stat *sbuf,
+		  char *errbuf, int *errlen, int keep_alive);
+int request_resolve(struct http_request *h, char *filename, char *cgiargs, struct stat *sbuf,
+		    char *errbuf, int *errlen, int keep_alive);
+int request_format_error(char *buf, char *cause, char *errnum, char *shortmsg, char *longmsg,
+			 int keep_alive);
+int request_format_static(char *buf, char *filename, off_t filesize, int keep_alive);
+int request_format_dynamic(char *buf, char *cgiout, size_t len, int *keep_alive);
 
 #endif // __REQUEST_H__
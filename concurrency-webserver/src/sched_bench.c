@@ -0,0 +1,158 @@
+// Measures response times for a mix of small and large files, to compare
+// wserver's scheduling policies.
+//
+//     make bench
+//     ./wserver -t 1 -b 64 -s SFF &
+//     ./sched_bench localhost 10000 /small.html /large.bin 10 32 10
+//
+// Each of the given number of clients asks for the large file the given
+// percentage of the time and the small file otherwise, one request per
+// connection and the next as soon as the last is answered, for the given
+// number of seconds. Response times are reported for each file separately.
+// Use fewer worker threads than clients, so that requests queue up and the
+// policy has something to choose from.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "io_helper.h"
+
+struct client {
+    char *host;
+    int port;
+    char *path[2];  // small, large
+    int large_pct;
+    double stop;
+    unsigned seed;
+
+    // Response times in seconds, for each file
+    double *times[2];
+    size_t len[2];
+    size_t cap[2];
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Asks for path over a new connection and reads the response to its end.
+// Returns 0 if no response came back.
+static int
+fetch(struct client *c, char *path)
+{
+    char buf[65536];
+    int fd = open_client_fd_or_die(c->host, c->port);
+    int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", path);
+    write_or_die(fd, buf, len);
+
+    ssize_t n, total = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        total += n;
+    }
+    close_or_die(fd);
+    return total > 0;
+}
+
+static void *
+run(void *arg)
+{
+    struct client *c = arg;
+    while (now() < c->stop) {
+        int large = rand_r(&c->seed) % 100 < c->large_pct;
+        double t0 = now();
+        if (!fetch(c, c->path[large])) {
+            fprintf(stderr, "no response for %s\n", c->path[large]);
+            exit(1);
+        }
+        double t = now() - t0;
+
+        if (c->len[large] == c->cap[large]) {
+            c->cap[large] = c->cap[large] ? 2 * c->cap[large] : 1024;
+            c->times[large] = realloc(c->times[large], c->cap[large] * sizeof(double));
+            assert(c->times[large] != NULL);
+        }
+        c->times[large][c->len[large]++] = t;
+    }
+    return NULL;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+report(char *path, double *times, size_t len, double secs)
+{
+    if (len == 0) {
+        printf("%-16s no requests\n", path);
+        return;
+    }
+    qsort(times, len, sizeof(double), compare);
+    double sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += times[i];
+    }
+    printf("%-16s %7zu req %8.1f req/s  mean %8.2f ms  p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n",
+        path, len, len / secs, sum / len * 1e3, times[len / 2] * 1e3,
+        times[(size_t)(len * 0.99)] * 1e3, times[len - 1] * 1e3);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc != 8) {
+        fprintf(stderr, "usage: %s host port small-path large-path large-percent clients seconds\n",
+            argv[0]);
+        return 1;
+    }
+    int nclients = atoi(argv[6]);
+    double secs = atof(argv[7]);
+
+    struct client *clients = calloc(nclients, sizeof(*clients));
+    pthread_t *threads = malloc_or_die(nclients * sizeof(pthread_t));
+    assert(clients != NULL);
+    double start = now();
+    for (int i = 0; i < nclients; i++) {
+        struct client *c = &clients[i];
+        c->host = argv[1];
+        c->port = atoi(argv[2]);
+        c->path[0] = argv[3];
+        c->path[1] = argv[4];
+        c->large_pct = atoi(argv[5]);
+        c->stop = start + secs;
+        c->seed = i + 1;
+        if (pthread_create(&threads[i], NULL, run, c)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    // Gather every client's times for each file
+    for (int large = 0; large < 2; large++) {
+        size_t len = 0;
+        double *times = malloc_or_die(sizeof(double));
+        for (int i = 0; i < nclients; i++) {
+            struct client *c = &clients[i];
+            times = realloc(times, (len + c->len[large] + 1) * sizeof(double));
+            assert(times != NULL);
+            memcpy(times + len, c->times[large], c->len[large] * sizeof(double));
+            len += c->len[large];
+        }
+        report(argv[3 + large], times, len, elapsed);
+        free(times);
+    }
+    return 0;
+}
@@ -0,0 +1,289 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "cache.h"
+#include "cgicache.h"
+#include "hist.h"
+#include "io_helper.h"
+#include "log.h"
+#include "stats.h"
+
+// Status codes are counted up to here
+#define STATS_CODES 600
+
+// Each thread counts what it does in a shard of its own, which only it
+// writes to, so counting takes no lock and shares no cache line. The
+// report adds the shards up; it may see one thread's counters a request
+// apart from each other, which does not matter here.
+struct shard {
+    char name[32];          // empty for threads that are never busy or idle
+    uint64_t status[STATS_CODES];
+    uint64_t bytes;
+
+    // Service times of static and dynamic requests
+    uint64_t requests[2];
+    uint64_t sum_us[2];
+    uint64_t hist[2][HIST_BUCKETS];
+
+    int busy;
+    uint64_t since;         // when the thread last became busy or idle
+    uint64_t busy_ns;
+    uint64_t idle_ns;
+
+    struct shard *next;
+} __attribute__((aligned(64)));     // which also rounds its size up, as aligned_alloc() wants
+
+long (*stats_queue_depth)(void);
+
+static __thread struct shard *my_shard;
+static struct shard *shards;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t started;
+
+// The counters are only written by their own thread, but read by others
+static void
+count(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+counted(uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct shard *
+shard_get(void)
+{
+    if (my_shard == NULL) {
+        my_shard = aligned_alloc(64, sizeof(struct shard));
+        assert(my_shard != NULL);
+        memset(my_shard, 0, sizeof(*my_shard));
+        my_shard->since = stats_now();
+        pthread_mutex_lock(&shards_lock);
+        my_shard->next = shards;
+        __atomic_store_n(&shards, my_shard, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&shards_lock);
+    }
+    return my_shard;
+}
+
+void
+stats_init(void)
+{
+    started = stats_now();
+}
+
+//
+// Names the calling thread, for the busy and idle times of the report
+//
+void
+stats_thread(const char *fmt, int n)
+{
+    struct shard *s = shard_get();
+    pthread_mutex_lock(&shards_lock);
+    snprintf(s->name, sizeof(s->name), fmt, n);
+    pthread_mutex_unlock(&shards_lock);
+}
+
+static void
+switch_state(int busy)
+{
+    struct shard *s = shard_get();
+    if (s->busy == busy) {
+        return;
+    }
+    uint64_t now = stats_now();
+    count(busy ? &s->idle_ns : &s->busy_ns, now - s->since);
+    __atomic_store_n(&s->since, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->busy, busy, __ATOMIC_RELAXED);
+}
+
+//
+// The calling thread starts work, after waiting for it
+//
+void
+stats_busy(void)
+{
+    switch_state(1);
+}
+
+//
+// The calling thread is out of work, and about to wait for more
+//
+void
+stats_idle(void)
+{
+    switch_state(0);
+}
+
+//
+// Counts a response with status, of which the client took bytes. Static and dynamic requests are
+// also timed, from start, as stats_now() had it, until now.
+//
+void
+stats_request(enum stats_kind kind, int status, size_t bytes, uint64_t start)
+{
+    struct shard *s = shard_get();
+    count(&s->status[status >= 0 && status < STATS_CODES ? status : 0], 1);
+    count(&s->bytes, bytes);
+    if (kind == STATS_OTHER) {
+        return;
+    }
+    uint64_t us = (stats_now() - start) / 1000;
+    count(&s->requests[kind], 1);
+    count(&s->sum_us[kind], us);
+    count(&s->hist[kind][hist_bucket(us)], 1);
+}
+
+struct report {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void
+report_printf(struct report *r, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void
+report_printf(struct report *r, const char *fmt, ...)
+{
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(r->buf + r->len, r->cap - r->len, fmt, ap);
+        va_end(ap);
+        if (r->len + n < r->cap) {
+            r->len += n;
+            return;
+        }
+        r->cap *= 2;
+        r->buf = realloc(r->buf, r->cap);
+        assert(r->buf != NULL);
+    }
+}
+
+static void
+report_times(struct report *r, const char *kind, uint64_t n, uint64_t sum_us, uint64_t *hist)
+{
+    report_printf(r, "\n%s: %llu requests", kind, (unsigned long long)n);
+    if (n == 0) {
+        report_printf(r, "\n");
+        return;
+    }
+    report_printf(r, ", mean %.3f ms\n ", (double)sum_us / n / 1000);
+    double pcts[] = { 50, 90, 99, 99.9 };
+    for (int i = 0; i < 4; i++) {
+        report_printf(r, " p%g %.3f ms", pcts[i], hist_percentile(hist, n, pcts[i]) / 1000.0);
+    }
+    report_printf(r, "\n");
+
+    // By powers of two, as the buckets are too fine to be read
+    for (int i = 0; i < HIST_BUCKETS; i += HIST_SUB) {
+        uint64_t c = 0;
+        for (int j = i; j < i + HIST_SUB; j++) {
+            c += hist[j];
+        }
+        if (c) {
+            report_printf(r, "  up to %10.3f ms %10llu\n", hist_value(i + HIST_SUB - 1) / 1000.0,
+                (unsigned long long)c);
+        }
+    }
+}
+
+//
+// Formats what the server has done since it started, as text. Returns the
+// report, for the caller to free, and its length in *len.
+//
+char *
+stats_report(size_t *len)
+{
+    // Added up from every shard
+    struct shard *total = calloc(1, sizeof(*total));
+    assert(total != NULL);
+    struct report r = { malloc_or_die(4096), 0, 4096 };
+    uint64_t now = stats_now();
+    uint64_t requests = 0;
+
+    report_printf(&r, "uptime %.3f s\n", (now - started) / 1e9);
+    pthread_mutex_lock(&shards_lock);
+    struct shard *first = shards;
+    pthread_mutex_unlock(&shards_lock);
+    for (struct shard *s = first; s != NULL; s = s->next) {
+        for (int i = 0; i < STATS_CODES; i++) {
+            total->status[i] += counted(&s->status[i]);
+        }
+        total->bytes += counted(&s->bytes);
+        for (int k = 0; k < 2; k++) {
+            total->requests[k] += counted(&s->requests[k]);
+            total->sum_us[k] += counted(&s->sum_us[k]);
+            for (int i = 0; i < HIST_BUCKETS; i++) {
+                total->hist[k][i] += counted(&s->hist[k][i]);
+            }
+        }
+    }
+    for (int i = 0; i < STATS_CODES; i++) {
+        requests += total->status[i];
+    }
+
+    report_printf(&r, "requests %llu\n", (unsigned long long)requests);
+    for (int i = 0; i < STATS_CODES; i++) {
+        if (total->status[i]) {
+            report_printf(&r, "  %03d %llu\n", i, (unsigned long long)total->status[i]);
+        }
+    }
+    report_printf(&r, "bytes sent %llu\n", (unsigned long long)total->bytes);
+    if (stats_queue_depth) {
+        report_printf(&r, "queue depth %ld\n", stats_queue_depth());
+    }
+    struct cache_stats cs;
+    cache_stats(&cs);
+    report_printf(&r, "cache %llu hits, %llu misses, %llu evictions, %zu entries, %zu bytes\n",
+        (unsigned long long)cs.hits, (unsigned long long)cs.misses,
+        (unsigned long long)cs.evictions, cs.entries, cs.bytes);
+    struct cgicache_stats gs;
+    cgicache_stats(&gs);
+    report_printf(&r, "cgi cache %llu hits, %llu coalesced, %llu runs, %zu entries, %zu bytes\n",
+        (unsigned long long)gs.hits, (unsigned long long)gs.coalesced,
+        (unsigned long long)gs.runs, gs.entries, gs.bytes);
+    report_printf(&r, "log lines dropped %llu\n", (unsigned long long)log_dropped());
+
+    // The time a thread has been in its current state counts as well
+    report_printf(&r, "\n");
+    pthread_mutex_lock(&shards_lock);
+    for (struct shard *s = first; s != NULL; s = s->next) {
+        if (s->name[0] == '\0') {
+            continue;
+        }
+        uint64_t busy = counted(&s->busy_ns), idle = counted(&s->idle_ns);
+        uint64_t since = __atomic_load_n(&s->since, __ATOMIC_RELAXED);
+        uint64_t current = now > since ? now - since : 0;
+        if (__atomic_load_n(&s->busy, __ATOMIC_RELAXED)) {
+            busy += current;
+        } else {
+            idle += current;
+        }
+        report_printf(&r, "%-12s busy %10.3f s   idle %10.3f s   %5.1f%% busy\n", s->name,
+            busy / 1e9, idle / 1e9, busy + idle ? 100.0 * busy / (busy + idle) : 0);
+    }
+    pthread_mutex_unlock(&shards_lock);
+
+    report_times(&r, "static", total->requests[STATS_STATIC], total->sum_us[STATS_STATIC],
+        total->hist[STATS_STATIC]);
+    report_times(&r, "dynamic", total->requests[STATS_DYNAMIC], total->sum_us[STATS_DYNAMIC],
+        total->hist[STATS_DYNAMIC]);
+
+    free(total);
+    *len = r.len;
+    return r.buf;
+}
@@ -0,0 +1,26 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// What a request was for, as far as service times go
+enum stats_kind {
+    STATS_STATIC,
+    STATS_DYNAMIC,
+    STATS_OTHER,            // refused, or the statistics themselves
+};
+
+// Returns the number of connections waiting for a worker, if the server
+// keeps them in a queue
+extern long (*stats_queue_depth)(void);
+
+void stats_init(void);
+void stats_thread(const char *fmt, int n);
+void stats_busy(void);
+void stats_idle(void);
+uint64_t stats_now(void);
+void stats_request(enum stats_kind kind, int status, size_t bytes, uint64_t start);
+char *stats_report(size_t *len);
+
+#endif // __STATS_H__
@@ -0,0 +1,222 @@
+#include "io_helper.h"
+#include "steal.h"
+
+// Each cell's sequence number says whose turn it is: it equals the position
+// of the next push into the cell, or that position plus one once the push is
+// done and the cell is waiting to be popped
+struct steal_cell {
+    uint64_t seq;
+    struct queue_item item;
+};
+
+static void
+ring_init(struct steal_ring *r, size_t size)
+{
+    size_t cap = 2;
+    while (cap < size) {
+        cap *= 2;
+    }
+    r->cells = malloc_or_die(cap * sizeof(struct steal_cell));
+    for (size_t i = 0; i < cap; i++) {
+        r->cells[i].seq = i;
+    }
+    r->mask = cap - 1;
+    r->head = 0;
+    r->tail = 0;
+}
+
+static bool
+ring_push(struct steal_ring *r, struct queue_item *it)
+{
+    uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    struct steal_cell *c;
+    while (1) {
+        c = &r->cells[pos & r->mask];
+        int64_t diff = (int64_t)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the cell still holds an item from a lap ago
+            return false;
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+    c->item = *it;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool
+ring_pop(struct steal_ring *r, struct queue_item *it)
+{
+    uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    struct steal_cell *c;
+    while (1) {
+        c = &r->cells[pos & r->mask];
+        int64_t diff = (int64_t)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (int64_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+    *it = c->item;
+    __atomic_store_n(&c->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+//
+// Sets up a ring for each of nworkers workers, holding about capacity
+// connections between them
+//
+void
+steal_init(struct steal *s, int nworkers, size_t capacity)
+{
+    s->nrings = nworkers;
+    s->rings = aligned_alloc(64, nworkers * sizeof(struct steal_ring));
+    assert(s->rings != NULL);
+    for (int i = 0; i < nworkers; i++) {
+        ring_init(&s->rings[i], (capacity + nworkers - 1) / nworkers);
+    }
+    s->next = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cv, NULL);
+    pthread_cond_init(&s->not_full, NULL);
+    s->sleepers = 0;
+    s->producer_waiting = 0;
+    s->stopping = false;
+}
+
+// Adds it to the first ring with room, going round the workers
+static bool
+push_any(struct steal *s, struct queue_item *it)
+{
+    for (int i = 0; i < s->nrings; i++) {
+        int r = (s->next + i) % s->nrings;
+        if (ring_push(&s->rings[r], it)) {
+            s->next = (r + 1) % s->nrings;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Takes an item from the worker's own ring, or else from another's
+static bool
+pop_any(struct steal *s, int worker, struct queue_item *it)
+{
+    for (int i = 0; i < s->nrings; i++) {
+        if (ring_pop(&s->rings[(worker + i) % s->nrings], it)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+// Hands it to the workers. Only the acceptor may call this. If every ring is
+// full, returns 0 at once, or waits for room if wait is set. Returns 1 once
+// it is queued, or -1 if the workers are stopping.
+//
+int
+steal_push(struct steal *s, struct queue_item *it, bool wait)
+{
+    if (!push_any(s, it)) {
+        if (!wait) {
+            return 0;
+        }
+        pthread_mutex_lock(&s->lock);
+        __atomic_store_n(&s->producer_waiting, 1, __ATOMIC_RELAXED);
+        // pairs with the fence in steal_pop(): either the worker sees that
+        // we are waiting, or we see the room it made
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        bool queued;
+        while (!(queued = push_any(s, it)) && !s->stopping) {
+            pthread_cond_wait(&s->not_full, &s->lock);
+        }
+        __atomic_store_n(&s->producer_waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&s->lock);
+        if (!queued) {
+            return -1;
+        }
+    }
+
+    // likewise with the sleepers' fence below
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->sleepers, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->cv);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return 1;
+}
+
+//
+// Takes the next connection for worker, sleeping while there is none.
+// Returns false once the workers are stopping and every ring is empty.
+//
+bool
+steal_pop(struct steal *s, int worker, struct queue_item *it)
+{
+    if (!pop_any(s, worker, it)) {
+        pthread_mutex_lock(&s->lock);
+        __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        bool popped;
+        while (!(popped = pop_any(s, worker, it)) && !s->stopping) {
+            pthread_cond_wait(&s->cv, &s->lock);
+        }
+        __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&s->lock);
+        if (!popped) {
+            return false;
+        }
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->producer_waiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->not_full);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return true;
+}
+
+//
+// Returns about how many connections are waiting in the rings
+//
+size_t
+steal_len(struct steal *s)
+{
+    size_t n = 0;
+    for (int i = 0; i < s->nrings; i++) {
+        struct steal_ring *r = &s->rings[i];
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        n += tail > head ? tail - head : 0;
+    }
+    return n;
+}
+
+//
+// Wakes everyone waiting: the acceptor gives up, and the workers return
+// false from steal_pop() once the rings are empty
+//
+void
+steal_stop(struct steal *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stopping = true;
+    pthread_cond_broadcast(&s->cv);
+    pthread_cond_broadcast(&s->not_full);
+    pthread_mutex_unlock(&s->lock);
+}
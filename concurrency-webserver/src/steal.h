@@ -0,0 +1,42 @@
+#ifndef __STEAL_H__
+#define __STEAL_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "queue.h"
+
+// A bounded lock-free ring of connections, one per worker. The acceptor
+// adds to the tail; the worker and, when it is idle, the others take from
+// the head.
+struct steal_ring {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    struct steal_cell *cells;
+    uint64_t mask;
+};
+
+// Hands connections from the acceptor to the workers without a shared
+// lock: the lock and conditions are only used to sleep when there is
+// nothing to do, or no room
+struct steal {
+    struct steal_ring *rings;
+    int nrings;
+    int next;               // the ring the acceptor tries first
+
+    pthread_mutex_t lock;
+    pthread_cond_t cv;      // a ring is not empty
+    pthread_cond_t not_full;
+    int sleepers;
+    int producer_waiting;
+    bool stopping;
+};
+
+void steal_init(struct steal *s, int nworkers, size_t capacity);
+int steal_push(struct steal *s, struct queue_item *it, bool wait);
+bool steal_pop(struct steal *s, int worker, struct queue_item *it);
+size_t steal_len(struct steal *s);
+void steal_stop(struct steal *s);
+
+#endif // __STEAL_H__
@@ -0,0 +1,969 @@
+#define _GNU_SOURCE
+
+#include <linux/io_uring.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+
+#include "cache.h"
+#include "cgi.h"
+#include "cgicache.h"
+#include "http.h"
+#include "io_helper.h"
+#include "log.h"
+#include "request.h"
+#include "stats.h"
+#include "uring.h"
+
+// Submission queue entries per ring. The completion queue is larger, as
+// multishot accepts post completions without taking up entries.
+#define RING_ENTRIES 256
+#define RING_CQ_ENTRIES (4 * RING_ENTRIES)
+
+// As in event.c, requests start out in a small buffer that grows up to MAXBUF
+#define INBUF_MIN 1024
+
+// Bytes of a file moved through a connection's pipe per pair of splices
+#define SPLICE_CHUNK (64 * 1024)
+
+// What a completion is for, if not a connection's operation. Connections are
+// told apart by their address, which is never this small.
+#define UD_IGNORE 0
+#define UD_ACCEPT 1
+#define UD_TIMEOUT 2
+#define UD_RESUME 3
+
+// As in event.c, how long a loop stops accepting after running out of
+// descriptors or memory
+#define ACCEPT_BACKOFF_MS 100
+
+// The operation a connection has in flight. There is never more than one,
+// so that a completion always finds the connection as it was left.
+enum conn_op {
+    OP_NONE,
+    OP_RECV,
+    OP_STATX,
+    OP_OPEN,
+    OP_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_CGI,
+    OP_CGI_WAIT,
+};
+
+// A ring, with the queues the kernel shares with us mapped in. Entries are
+// filled in ahead of the kernel's view of the submission queue tail, which
+// only moves on the next ring_enter().
+struct ring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned tail;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    size_t sqes_size;
+};
+
+// An event loop, with its own ring. As in event.c, the connections waiting
+// for a request are listed in order of their last activity.
+struct loop {
+    struct ring ring;
+    int listen_fd;
+    int multishot;              // 0 on kernels that accept one at a time
+    int accept_paused;          // no accept armed, after running out of descriptors
+    struct conn *idle_head;
+    struct conn *idle_tail;
+    struct __kernel_timespec timeout;
+    struct __kernel_timespec backoff;
+};
+
+struct conn {
+    int fd;
+    struct loop *loop;
+    enum conn_op op;
+
+    // Place in the loop's idle list, while idle is set
+    int idle;
+    struct conn *prev;
+    struct conn *next;
+    uint64_t last_ms;
+
+    int nrequests;
+    int keep_alive;
+    enum stats_kind kind;
+    uint64_t start;
+
+    char *in;
+    size_t inlen;
+    size_t incap;
+    struct http_request http;
+
+    // The file the request is for, while the ring looks it up
+    int is_static;
+    char *filename;
+    char *cgiargs;
+    struct statx stx;
+
+    // The response, as in event.c. A body that is not held in the cache
+    // entry goes from body_fd through pipe_fds to the socket, with in_pipe
+    // bytes of it in between.
+    char *out;
+    size_t outlen;
+    size_t outcap;
+    size_t sent;
+    struct cache_entry *entry;
+    int body_fd;
+    off_t body_off;
+    off_t bodylen;
+    int pipe_fds[2];
+    size_t in_pipe;
+    int cgi_fd;
+
+    // As in event.c, the CGI cache entry for the output, and whether this
+    // connection runs the program for it
+    struct cgicache_entry *cgi;
+    int cgi_run;
+
+    // What the send in flight points at
+    struct iovec iov[2];
+    struct msghdr msg;
+};
+
+static int nloops_started;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+ring_setup(struct ring *r)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = RING_CQ_ENTRIES;
+    int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (fd < 0 && errno == EINVAL) {
+        // Before 6.1, completions are posted as they happen rather than when
+        // the loop comes to wait for them
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = RING_CQ_ENTRIES;
+        fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Kernels before 5.5 map the queues separately and may drop completions;
+    // they are not worth supporting
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sq_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    char *q = r->sq_ring;
+    r->fd = fd;
+    r->sq_head = (unsigned *)(q + p.sq_off.head);
+    r->sq_tail = (unsigned *)(q + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(q + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(q + p.cq_off.head);
+    r->cq_tail = (unsigned *)(q + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(q + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(q + p.cq_off.cqes);
+
+    // Entries are submitted in the order they are filled in
+    unsigned *array = (unsigned *)(q + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    return 0;
+}
+
+static void
+ring_teardown(struct ring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+// Submits the entries filled in so far, and waits for at least wait
+// completions. This is the only system call the loop makes for its I/O.
+static void
+ring_enter(struct ring *r, unsigned wait)
+{
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    unsigned pending = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    int rc = syscall(__NR_io_uring_enter, r->fd, pending, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+
+    // Interrupted, or completions are backed up: whatever was not submitted
+    // goes in on the next call, once those have been handled
+    assert(rc >= 0 || errno == EINTR || errno == EBUSY || errno == EAGAIN);
+}
+
+// Returns a cleared submission queue entry, submitting those already filled
+// in if the queue is full
+static struct io_uring_sqe *
+ring_sqe(struct ring *r, int opcode, int fd, uint64_t user_data)
+{
+    while (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) {
+        ring_enter(r, 0);
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->tail & r->sq_mask];
+    r->tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+// Closes fd through the ring, as nothing waits for the result
+static void
+ring_close(struct ring *r, int fd)
+{
+    ring_sqe(r, IORING_OP_CLOSE, fd, UD_IGNORE);
+}
+
+static void
+idle_link(struct conn *c)
+{
+    struct loop *l = c->loop;
+    c->last_ms = now_ms();
+    c->idle = 1;
+    c->next = NULL;
+    c->prev = l->idle_tail;
+    if (l->idle_tail) {
+        l->idle_tail->next = c;
+    } else {
+        l->idle_head = c;
+    }
+    l->idle_tail = c;
+}
+
+static void
+idle_unlink(struct conn *c)
+{
+    struct loop *l = c->loop;
+    if (!c->idle) {
+        return;
+    }
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        l->idle_head = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        l->idle_tail = c->prev;
+    }
+    c->prev = c->next = NULL;
+    c->idle = 0;
+}
+
+// Drops what the current request held on to
+static void
+conn_reset(struct conn *c)
+{
+    struct ring *r = &c->loop->ring;
+    if (c->body_fd >= 0) {
+        ring_close(r, c->body_fd);
+        c->body_fd = -1;
+    }
+    if (c->entry) {
+        cache_put(c->entry);
+        c->entry = NULL;
+    }
+    free(c->filename);
+    free(c->cgiargs);
+    c->filename = c->cgiargs = NULL;
+    c->body_off = c->bodylen = 0;
+    c->outlen = c->sent = 0;
+}
+
+static void
+loop_arm_accept(struct loop *l)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, IORING_OP_ACCEPT, l->listen_fd, UD_ACCEPT);
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (l->multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+}
+
+// Arms the accept again after a pause
+static void
+loop_resume_accept(struct loop *l)
+{
+    if (l->accept_paused) {
+        l->accept_paused = 0;
+        loop_arm_accept(l);
+    }
+}
+
+// Closes the connection, which has nothing in flight
+static void
+conn_close(struct conn *c)
+{
+    struct ring *r = &c->loop->ring;
+    idle_unlink(c);
+    conn_reset(c);
+    if (c->pipe_fds[0] >= 0) {
+        ring_close(r, c->pipe_fds[0]);
+        ring_close(r, c->pipe_fds[1]);
+    }
+    ring_close(r, c->fd);
+    // A descriptor is free again for a connection waiting to be accepted
+    loop_resume_accept(c->loop);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void
+conn_reserve(struct conn *c, size_t len)
+{
+    if (c->outlen + len > c->outcap) {
+        c->outcap = c->outcap ? c->outcap : MAXBUF;
+        while (c->outlen + len > c->outcap) {
+            c->outcap *= 2;
+        }
+        c->out = realloc(c->out, c->outcap);
+        assert(c->out != NULL);
+    }
+}
+
+static void
+conn_recv(struct conn *c)
+{
+    // The parser refuses requests longer than MAXBUF before the buffer would
+    // have to grow past it
+    if (c->inlen == c->incap) {
+        c->incap *= 2;
+        c->in = realloc(c->in, c->incap);
+        assert(c->in != NULL);
+    }
+
+    struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring, IORING_OP_RECV, c->fd, (uintptr_t)c);
+    sqe->addr = (uintptr_t)(c->in + c->inlen);
+    sqe->len = c->incap - c->inlen;
+    c->op = OP_RECV;
+}
+
+// Sends what is left of the header, and of a body held in memory
+static void
+conn_send(struct conn *c)
+{
+    int n = 0;
+    if (c->sent < c->outlen) {
+        c->iov[n].iov_base = c->out + c->sent;
+        c->iov[n].iov_len = c->outlen - c->sent;
+        n++;
+    }
+    if (c->entry && c->entry->body && c->body_off < c->bodylen) {
+        c->iov[n].iov_base = c->entry->body + c->body_off;
+        c->iov[n].iov_len = c->bodylen - c->body_off;
+        n++;
+    }
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = n;
+
+    // A body spliced from the file shares a segment with the header
+    struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring, IORING_OP_SENDMSG, c->fd, (uintptr_t)c);
+    sqe->addr = (uintptr_t)&c->msg;
+    sqe->msg_flags = MSG_NOSIGNAL | (c->body_fd >= 0 ? MSG_MORE : 0);
+    c->op = OP_SEND;
+}
+
+// Moves the next piece of the body from the file into the pipe, or from the
+// pipe out to the socket
+static void
+conn_splice(struct conn *c)
+{
+    struct ring *r = &c->loop->ring;
+    struct io_uring_sqe *sqe;
+    if (c->in_pipe == 0) {
+        off_t left = c->bodylen - c->body_off;
+        sqe = ring_sqe(r, IORING_OP_SPLICE, c->pipe_fds[1], (uintptr_t)c);
+        sqe->splice_fd_in = c->body_fd;
+        sqe->splice_off_in = c->body_off;
+        sqe->off = -1;
+        sqe->len = left < SPLICE_CHUNK ? left : SPLICE_CHUNK;
+        c->op = OP_SPLICE_IN;
+    } else {
+        sqe = ring_sqe(r, IORING_OP_SPLICE, c->fd, (uintptr_t)c);
+        sqe->splice_fd_in = c->pipe_fds[0];
+        sqe->splice_off_in = -1;
+        sqe->off = -1;
+        sqe->len = c->in_pipe;
+        c->op = OP_SPLICE_OUT;
+    }
+    sqe->splice_flags = SPLICE_F_MOVE;
+}
+
+static void conn_process(struct conn *c);
+
+// Ends the response that has just gone out, and goes on to the next request
+static void
+conn_finish(struct conn *c)
+{
+    c->op = OP_NONE;
+    // What is still in the pipe never reached the client
+    stats_request(c->kind, atoi(c->out + 9), c->sent + c->body_off - c->in_pipe, c->start);
+
+    if (!c->keep_alive) {
+        conn_close(c);
+        return;
+    }
+    conn_reset(c);
+    idle_link(c);
+    conn_process(c);
+}
+
+static void
+conn_serve_stats(struct conn *c)
+{
+    size_t len;
+    char *body = stats_report(&len);
+    conn_reserve(c, MAXBUF + len);
+    c->outlen = request_format_static(c->out, "stats.txt", len, c->keep_alive);
+    memcpy(c->out + c->outlen, body, len);
+    c->outlen += len;
+    free(body);
+    conn_send(c);
+}
+
+static void
+conn_serve_static(struct conn *c, struct stat *sbuf)
+{
+    struct cache_entry *e = cache_get(c->filename, sbuf);
+    if (e == NULL) {
+        // Gone since the ring looked
+        c->outlen = request_format_error(c->out, c->filename, "404", "Not found",
+            "server could not find this file", c->keep_alive);
+        conn_send(c);
+        return;
+    }
+
+    int len = e->headerlen[c->keep_alive];
+    conn_reserve(c, len);
+    memcpy(c->out, e->header[c->keep_alive], len);
+    c->outlen = len;
+    c->entry = e;
+    c->bodylen = e->size;
+    if (e->body || e->size == 0) {
+        conn_send(c);
+        return;
+    }
+
+    // Too large for the cache: the file is opened, the header sent, and the
+    // body spliced after it
+    struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring, IORING_OP_OPENAT, AT_FDCWD, (uintptr_t)c);
+    sqe->addr = (uintptr_t)c->filename;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    c->op = OP_OPEN;
+}
+
+// Reads the next piece of the CGI program's output
+static void
+conn_read_cgi(struct conn *c)
+{
+    conn_reserve(c, MAXBUF);
+    struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring, IORING_OP_READ, c->cgi_fd, (uintptr_t)c);
+    sqe->addr = (uintptr_t)(c->out + c->outlen);
+    sqe->len = c->outcap - c->outlen;
+    sqe->off = -1;
+    c->op = OP_CGI;
+}
+
+// Waits for the run of the CGI program another request started
+static void
+conn_wait_cgi(struct conn *c)
+{
+    struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring, IORING_OP_POLL_ADD, c->cgi->fd,
+        (uintptr_t)c);
+    sqe->poll32_events = POLLIN;
+    c->op = OP_CGI_WAIT;
+}
+
+// Frames the CGI program's output, which is in out, and sends it
+static void
+conn_send_cgi(struct conn *c)
+{
+    // As in request_serve_dynamic(), the program writes the rest of the
+    // header, behind the part the server puts in front of it
+    char hdr[MAXBUF];
+    int hlen = request_format_dynamic(hdr, c->out, c->outlen, &c->keep_alive);
+    conn_reserve(c, hlen);
+    memmove(c->out + hlen, c->out, c->outlen);
+    memcpy(c->out, hdr, hlen);
+    c->outlen += hlen;
+    conn_send(c);
+}
+
+static void
+conn_send_cached(struct conn *c)
+{
+    conn_reserve(c, c->cgi->len);
+    memcpy(c->out, c->cgi->out, c->cgi->len);
+    c->outlen = c->cgi->len;
+    cgicache_put(c->cgi);
+    c->cgi = NULL;
+    conn_send_cgi(c);
+}
+
+// Runs the CGI program with its output going to a pipe, which the ring reads
+// from until the program is done. With the CGI cache on, the output may be
+// ready already, or the ring may wait for another run of the program to
+// finish.
+static void
+conn_serve_dynamic(struct conn *c)
+{
+    c->cgi_run = 1;
+    c->cgi = cgicache_get(c->filename, c->cgiargs, &c->cgi_run);
+    if (c->cgi && !c->cgi_run) {
+        if (__atomic_load_n(&c->cgi->ready, __ATOMIC_ACQUIRE)) {
+            conn_send_cached(c);
+        } else {
+            conn_wait_cgi(c);
+        }
+        return;
+    }
+
+    int fds[2];
+    int rc = pipe2(fds, O_CLOEXEC);
+    assert(rc == 0);
+
+    cgi_spawn(c->filename, c->cgiargs, fds[1]);
+    close_or_die(fds[1]);
+    c->cgi_fd = fds[0];
+
+    conn_read_cgi(c);
+}
+
+// Takes up the request the parser has found at the start of the input, as
+// conn_request() in event.c does, up to the point where the file has to be
+// looked at, which the ring does
+static void
+conn_request(struct conn *c, ssize_t len)
+{
+    char filename[MAXBUF], cgiargs[MAXBUF];
+    struct http_request *h = &c->http;
+    int errlen;
+
+    idle_unlink(c);
+    c->kind = STATS_OTHER;
+    c->start = stats_now();
+    if (len > 0) {
+        log_printf("method:%.*s uri:%.*s version:%.*s\n", (int)h->method.len, h->method.p,
+            (int)h->target.len, h->target.p, (int)h->version.len, h->version.p);
+    }
+    c->keep_alive = len > 0 && h->keep_alive && !h->has_body
+        && ++c->nrequests < request_keepalive_max;
+
+    conn_reserve(c, MAXBUF);
+    int is_static = request_route(h, filename, cgiargs, c->out, &errlen, c->keep_alive);
+
+    if (len > 0) {
+        c->inlen -= len;
+        memmove(c->in, c->in + len, c->inlen);
+        http_init(h, MAXBUF);
+    }
+
+    if (is_static < 0) {
+        c->outlen = errlen;
+        conn_send(c);
+        return;
+    } else if (is_static == REQUEST_STATS) {
+        conn_serve_stats(c);
+        return;
+    }
+
+    c->is_static = is_static;
+    c->filename = strdup(filename);
+    c->cgiargs = strdup(cgiargs);
+    assert(c->filename != NULL && c->cgiargs != NULL);
+    struct io_uring_sqe *sqe = ring_sqe(&c->loop->ring, IORING_OP_STATX, AT_FDCWD, (uintptr_t)c);
+    sqe->addr = (uintptr_t)c->filename;
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME;
+    sqe->off = (uintptr_t)&c->stx;
+    c->op = OP_STATX;
+}
+
+// Answers the next request in the input, or reads more of it
+static void
+conn_process(struct conn *c)
+{
+    ssize_t len = http_parse(&c->http, c->in, c->inlen);
+    if (len == 0) {
+        conn_recv(c);
+    } else {
+        conn_request(c, len);
+    }
+}
+
+// Fills in what request_check() and the cache look at
+static void
+stat_of_statx(struct stat *sb, struct statx *stx)
+{
+    memset(sb, 0, sizeof(*sb));
+    sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    sb->st_ino = stx->stx_ino;
+    sb->st_mode = stx->stx_mode;
+    sb->st_size = stx->stx_size;
+    sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+static void
+conn_complete(struct conn *c, int res)
+{
+    struct stat sbuf;
+    int errlen;
+
+    switch (c->op) {
+    case OP_RECV:
+        if (res <= 0) {
+            conn_close(c);
+            return;
+        }
+        idle_unlink(c);
+        idle_link(c);
+        c->inlen += res;
+        conn_process(c);
+        break;
+
+    case OP_STATX:
+        if (res == 0) {
+            stat_of_statx(&sbuf, &c->stx);
+        }
+        c->is_static = request_check(c->is_static, c->filename, res == 0 ? &sbuf : NULL,
+            c->out, &errlen, c->keep_alive);
+        if (c->is_static < 0) {
+            c->outlen = errlen;
+            conn_send(c);
+        } else if (c->is_static) {
+            c->kind = STATS_STATIC;
+            conn_serve_static(c, &sbuf);
+        } else {
+            c->kind = STATS_DYNAMIC;
+            conn_serve_dynamic(c);
+        }
+        break;
+
+    case OP_OPEN:
+        if (res < 0) {
+            cache_put(c->entry);
+            c->entry = NULL;
+            c->bodylen = 0;
+            c->outlen = request_format_error(c->out, c->filename, "404", "Not found",
+                "server could not find this file", c->keep_alive);
+            conn_send(c);
+            break;
+        }
+        c->body_fd = res;
+        if (c->pipe_fds[0] < 0) {
+            int rc = pipe2(c->pipe_fds, O_CLOEXEC);
+            assert(rc == 0);
+        }
+        conn_send(c);
+        break;
+
+    case OP_SEND:
+        if (res < 0) {
+            // The client went away, there is no one left to answer
+            c->keep_alive = 0;
+            conn_finish(c);
+            break;
+        }
+        size_t hdr = res < c->outlen - c->sent ? res : c->outlen - c->sent;
+        c->sent += hdr;
+        if (c->body_fd < 0) {
+            c->body_off += res - hdr;
+        }
+        if (c->sent < c->outlen || (c->body_fd < 0 && c->body_off < c->bodylen)) {
+            conn_send(c);
+        } else if (c->body_off < c->bodylen) {
+            conn_splice(c);
+        } else {
+            conn_finish(c);
+        }
+        break;
+
+    case OP_SPLICE_IN:
+        if (res <= 0) {
+            // The file shrank under us
+            c->keep_alive = 0;
+            conn_finish(c);
+            break;
+        }
+        c->in_pipe += res;
+        c->body_off += res;
+        conn_splice(c);
+        break;
+
+    case OP_SPLICE_OUT:
+        if (res <= 0) {
+            // What is left in the pipe goes with it
+            c->keep_alive = 0;
+            conn_finish(c);
+            break;
+        }
+        c->in_pipe -= res;
+        if (c->in_pipe > 0 || c->body_off < c->bodylen) {
+            conn_splice(c);
+        } else {
+            conn_finish(c);
+        }
+        break;
+
+    case OP_CGI:
+        if (res > 0 || res == -EINTR) {
+            c->outlen += res > 0 ? res : 0;
+            conn_read_cgi(c);
+            break;
+        }
+
+        // The program is done; SIGCHLD is ignored, so it needs no reaping
+        ring_close(&c->loop->ring, c->cgi_fd);
+        c->cgi_fd = -1;
+        if (c->cgi) {
+            cgicache_fill(c->cgi, c->out, c->outlen);
+            cgicache_put(c->cgi);
+            c->cgi = NULL;
+        }
+        conn_send_cgi(c);
+        break;
+
+    case OP_CGI_WAIT:
+        if (!__atomic_load_n(&c->cgi->ready, __ATOMIC_ACQUIRE)) {
+            conn_wait_cgi(c);
+            break;
+        }
+        conn_send_cached(c);
+        break;
+
+    case OP_NONE:
+        assert(0);
+    }
+}
+
+static void
+loop_accept(struct loop *l, int res, unsigned flags)
+{
+    if (res == -EINVAL && l->multishot) {
+        // Multishot accepts came in with 5.19
+        l->multishot = 0;
+    } else if (res >= 0) {
+        // As in request_init(), answers to pipelined requests go out
+        // without waiting for acks
+        int one = 1;
+        setsockopt_or_die(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct conn *c = malloc_or_die(sizeof(*c));
+        memset(c, 0, sizeof(*c));
+        c->fd = res;
+        c->loop = l;
+        c->body_fd = -1;
+        c->cgi_fd = -1;
+        c->pipe_fds[0] = c->pipe_fds[1] = -1;
+        c->incap = INBUF_MIN;
+        c->in = malloc_or_die(c->incap);
+        http_init(&c->http, MAXBUF);
+        idle_link(c);
+        conn_recv(c);
+    }
+
+    if (flags & IORING_CQE_F_MORE) {
+        return;
+    }
+
+    // Out of descriptors or memory, the connection stays in the backlog and
+    // a new accept would fail again at once, so the loop waits until one of
+    // its connections closes or a little while has passed
+    if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) {
+        l->accept_paused = 1;
+        l->backoff.tv_sec = 0;
+        l->backoff.tv_nsec = ACCEPT_BACKOFF_MS * 1000000L;
+        struct io_uring_sqe *sqe = ring_sqe(&l->ring, IORING_OP_TIMEOUT, -1, UD_RESUME);
+        sqe->addr = (uintptr_t)&l->backoff;
+        sqe->len = 1;
+    } else {
+        loop_arm_accept(l);
+    }
+}
+
+// Shuts down the connections that have waited longer than the keep-alive
+// timeout for a request, which ends their receives, and sets the timer for
+// when the next one is due
+static void
+loop_expire(struct loop *l)
+{
+    uint64_t timeout_ms = (uint64_t)request_keepalive_timeout * 1000;
+    uint64_t now = now_ms();
+    while (l->idle_head && l->idle_head->last_ms + timeout_ms <= now) {
+        struct conn *c = l->idle_head;
+        idle_unlink(c);
+        shutdown(c->fd, SHUT_RDWR);
+    }
+
+    // Connections that go idle later are due later than the head
+    uint64_t wait_ms = l->idle_head ? l->idle_head->last_ms + timeout_ms - now : timeout_ms;
+    l->timeout.tv_sec = wait_ms / 1000;
+    l->timeout.tv_nsec = wait_ms % 1000 * 1000000;
+    struct io_uring_sqe *sqe = ring_sqe(&l->ring, IORING_OP_TIMEOUT, -1, UD_TIMEOUT);
+    sqe->addr = (uintptr_t)&l->timeout;
+    sqe->len = 1;
+}
+
+static void *
+loop_run(void *arg)
+{
+    struct loop l = { 0 };
+    l.listen_fd = *(int *)arg;
+    l.multishot = 1;
+
+    // The ring is set up by the thread that uses it, as SINGLE_ISSUER asks
+    if (ring_setup(&l.ring) < 0) {
+        perror("io_uring_setup");
+        exit(1);
+    }
+    struct ring *r = &l.ring;
+
+    // Every loop keeps an accept on the listening socket; each connection
+    // goes to one of them
+    loop_arm_accept(&l);
+    if (request_keepalive_timeout > 0) {
+        loop_expire(&l);
+    }
+
+    stats_thread("ring %d", __atomic_fetch_add(&nloops_started, 1, __ATOMIC_RELAXED));
+    while (1) {
+        stats_idle();
+        ring_enter(r, 1);
+        stats_busy();
+
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            // The entry is handed back before it is acted on, as that may
+            // submit, and submitting may wait on more completions
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+
+            if (user_data == UD_ACCEPT) {
+                loop_accept(&l, res, flags);
+            } else if (user_data == UD_TIMEOUT) {
+                loop_expire(&l);
+            } else if (user_data == UD_RESUME) {
+                loop_resume_accept(&l);
+            } else if (user_data != UD_IGNORE) {
+                conn_complete((struct conn *)(uintptr_t)user_data, res);
+            }
+        }
+    }
+    ring_teardown(r);
+    return NULL;
+}
+
+//
+// Returns 1 if the kernel has io_uring with the operations uring_serve()
+// uses, or 0 if it does not or it is not allowed
+//
+int
+uring_available(void)
+{
+    struct ring r;
+    if (ring_setup(&r) < 0) {
+        return 0;
+    }
+
+    // IORING_OP_SPLICE, the last of them, came in with 5.7
+    size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = malloc_or_die(len);
+    memset(probe, 0, len);
+    int ok = syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PROBE, probe,
+        IORING_OP_LAST) == 0;
+    int ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_STATX,
+        IORING_OP_OPENAT, IORING_OP_SPLICE, IORING_OP_READ, IORING_OP_TIMEOUT,
+        IORING_OP_CLOSE, IORING_OP_POLL_ADD,
+    };
+    for (int i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    ring_teardown(&r);
+    return ok;
+}
+
+//
+// Serves connections on listen_fd with nloops event loops, as event_serve()
+// does, but with each loop submitting its I/O to an io_uring rather than
+// making a system call per operation. Does not return.
+//
+void
+uring_serve(int listen_fd, int nloops)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // Splicing to a socket the client has closed raises SIGPIPE, which
+    // MSG_NOSIGNAL cannot prevent
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+
+    pthread_t *threads = malloc_or_die(nloops * sizeof(pthread_t));
+    for (int i = 0; i < nloops; i++) {
+        if (pthread_create(&threads[i], NULL, loop_run, &listen_fd)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nloops; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
@@ -0,0 +1,7 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+int uring_available(void);
+void uring_serve(int listen_fd, int nloops);
+
+#endif // __URING_H__
@@ -44,25 +44,33 @@ void client_send(int fd, char *filename) {
 void client_print(int fd) {
     char buf[MAXBUF];  
     int n;
+    long long length = -1;
+    rio_t rio;
     
     // Read and display the HTTP Header 
-    n = readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n") && (n > 0)) {
+    rio_init(&rio, fd);
+    n = rio_readline_or_die(&rio, buf, MAXBUF);
+    while (strcmp(buf, "\r\n") && strcmp(buf, "\n") && (n > 0)) {
 	printf("Header: %s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
 	
-	// If you want to look for certain HTTP tags... 
-	// int length = 0;
-	//if (sscanf(buf, "Content-Length: %d ", &length) == 1) {
-	//    printf("Length = %d\n", length);
-	//}
+	// The server keeps the connection open for another request, so the
+	// body ends where Content-Length says rather than at EOF
+	if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+	    length = atoll(buf + 15);
+	}
+	n = rio_readline_or_die(&rio, buf, MAXBUF);
     }
     
-    // Read and display the HTTP Body 
-    n = readline_or_die(fd, buf, MAXBUF);
-    while (n > 0) {
-	printf("%s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+    // Read and display the HTTP Body, a buffer at a time since it need not
+    // be text
+    while (length != 0) {
+	size_t want = (length < 0 || length > MAXBUF) ? MAXBUF : length;
+	n = rio_read_or_die(&rio, buf, want);
+	if (n == 0)
+	    break;
+	fwrite(buf, 1, n, stdout);
+	if (length > 0)
+	    length -= n;
     }
 }
 
@@ -0,0 +1,727 @@
+// A load generator for wserver, and the benchmark to run before and after
+// changing it. It keeps many connections busy at once from a few threads,
+// each running an epoll loop, and reports the request rate and the latency
+// distribution.
+//
+//     make bench
+//     ./wload -c 64 -d 10 localhost 10000 /index.html '/spin.cgi?1'
+//     ./wload -c 64 -d 10 -R 5000 -k -f trace.txt localhost 10000
+//
+// By default each connection sends its next request as soon as the last is
+// answered (closed loop). That measures the most the server can do, but
+// understates latency: while the server stalls no requests go out, so none
+// are seen waiting. With -R, requests go out at a fixed rate instead (open
+// loop), and each is timed from when it was due, whether or not a
+// connection was free to send it then.
+//
+// The URIs come from the command line or, with -f, from a file with one per
+// line, and are sent in order, over and over: a mix is given by repeating
+// URIs, a trace by replaying it. Blank lines and lines starting with '#' are
+// skipped.
+//
+// Options:
+//     -c conns     connections open at once (16)
+//     -t threads   threads to spread them over (1)
+//     -d secs      how long to measure (10)
+//     -w secs      how long to run before measuring (0)
+//     -R rate      open loop, sending rate requests a second in all
+//     -k           keep connections open between requests, rather than
+//                  opening a new one for each
+//     -f file      read the URIs from file
+//     -H           print the whole latency histogram
+
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include "hist.h"
+#include "io_helper.h"
+
+#define MAXBUF (8192)
+#define MAXEVENTS 256
+
+struct stats {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t responses;
+    uint64_t ok;            // with a 2xx status
+    uint64_t errors;        // connections refused, reset or closed early
+    uint64_t unfinished;    // due, but not answered by the end
+    uint64_t bytes;
+    uint64_t sum_us;
+    uint64_t max_us;
+};
+
+enum conn_state {
+    CONN_IDLE,
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_READING,
+};
+
+struct thread;
+
+struct conn {
+    int fd;                 // -1 while not connected
+    uint32_t events;        // what fd is watched for
+    enum conn_state state;
+    struct thread *t;
+    struct conn *next_idle;
+
+    char *req;
+    size_t reqlen;
+    size_t sent;
+    uint64_t start;         // when the request was due, in ns
+
+    // The response header, until its end is seen; the body is only counted
+    char hdr[MAXBUF];
+    size_t hdrlen;
+    int header_done;
+    int status;
+    int64_t remaining;      // body bytes still to come, -1 if it ends at EOF
+    int server_closes;
+    size_t bytes;
+};
+
+struct thread {
+    int id;
+    pthread_t thread;
+    int epfd;
+    int timer_fd;
+    uint64_t armed;         // when the timer goes off
+
+    struct conn *conns;
+    int nconns;
+    struct conn *idle;      // connections with no request outstanding
+    size_t next_uri;
+
+    // In the open loop, the requests that are due but not yet sent, oldest
+    // first, by when they were due
+    uint64_t interval;
+    uint64_t next_due;
+    uint64_t *due;
+    size_t due_head;
+    size_t due_len;
+    size_t due_cap;
+
+    struct stats stats;
+    char scratch[65536];
+};
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+static char **reqs;
+static size_t *reqlens;
+static size_t nuris;
+static int keep_alive;
+
+// The run starts at run_start, and only requests due from measure_start
+// until end count
+static uint64_t run_start;
+static uint64_t measure_start;
+static uint64_t end;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+conn_idle(struct conn *c)
+{
+    c->state = CONN_IDLE;
+    c->next_idle = c->t->idle;
+    c->t->idle = c;
+}
+
+static void
+conn_disconnect(struct conn *c)
+{
+    if (c->fd >= 0) {
+        close_or_die(c->fd);
+        c->fd = -1;
+    }
+}
+
+// The request could not be sent, or its response was cut short
+static void
+conn_fail(struct conn *c)
+{
+    if (c->start >= measure_start) {
+        c->t->stats.errors++;
+    }
+    conn_disconnect(c);
+    conn_idle(c);
+}
+
+static void
+conn_done(struct conn *c)
+{
+    struct stats *s = &c->t->stats;
+    if (c->start >= measure_start) {
+        uint64_t us = (now_ns() - c->start) / 1000;
+        s->counts[hist_bucket(us)]++;
+        s->responses++;
+        s->ok += c->status >= 200 && c->status < 300;
+        s->bytes += c->bytes;
+        s->sum_us += us;
+        if (us > s->max_us) {
+            s->max_us = us;
+        }
+    }
+    if (!keep_alive || c->server_closes || c->remaining < 0) {
+        conn_disconnect(c);
+    }
+    conn_idle(c);
+}
+
+// Returns where the body starts, once the header is complete. As in
+// wclient, the blank line that ends it may be "\r\n" or just "\n", as CGI
+// programs often write it.
+static char *
+header_end(char *hdr)
+{
+    for (char *p = strchr(hdr, '\n'); p != NULL; p = strchr(p + 1, '\n')) {
+        if (p[1] == '\n') {
+            return p + 2;
+        }
+        if (p[1] == '\r' && p[2] == '\n') {
+            return p + 3;
+        }
+    }
+    return NULL;
+}
+
+// Reads what it needs from the header, which ends where the body starts
+static void
+conn_parse_header(struct conn *c, char *body)
+{
+    *body = '\0';
+    c->status = 0;
+    sscanf(c->hdr, "HTTP/%*d.%*d %d", &c->status);
+    c->remaining = -1;
+    c->server_closes = 0;
+    for (char *line = strchr(c->hdr, '\n'); line != NULL; line = strchr(line, '\n')) {
+        line++;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->remaining = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            char *value = line + 11;
+            while (*value == ' ') {
+                value++;
+            }
+            c->server_closes = strncasecmp(value, "close", 5) == 0;
+        }
+    }
+}
+
+// Reads as much of the response as has come. Returns 0 once there is no
+// more to read for now.
+static int
+conn_read(struct conn *c)
+{
+    ssize_t n;
+    if (!c->header_done) {
+        n = read(c->fd, c->hdr + c->hdrlen, sizeof(c->hdr) - 1 - c->hdrlen);
+    } else {
+        n = read(c->fd, c->t->scratch, sizeof(c->t->scratch));
+    }
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return errno == EINTR;
+        }
+        conn_fail(c);
+        return 0;
+    }
+    if (n == 0) {
+        if (c->header_done && c->remaining < 0) {
+            conn_done(c);
+        } else {
+            conn_fail(c);
+        }
+        return 0;
+    }
+    c->bytes += n;
+
+    if (!c->header_done) {
+        c->hdrlen += n;
+        c->hdr[c->hdrlen] = '\0';
+        char *body = header_end(c->hdr);
+        if (body == NULL) {
+            if (c->hdrlen == sizeof(c->hdr) - 1) {
+                conn_fail(c);
+                return 0;
+            }
+            return 1;
+        }
+        n = c->hdr + c->hdrlen - body;
+        conn_parse_header(c, body);
+        c->header_done = 1;
+        if (c->remaining < 0) {
+            return 1;
+        }
+    }
+    c->remaining -= n;
+    if (c->remaining <= 0) {
+        conn_done(c);
+        return 0;
+    }
+    return 1;
+}
+
+// Edge-triggered, so the connection is looked at whenever something
+// changes, and always taken as far as it goes. It is watched for room to
+// write only while it needs it, or else every ack would wake the thread.
+static void
+conn_watch(struct conn *c, uint32_t events)
+{
+    events |= EPOLLIN | EPOLLRDHUP | EPOLLET;
+    if (events == c->events) {
+        return;
+    }
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    int rc = epoll_ctl(c->t->epfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+    assert(rc == 0);
+    c->events = events;
+}
+
+// Takes the connection as far as it can go without waiting
+static void
+conn_progress(struct conn *c)
+{
+    if (c->state == CONN_IDLE) {
+        // The server may close a connection kept open, between requests
+        if (c->fd >= 0) {
+            char b;
+            ssize_t n = recv(c->fd, &b, 1, MSG_PEEK);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                conn_disconnect(c);
+            }
+        }
+        return;
+    }
+
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            conn_fail(c);
+            return;
+        }
+        c->state = CONN_SENDING;
+    }
+
+    if (c->state == CONN_SENDING) {
+        while (c->sent < c->reqlen) {
+            ssize_t n = send(c->fd, c->req + c->sent, c->reqlen - c->sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    conn_watch(c, EPOLLOUT);
+                    return;
+                }
+                if (errno != EINTR) {
+                    conn_fail(c);
+                    return;
+                }
+                continue;
+            }
+            c->sent += n;
+        }
+        conn_watch(c, 0);
+        c->state = CONN_READING;
+    }
+
+    while (conn_read(c))
+        ;
+}
+
+static void
+conn_connect(struct conn *c)
+{
+    c->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    assert(c->fd >= 0);
+    int one = 1;
+    setsockopt_or_die(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->state = CONN_CONNECTING;
+    if (connect(c->fd, (struct sockaddr *)&addr, addrlen) < 0 && errno != EINPROGRESS) {
+        conn_fail(c);
+        return;
+    }
+    c->events = 0;
+    conn_watch(c, EPOLLOUT);
+}
+
+// Sends the thread's next request, timed from start
+static void
+conn_start(struct conn *c, uint64_t start)
+{
+    struct thread *t = c->t;
+    size_t i = t->next_uri++ % nuris;
+    c->req = reqs[i];
+    c->reqlen = reqlens[i];
+    c->sent = 0;
+    c->start = start;
+    c->hdrlen = 0;
+    c->header_done = 0;
+    c->bytes = 0;
+
+    if (c->fd < 0) {
+        conn_connect(c);
+    } else {
+        c->state = CONN_SENDING;
+        conn_progress(c);
+    }
+}
+
+static void
+due_push(struct thread *t, uint64_t due)
+{
+    if (t->due_head + t->due_len == t->due_cap) {
+        if (t->due_head > 0) {
+            memmove(t->due, t->due + t->due_head, t->due_len * sizeof(*t->due));
+            t->due_head = 0;
+        } else {
+            t->due_cap = t->due_cap ? 2 * t->due_cap : 1024;
+            t->due = realloc(t->due, t->due_cap * sizeof(*t->due));
+            assert(t->due != NULL);
+        }
+    }
+    t->due[t->due_head + t->due_len++] = due;
+}
+
+static uint64_t
+due_pop(struct thread *t)
+{
+    t->due_len--;
+    return t->due[t->due_head++];
+}
+
+// Has the timer wake the thread at when, if it is not set to already
+static void
+timer_arm(struct thread *t, uint64_t when)
+{
+    if (when == t->armed) {
+        return;
+    }
+    struct itimerspec its = {
+        .it_value = { when / 1000000000, when % 1000000000 },
+    };
+    int rc = timerfd_settime(t->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    assert(rc == 0);
+    t->armed = when;
+}
+
+static void *
+thread_run(void *arg)
+{
+    struct thread *t = arg;
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    assert(t->epfd >= 0);
+    t->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    assert(t->timer_fd >= 0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    int rc = epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->timer_fd, &ev);
+    assert(rc == 0);
+
+    for (int i = t->nconns - 1; i >= 0; i--) {
+        t->conns[i].fd = -1;
+        t->conns[i].t = t;
+        conn_idle(&t->conns[i]);
+    }
+
+    struct epoll_event events[MAXEVENTS];
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= end) {
+            break;
+        }
+        if (t->interval) {
+            while (t->next_due <= now) {
+                due_push(t, t->next_due);
+                t->next_due += t->interval;
+            }
+        }
+        // Those that finish or fail at once wait for the next time round
+        struct conn *idle = t->idle;
+        t->idle = NULL;
+        while (idle != NULL && (t->interval == 0 || t->due_len > 0)) {
+            struct conn *c = idle;
+            idle = c->next_idle;
+            conn_start(c, t->interval ? due_pop(t) : now_ns());
+        }
+        while (idle != NULL) {
+            struct conn *c = idle;
+            idle = c->next_idle;
+            c->next_idle = t->idle;
+            t->idle = c;
+        }
+        timer_arm(t, t->interval && t->next_due < end ? t->next_due : end);
+
+        int ready = t->idle != NULL && (t->interval == 0 || t->due_len > 0);
+        int n = epoll_wait(t->epfd, events, MAXEVENTS, ready ? 0 : -1);
+        if (n < 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+            if (c == NULL) {
+                uint64_t expirations;
+                ssize_t r = read(t->timer_fd, &expirations, sizeof(expirations));
+                (void)r;
+                t->armed = 0;
+            } else {
+                conn_progress(c);
+            }
+        }
+    }
+
+    // What was due in time to count but never answered. In the closed loop
+    // that is just the requests the end cut short.
+    if (t->interval) {
+        for (size_t i = 0; i < t->due_len; i++) {
+            t->stats.unfinished += t->due[t->due_head + i] >= measure_start;
+        }
+        for (int i = 0; i < t->nconns; i++) {
+            struct conn *c = &t->conns[i];
+            t->stats.unfinished += c->state != CONN_IDLE && c->start >= measure_start;
+        }
+    }
+    return NULL;
+}
+
+static void
+stats_add(struct stats *to, struct stats *from)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        to->counts[i] += from->counts[i];
+    }
+    to->responses += from->responses;
+    to->ok += from->ok;
+    to->errors += from->errors;
+    to->unfinished += from->unfinished;
+    to->bytes += from->bytes;
+    to->sum_us += from->sum_us;
+    if (from->max_us > to->max_us) {
+        to->max_us = from->max_us;
+    }
+}
+
+static void
+stats_print(struct stats *s, double secs, int histogram)
+{
+    printf("requests     %lu   %.1f/s\n", s->responses, s->responses / secs);
+    printf("responses    2xx %lu   other %lu   errors %lu   unfinished %lu\n",
+        s->ok, s->responses - s->ok, s->errors, s->unfinished);
+    printf("transfer     %.1f MB   %.1f MB/s\n", s->bytes / 1e6, s->bytes / 1e6 / secs);
+    if (s->responses == 0) {
+        return;
+    }
+    printf("latency      mean %.3f ms   max %.3f ms\n",
+        (double)s->sum_us / s->responses / 1000, s->max_us / 1000.0);
+    printf("            ");
+    double pcts[] = { 50, 90, 99, 99.9 };
+    for (int i = 0; i < 4; i++) {
+        printf("  p%g %.3f ms", pcts[i], hist_percentile(s->counts, s->responses, pcts[i]) / 1000.0);
+    }
+    printf("\n");
+
+    if (histogram) {
+        printf("\n%12s %12s %9s\n", "up to (ms)", "count", "below");
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            if (s->counts[i] == 0) {
+                continue;
+            }
+            seen += s->counts[i];
+            printf("%12.3f %12lu %8.3f%%\n", hist_value(i) / 1000.0, s->counts[i],
+                100.0 * seen / s->responses);
+        }
+    }
+}
+
+// Adds a request for uri to those sent in turn
+static void
+add_uri(char *uri, char *host)
+{
+    char buf[MAXBUF];
+    int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", uri, host,
+        keep_alive ? "" : "Connection: close\r\n");
+    if (len >= sizeof(buf)) {
+        fprintf(stderr, "wload: URI too long: %s\n", uri);
+        exit(1);
+    }
+    reqs = realloc(reqs, (nuris + 1) * sizeof(*reqs));
+    reqlens = realloc(reqlens, (nuris + 1) * sizeof(*reqlens));
+    assert(reqs != NULL && reqlens != NULL);
+    reqs[nuris] = strdup(buf);
+    reqlens[nuris] = len;
+    nuris++;
+}
+
+static void
+read_uris(char *path, char *host)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) >= 0) {
+        char *uri = line;
+        while (isspace(*uri)) {
+            uri++;
+        }
+        char *end = uri + strlen(uri);
+        while (end > uri && isspace(end[-1])) {
+            *--end = '\0';
+        }
+        if (*uri != '\0' && *uri != '#') {
+            add_uri(uri, host);
+        }
+    }
+    free(line);
+    fclose(f);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: wload [-c conns] [-t threads] [-d secs] [-w secs] [-R rate] [-k] "
+        "[-f file] [-H] host port [uri...]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int nconns = 16, nthreads = 1, histogram = 0;
+    double duration = 10, warmup = 0, rate = 0;
+    char *uri_file = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "c:t:d:w:R:kf:H")) != -1) {
+        switch (c) {
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'w':
+            warmup = atof(optarg);
+            break;
+        case 'R':
+            rate = atof(optarg);
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'f':
+            uri_file = optarg;
+            break;
+        case 'H':
+            histogram = 1;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (argc - optind < 2 || nconns < 1 || nthreads < 1 || duration <= 0 || warmup < 0
+        || rate < 0) {
+        usage();
+        exit(1);
+    }
+    if (nthreads > nconns) {
+        nthreads = nconns;
+    }
+    char *host = argv[optind];
+    char *port = argv[optind + 1];
+
+    if (uri_file != NULL) {
+        read_uris(uri_file, host);
+    }
+    for (int i = optind + 2; i < argc; i++) {
+        add_uri(argv[i], host);
+    }
+    if (nuris == 0) {
+        add_uri("/", host);
+    }
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+    int rc = getaddrinfo(host, port, &hints, &ai);
+    if (rc != 0) {
+        fprintf(stderr, "wload: %s: %s\n", host, gai_strerror(rc));
+        exit(1);
+    }
+    memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+    addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+
+    // Rather than count every request of the run as an error
+    int fd = socket_or_die(addr.ss_family, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, addrlen) < 0) {
+        fprintf(stderr, "wload: cannot connect to %s:%s: %s\n", host, port, strerror(errno));
+        exit(1);
+    }
+    close_or_die(fd);
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    printf("%d connections, %d thread%s, %s, %s, %zu URI%s, %.1f s\n", nconns, nthreads,
+        nthreads == 1 ? "" : "s", rate > 0 ? "open loop" : "closed loop",
+        keep_alive ? "keep-alive" : "a connection per request", nuris, nuris == 1 ? "" : "s",
+        duration);
+    if (rate > 0) {
+        printf("target rate  %.1f/s\n", rate);
+    }
+
+    struct thread *threads = calloc(nthreads, sizeof(*threads));
+    struct conn *conns = calloc(nconns, sizeof(*conns));
+    assert(threads != NULL && conns != NULL);
+    run_start = now_ns();
+    measure_start = run_start + warmup * 1e9;
+    end = measure_start + duration * 1e9;
+    for (int i = 0, first = 0; i < nthreads; i++) {
+        struct thread *t = &threads[i];
+        t->id = i;
+        t->conns = conns + first;
+        t->nconns = nconns / nthreads + (i < nconns % nthreads);
+        first += t->nconns;
+        if (rate > 0) {
+            // Each thread sends its share, the threads taking turns
+            t->interval = nthreads * 1e9 / rate;
+            t->next_due = run_start + i * 1e9 / rate;
+        }
+        if (pthread_create(&t->thread, NULL, thread_run, t)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    struct stats *total = calloc(1, sizeof(*total));
+    assert(total != NULL);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        stats_add(total, &threads[i].stats);
+    }
+    stats_print(total, duration, histogram);
+    return 0;
+}
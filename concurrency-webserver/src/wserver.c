@@ -1,52 +1,571 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 
+#include "cache.h"
+#include "cgi.h"
+#include "cgicache.h"
+#include "event.h"
 #include "io_helper.h"
+#include "log.h"
 #include "request.h"
 #include "queue.h"
+#include "stats.h"
+#include "steal.h"
+#include "uring.h"
 
 char default_root[] = ".";
 
-static pthread_mutex_t lock;
-static pthread_cond_t cv;
+// How long an acceptor waits before it tries again after running out of
+// descriptors or memory
+#define ACCEPT_BACKOFF_MS 100
+
+static struct queue_policy *policy;
+static bool shed;                   // answer 503 rather than wait for room
+static bool stopping;               // set once, by drain()
+
+static bool
+is_stopping(void)
+{
+    return __atomic_load_n(&stopping, __ATOMIC_SEQ_CST);
+}
+
+// Each worker notes the connection it is serving, or -1, under its own lock
+struct worker {
+    pthread_mutex_t lock;
+    int fd;
+    uint64_t requests;              // answered so far
+    struct group *group;
+    pthread_t thread;
+} __attribute__((aligned(64)));
+
+// The threads are split into groups that share nothing: each has its own
+// listening socket on the port, acceptor, queue and workers, and runs on its
+// own set of CPUs
+struct group {
+    int listen_fd;
+    cpu_set_t cpus;
+    pthread_t acceptor;
+    uint64_t connections;           // accepted so far
+
+    // FIFO hands connections to the workers through a ring per worker,
+    // which idle workers steal from. The other policies need every waiting
+    // connection in one place to choose from, and keep a single queue
+    // guarded by lock.
+    bool stealing;
+    struct steal steal;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cv;              // the queue is not empty
+    pthread_cond_t not_full;        // the queue has room
+    struct queue q;
+
+    struct worker *workers;
+    int nworkers;
+};
+
+static struct group *groups;
+static int ngroups;
+
+// Takes the next connection for worker w, waiting for one. Returns false
+// once the server is stopping and none are left.
+bool
+take_item(struct worker *w, struct queue_item *it)
+{
+    struct group *g = w->group;
+    if (g->stealing) {
+        return steal_pop(&g->steal, w - g->workers, it);
+    }
+
+    pthread_mutex_lock(&g->lock);
+    while (queue_empty(&g->q) && !is_stopping()) {
+        pthread_cond_wait(&g->cv, &g->lock);
+    }
+    if (queue_empty(&g->q)) {
+        pthread_mutex_unlock(&g->lock);
+        return false;
+    }
+    queue_pop(&g->q, it);
+    pthread_cond_signal(&g->not_full);
+    pthread_mutex_unlock(&g->lock);
+    return true;
+}
+
+// Hands it to g's workers, waiting for room unless shed is set. Returns 1
+// once it is queued, 0 if there was no room, or -1 if the server is stopping.
+int
+give_item(struct group *g, struct queue_item *it)
+{
+    if (g->stealing) {
+        return steal_push(&g->steal, it, !shed);
+    }
+
+    pthread_mutex_lock(&g->lock);
+    while (queue_full(&g->q) && !shed && !is_stopping()) {
+        pthread_cond_wait(&g->not_full, &g->lock);
+    }
+    int rc = is_stopping() ? -1 : queue_full(&g->q) ? 0 : 1;
+    if (rc > 0) {
+        queue_push(&g->q, it);
+        pthread_cond_signal(&g->cv);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return rc;
+}
+
+// Puts it back in g's queue, without waiting for room. Returns false if
+// there is none, or if the server is stopping.
+bool
+requeue_item(struct group *g, struct queue_item *it)
+{
+    pthread_mutex_lock(&g->lock);
+    bool ok = !queue_full(&g->q) && !is_stopping();
+    if (ok) {
+        queue_push(&g->q, it);
+        pthread_cond_signal(&g->cv);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return ok;
+}
+
+// Reads the first request on it->fd and notes the size of the file it asks
+// for, for the policies that order connections by it. Returns 0 if the
+// connection ended first.
+int
+prepare_item(struct queue_item *it)
+{
+    struct request *r = malloc_or_die(sizeof(*r));
+    request_init(r, it->fd);
+    if (!request_read(r)) {
+        free(r);
+        return 0;
+    }
+    // refused requests are answered at once, and CGI programs are taken to
+    // run about as long as their size suggests
+    if (r->is_static >= 0) {
+        it->size = r->sbuf.st_size;
+    }
+    it->arg = r;
+    return 1;
+}
+
+// Notes fd as the connection w is on, or -1 for none, so that drain() can
+// end it
+static void
+serving(struct worker *w, int fd)
+{
+    pthread_mutex_lock(&w->lock);
+    w->fd = fd;
+    if (fd >= 0 && is_stopping()) {
+        shutdown(fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
 
 void *
 handle_request(void *arg)
 {
-    struct queue *q = arg;
-    pthread_mutex_lock(&lock);
-    while (queue_empty(q)) {
-        pthread_cond_wait(&cv, &lock);
+    struct worker *w = arg;
+    struct queue_item it;
+
+    // numbered across the groups
+    int id = w - w->group->workers;
+    for (struct group *g = groups; g < w->group; g++) {
+        id += g->nworkers;
     }
+    stats_thread("worker %d", id);
 
-    int conn_fd = queue_pop(q);
-    pthread_mutex_unlock(&lock);
+    while (take_item(w, &it)) {
+        stats_busy();
+        serving(w, it.fd);
 
-    request_handle(conn_fd);
-    close_or_die(conn_fd);
+        // The acceptor queues connections before their first request is
+        // in, as it must not wait on any one client. Policies that order
+        // them by the file asked for have the request read here, and the
+        // connection put back to take its place among the others, unless
+        // there is no room left for it.
+        if (policy->needs_size && it.arg == NULL) {
+            int ok = prepare_item(&it);
+            // the descriptor must not be shut down once another worker
+            // may have it
+            serving(w, -1);
+            if (!ok) {
+                close_or_die(it.fd);
+                stats_idle();
+                continue;
+            }
+            if (requeue_item(w->group, &it)) {
+                stats_idle();
+                continue;
+            }
+            serving(w, it.fd);
+        }
 
+        int n;
+        if (it.arg) {
+            n = request_continue(it.arg);
+            free(it.arg);
+        } else {
+            n = request_handle(it.fd);
+        }
+        __atomic_add_fetch(&w->requests, n, __ATOMIC_RELAXED);
+
+        // the descriptor must not be shut down once it may have been reused
+        serving(w, -1);
+        close_or_die(it.fd);
+        stats_idle();
+    }
+    return NULL;
+}
+
+// Returns how many connections are waiting for a worker, for /__stats
+long
+queue_depth(void)
+{
+    long n = 0;
+    for (int i = 0; i < ngroups; i++) {
+        struct group *g = &groups[i];
+        n += g->stealing ? steal_len(&g->steal) : __atomic_load_n(&g->q.len, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+// Stops taking connections, for SIGTERM. Workers answer what has already
+// come in, on their own connections and on those still queued, but stop
+// waiting for more: shutting down the reading side ends the connection
+// once its buffered requests are served.
+void
+drain(void)
+{
+    __atomic_store_n(&stopping, true, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < ngroups; i++) {
+        struct group *g = &groups[i];
+        pthread_mutex_lock(&g->lock);
+        pthread_cond_broadcast(&g->cv);
+        pthread_cond_broadcast(&g->not_full);
+        pthread_mutex_unlock(&g->lock);
+        if (g->stealing) {
+            steal_stop(&g->steal);
+        }
+
+        for (int j = 0; j < g->nworkers; j++) {
+            struct worker *w = &g->workers[j];
+            pthread_mutex_lock(&w->lock);
+            if (w->fd >= 0) {
+                shutdown(w->fd, SHUT_RD);
+            }
+            pthread_mutex_unlock(&w->lock);
+        }
+
+        // wakes the acceptor, whose accept4() now fails
+        shutdown(g->listen_fd, SHUT_RD);
+    }
+}
+
+// Closes a connection that will not be served
+void
+discard_item(struct queue_item *it)
+{
+    free(it->arg);
+    close_or_die(it->fd);
+}
+
+// Tells the client of a connection that does not fit in the queue to come
+// back later, without waiting on it
+void
+shed_item(struct queue_item *it)
+{
+    char buf[MAXBUF];
+    int len = request_format_error(buf, "try again later", "503", "Service Unavailable",
+        "server has too many connections waiting", 0);
+    send(it->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    stats_request(STATS_OTHER, 503, len, 0);
+
+    // an unread request would make close() reset the connection, possibly
+    // before the client has seen the response
+    if (it->arg == NULL) {
+        recv(it->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    }
+    discard_item(it);
+}
+
+// Accepts connections on g's socket and queues them for its workers
+void *
+accept_connections(void *arg)
+{
+    struct group *g = arg;
+    bool backing_off = false;
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        // close-on-exec, so that CGI programs do not hold other connections
+        // open after the server has closed them
+        int conn_fd = accept4(g->listen_fd, (sockaddr_t *)&client_addr, &client_len,
+            SOCK_CLOEXEC);
+        if (conn_fd < 0) {
+            if (is_stopping()) {
+                break;
+            }
+            // the connection went away before it was accepted
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // Out of descriptors or memory, say: the connection waits in the
+            // backlog until workers have closed some of theirs. Trying again
+            // at once would only spin, and the error is reported once per
+            // spell rather than every time.
+            if (!backing_off) {
+                perror("accept4");
+                backing_off = true;
+            }
+            usleep(ACCEPT_BACKOFF_MS * 1000);
+            continue;
+        }
+        backing_off = false;
+        __atomic_add_fetch(&g->connections, 1, __ATOMIC_RELAXED);
+
+        // nothing is read here, see handle_request()
+        struct queue_item it = { .fd = conn_fd, .size = 0, .arg = NULL };
+
+        int rc = give_item(g, &it);
+        if (rc < 0) {
+            discard_item(&it);
+            break;
+        }
+        if (rc == 0) {
+            shed_item(&it);
+        }
+    }
     return NULL;
 }
 
+// Prints how much each group has done
+void
+report_groups(void)
+{
+    for (int i = 0; i < ngroups; i++) {
+        struct group *g = &groups[i];
+        uint64_t requests = 0;
+        for (int j = 0; j < g->nworkers; j++) {
+            requests += __atomic_load_n(&g->workers[j].requests, __ATOMIC_RELAXED);
+        }
+
+        char cpus[256] = "";
+        size_t len = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE && len < sizeof(cpus) - 8; cpu++) {
+            if (CPU_ISSET(cpu, &g->cpus)) {
+                len += snprintf(cpus + len, sizeof(cpus) - len, "%s%d", len ? "," : "", cpu);
+            }
+        }
+        fprintf(stderr, "group %d (cpus %s): %llu connections, %llu requests\n", i, cpus,
+            (unsigned long long)__atomic_load_n(&g->connections, __ATOMIC_RELAXED),
+            (unsigned long long)requests);
+    }
+}
+
+// Prints the cache and group counters every time the server gets SIGUSR1,
+// and drains the worker threads on SIGTERM
+void *
+handle_signals(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) == 0) {
+        if (sig == SIGTERM) {
+            drain();
+            continue;
+        }
+        struct cache_stats st;
+        cache_stats(&st);
+        fprintf(stderr, "cache: %llu hits, %llu misses, %llu evictions, %zu entries, %zu bytes\n",
+            (unsigned long long)st.hits, (unsigned long long)st.misses,
+            (unsigned long long)st.evictions, st.entries, st.bytes);
+        struct cgicache_stats cst;
+        cgicache_stats(&cst);
+        fprintf(stderr, "cgi cache: %llu hits, %llu coalesced, %llu runs, %zu entries, %zu bytes\n",
+            (unsigned long long)cst.hits, (unsigned long long)cst.coalesced,
+            (unsigned long long)cst.runs, cst.entries, cst.bytes);
+        report_groups();
+    }
+    return NULL;
+}
+
+// Deals the CPUs the server may run on out to the groups in turn. With a
+// single group nothing is pinned.
+void
+assign_cpus(void)
+{
+    cpu_set_t all;
+    int rc = sched_getaffinity(0, sizeof(all), &all);
+    assert(rc == 0);
+    for (int i = 0; i < ngroups; i++) {
+        CPU_ZERO(&groups[i].cpus);
+    }
+    if (ngroups == 1) {
+        groups[0].cpus = all;
+        return;
+    }
+
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &all)) {
+            CPU_SET(cpu, &groups[n % ngroups].cpus);
+            n++;
+        }
+    }
+    // more groups than CPUs: the rest share them in the same way
+    for (int i = n; i < ngroups; i++) {
+        groups[i].cpus = groups[i % n].cpus;
+    }
+}
+
+// Starts a thread of group g, on g's CPUs
+void
+start_thread(struct group *g, pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (ngroups > 1) {
+        pthread_attr_setaffinity_np(&attr, sizeof(g->cpus), &g->cpus);
+    }
+    if (pthread_create(thread, &attr, fn, arg)) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Sets up ngroups groups listening on port, sharing out nthreads workers and
+// queue_size waiting connections between them
+void
+init_groups(int port, int nthreads, size_t queue_size)
+{
+    groups = calloc(ngroups, sizeof(struct group));
+    assert(groups != NULL);
+    assign_cpus();
+    for (int i = 0; i < ngroups; i++) {
+        struct group *g = &groups[i];
+        g->listen_fd = open_listen_fd_or_die(port, ngroups > 1);
+        g->nworkers = (nthreads + ngroups - 1) / ngroups;
+        size_t size = (queue_size + ngroups - 1) / ngroups;
+
+        g->stealing = !policy->needs_size;
+        if (g->stealing) {
+            steal_init(&g->steal, g->nworkers, size);
+        } else {
+            queue_init(&g->q, size, policy);
+        }
+        pthread_mutex_init(&g->lock, NULL);
+        pthread_cond_init(&g->cv, NULL);
+        pthread_cond_init(&g->not_full, NULL);
+
+        g->workers = aligned_alloc(64, g->nworkers * sizeof(struct worker));
+        assert(g->workers != NULL);
+        for (int j = 0; j < g->nworkers; j++) {
+            struct worker *w = &g->workers[j];
+            pthread_mutex_init(&w->lock, NULL);
+            w->fd = -1;
+            w->requests = 0;
+            w->group = g;
+        }
+    }
+}
+
 void
 usage()
 {
-    fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffersize]\n");
+    fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffersize] "
+        "[-s FIFO|SFF|SFF-AGING] [-o block|shed] [-g groups] [-e threads|epoll|uring] [-k timeout] [-m maxrequests] [-c cachemb] [-r runners] [-C cgittl]\n");
 }
 
 //
-// ./wserver [-d <basedir>] [-p <portnum>]
+// ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>] [-b <buffers>] [-s <schedalg>]
+//           [-o block|shed] [-g <groups>] [-e threads|epoll|uring] [-k <timeout>] [-m <maxrequests>]
+//           [-c <cachemb>] [-r <runners>] [-C <cgittl>]
+//
+// Connections wait in a queue of -b entries for one of -t worker threads,
+// which takes them in the order -s sets:
+//
+//   FIFO       in the order they came in, the default
+//   SFF        smallest file first, going by the first request on each
+//   SFF-AGING  smallest file first, but a large file is passed by only a
+//              bounded number of later requests, so it cannot starve
+//
+// For SFF and SFF-AGING the accepting thread queues each connection before
+// reading anything from it, so that no one client can hold up the others. A
+// worker that takes a connection whose first request is still unread reads
+// it and stat()s the file, then puts the connection back in the queue to
+// wait its turn by size, or serves it at once if the queue has no room. A
+// connection put back takes a new place in line, so SFF-AGING ages it from
+// then rather than from when it came in. Later requests on a connection that
+// is kept open go to the same worker, in order.
+//
+// When the queue is full, new connections wait in the listen backlog until
+// there is room, or with -o shed are answered at once with 503 Service
+// Unavailable. On SIGTERM the server stops accepting, answers the requests
+// it has received, and exits.
+//
+// With -g, the workers and the queue are split into that many groups, each
+// with its own acceptor thread and SO_REUSEPORT listening socket, so that
+// the kernel spreads connections across them. Each group's threads are
+// pinned to its share of the CPUs, so a connection is accepted and served
+// on the same ones. -t and -b are split between the groups. SIGUSR1 and
+// the exit after SIGTERM print how many connections and requests each
+// group has handled.
+//
+// With -e epoll, connections are served by event loops instead, one loop per
+// CPU unless -t says otherwise, and -b, -s and -g do not apply. With -e
+// uring, the event loops submit their accepts, reads, file lookups and sends
+// to an io_uring each, in batches, rather than make a system call for each;
+// where the kernel has no io_uring or does not allow it, the threads serve
+// connections as without -e.
+//
+// Connections are kept open for further requests (HTTP/1.1, or HTTP/1.0
+// with "Connection: keep-alive") until they have been idle for -k seconds,
+// 5 by default and 0 for no limit, or have carried -m requests, 100 by
+// default.
+//
+// Static files are served from a cache of -c megabytes, 64 by default and 0
+// to read every file afresh. Sending the server SIGUSR1 prints its hit and
+// miss counts.
+//
+// CGI programs are started by -r runner processes, which the server forks
+// at startup while it is still small, and which start programs in parallel
+// at a fraction of the cost of forking the server itself. With -r 0, the
+// default, the server forks each program directly.
+//
+// With -C, the output of a CGI program is kept for that many seconds, or for
+// as long as its Cache-Control header gives as max-age, and later requests
+// for the same program and query string are answered from it; output marked
+// no-store, no-cache or private is not kept. Requests that come in while the
+// program runs wait for its output rather than run it again, however many
+// there are. 0, the default, runs the program for every request.
+//
+// Each request is logged to stdout by a logger thread, from buffers the
+// threads serving requests fill without taking a lock; lines that do not
+// fit are dropped rather than hold up a request. GET /__stats reports the
+// requests answered by status, the bytes sent, the connections waiting,
+// how busy each thread has been, and how long static and dynamic requests
+// took to answer.
 //
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
     int port = 10000;
-    int nthreads = 10;
+    int nthreads = 0;
     size_t queue_size = 10;
+    int epoll = 0;
+    int uring = 0;
+    size_t cache_mb = 64;
+    int nrunners = 0;
+    int cgi_ttl = 0;
+    policy = queue_policy("FIFO");
+    ngroups = 1;
 
-    struct queue q;
-
-    while ((c = getopt(argc, argv, "d:p:t:b:h")) != -1)
+    while ((c = getopt(argc, argv, "d:p:t:b:s:o:g:e:k:m:c:r:C:h")) != -1)
         switch (c) {
         case 'd':
             root_dir = optarg;
@@ -60,6 +579,53 @@ int main(int argc, char *argv[]) {
         case 'b':
             queue_size = atoi(optarg);
             break;
+        case 's':
+            policy = queue_policy(optarg);
+            if (policy == NULL) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'o':
+            if (!strcmp(optarg, "shed")) {
+                shed = true;
+            } else if (strcmp(optarg, "block")) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'g':
+            ngroups = atoi(optarg);
+            if (ngroups <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'e':
+            if (!strcmp(optarg, "epoll")) {
+                epoll = 1;
+            } else if (!strcmp(optarg, "uring")) {
+                uring = 1;
+            } else if (strcmp(optarg, "threads")) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'k':
+            request_keepalive_timeout = atoi(optarg);
+            break;
+        case 'm':
+            request_keepalive_max = atoi(optarg);
+            break;
+        case 'c':
+            cache_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            nrunners = atoi(optarg);
+            break;
+        case 'C':
+            cgi_ttl = atoi(optarg);
+            break;
         case 'h':
             usage();
             exit(0);
@@ -71,29 +637,81 @@ int main(int argc, char *argv[]) {
     // run out of this directory
     chdir_or_die(root_dir);
 
-    queue_init(&q, queue_size);
-    pthread_mutex_init(&lock, NULL);
-    pthread_cond_init(&cv, NULL);
+    // before anything else, so that the runners are small and hold nothing
+    // of the server's
+    cgi_init(nrunners);
+    cache_init(cache_mb << 20);
+    cgicache_init(cgi_ttl);
+    stats_init();
 
-    pthread_t *threads = malloc_or_die(nthreads * sizeof(pthread_t));
-    for (int i = 0; i < nthreads; i++) {
-        if (pthread_create(&threads[i], NULL, handle_request, &q)) {
-            perror("pthread_create");
-            exit(1);
+    if (uring && !uring_available()) {
+        fprintf(stderr, "wserver: io_uring is not available, serving with threads\n");
+        uring = 0;
+    }
+    int loops = epoll || uring;
+
+    if (!loops) {
+        if (nthreads <= 0) {
+            nthreads = 10;
+        }
+        if (ngroups > nthreads) {
+            ngroups = nthreads;
+        }
+        init_groups(port, nthreads, queue_size);
+        stats_queue_depth = queue_depth;
+    }
+
+    // The signals are taken by handle_signals() alone, so they are blocked
+    // before any other thread is started. The event loops have nothing to
+    // drain, and leave SIGTERM to end the server at once.
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (!loops) {
+        sigaddset(&set, SIGTERM);
+    }
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    log_init();
+    pthread_t signal_thread;
+    if (pthread_create(&signal_thread, NULL, handle_signals, &set)) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    if (loops) {
+        if (nthreads <= 0) {
+            nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (uring) {
+            uring_serve(open_listen_fd_or_die(port, 0), nthreads);
+        } else {
+            event_serve(open_listen_fd_or_die(port, 0), nthreads);
         }
+        return 0;
     }
 
+    // A client that goes before it has its whole response must cost no
+    // more than its connection; sendfile() has no MSG_NOSIGNAL, so SIGPIPE
+    // is ignored as in the event loops
+    signal(SIGPIPE, SIG_IGN);
+
     // now, get to work
-    int listen_fd = open_listen_fd_or_die(port);
-    while (1) {
-        struct sockaddr_in client_addr;
-        int client_len = sizeof(client_addr);
-        int conn_fd = accept_or_die(listen_fd, (sockaddr_t *)&client_addr,
-            (socklen_t *)&client_len);
-        pthread_mutex_lock(&lock);
-        queue_push(&q, conn_fd);
-        pthread_cond_signal(&cv);
-        pthread_mutex_unlock(&lock);
+    for (int i = 0; i < ngroups; i++) {
+        struct group *g = &groups[i];
+        for (int j = 0; j < g->nworkers; j++) {
+            start_thread(g, &g->workers[j].thread, handle_request, &g->workers[j]);
+        }
+        start_thread(g, &g->acceptor, accept_connections, g);
+    }
+
+    for (int i = 0; i < ngroups; i++) {
+        struct group *g = &groups[i];
+        pthread_join(g->acceptor, NULL);
+        for (int j = 0; j < g->nworkers; j++) {
+            pthread_join(g->workers[j].thread, NULL);
+        }
     }
+    report_groups();
+    log_flush();
     return 0;
 }
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define CHUNK_SIZE (1 << 20)
+
+// Classes are spaced 8 bytes apart up to MAX_SMALL, then a power of two apart
+// up to MAX_CLASS
+#define MAX_SMALL 128
+#define MAX_CLASS 4096
+
+struct chunk {
+    struct chunk *next;
+    struct chunk *prev;
+};
+
+static size_t
+class_of(size_t size)
+{
+    if (size <= MAX_SMALL) {
+        return size ? (size - 1) / 8 : 0;
+    }
+
+    size_t c = MAX_SMALL / 8;
+    for (size_t cap = 2 * MAX_SMALL; cap < size; cap *= 2) {
+        c++;
+    }
+
+    return c;
+}
+
+static size_t
+class_size(size_t c)
+{
+    if (c < MAX_SMALL / 8) {
+        return (c + 1) * 8;
+    }
+
+    return (size_t)(2 * MAX_SMALL) << (c - MAX_SMALL / 8);
+}
+
+static void *
+chunk_new(struct arena *a, size_t size)
+{
+    struct chunk *c = malloc(sizeof(*c) + size);
+    if (!c) {
+        perror("malloc");
+        exit(1);
+    }
+
+    c->prev = NULL;
+    c->next = a->chunks;
+    if (a->chunks) {
+        a->chunks->prev = c;
+    }
+
+    a->chunks = c;
+    a->nchunks++;
+    a->reserved += size;
+    return c + 1;
+}
+
+void
+arena_init(struct arena *a)
+{
+    memset(a, 0, sizeof(*a));
+}
+
+// Returns the usable size of a block allocated for size bytes. Two sizes map
+// to the same block size exactly when they fall into the same class.
+size_t
+arena_size(size_t size)
+{
+    if (size > MAX_CLASS) {
+        return size;
+    }
+
+    return class_size(class_of(size));
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+    if (size > MAX_CLASS) {
+        a->used += size;
+        return chunk_new(a, size);
+    }
+
+    size_t c = class_of(size);
+    size_t sz = class_size(c);
+    a->used += sz;
+    void *p = a->free[c];
+    if (p) {
+        a->free[c] = *(void **)p;
+        return p;
+    }
+
+    if (a->avail < sz) {
+        a->next = chunk_new(a, CHUNK_SIZE);
+        a->avail = CHUNK_SIZE;
+    }
+
+    p = a->next;
+    a->next += sz;
+    a->avail -= sz;
+    return p;
+}
+
+// Returns p to the arena. size must be the size p was allocated for, or any
+// other size in the same class.
+void
+arena_free(struct arena *a, void *p, size_t size)
+{
+    if (size > MAX_CLASS) {
+        struct chunk *c = (struct chunk *)p - 1;
+        if (c->prev) {
+            c->prev->next = c->next;
+        } else {
+            a->chunks = c->next;
+        }
+
+        if (c->next) {
+            c->next->prev = c->prev;
+        }
+
+        free(c);
+        a->nchunks--;
+        a->reserved -= size;
+        a->used -= size;
+        return;
+    }
+
+    size_t c = class_of(size);
+    a->used -= class_size(c);
+    *(void **)p = a->free[c];
+    a->free[c] = p;
+}
+
+void
+arena_release(struct arena *a)
+{
+    struct chunk *c = a->chunks;
+    while (c) {
+        struct chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+
+    arena_init(a);
+}
@@ -0,0 +1,34 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+#define ARENA_CLASSES 21
+
+struct chunk;
+
+// Hands out blocks rounded up to a size class, carved from large chunks.
+// Freed blocks go onto a free list per class for reuse. Blocks too large for
+// any class get a chunk of their own. Everything is returned to the system at
+// once by arena_release(), at a cost proportional to the number of chunks
+// rather than the number of blocks.
+struct arena {
+    struct chunk *chunks;
+    char *next;
+    size_t avail;
+    void *free[ARENA_CLASSES];
+
+    // Bytes obtained from malloc in nchunks chunks, and how many of them are
+    // handed out in blocks
+    size_t nchunks;
+    size_t reserved;
+    size_t used;
+};
+
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_free(struct arena *a, void *p, size_t size);
+size_t arena_size(size_t size);
+void arena_release(struct arena *a);
+
+#endif // __ARENA_H__
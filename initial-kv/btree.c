@@ -0,0 +1,243 @@
+#include <string.h>
+
+#include "btree.h"
+
+// Returns the index of the first key in node not less than key
+static int
+lower_bound(struct bnode *node, int key)
+{
+    int lo = 0;
+    int hi = node->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (node->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Returns the index of the child of an inner node that covers key. Child i
+// holds the keys from keys[i - 1] up to but excluding keys[i].
+static int
+child_index(struct bnode *node, int key)
+{
+    int i = lower_bound(node, key);
+    if (i < node->n && node->keys[i] == key) {
+        i++;
+    }
+
+    return i;
+}
+
+static struct bnode *
+node_new(struct btree *t, int leaf)
+{
+    struct bnode *node = arena_alloc(t->arena, sizeof(*node));
+    memset(node, 0, sizeof(*node));
+    node->leaf = leaf;
+    return node;
+}
+
+// Splits an overflowing node in two. Returns the new right half and stores
+// the smallest key under it in *sep.
+static struct bnode *
+node_split(struct btree *t, struct bnode *node, int *sep)
+{
+    struct bnode *right = node_new(t, node->leaf);
+    int half = node->n / 2;
+    if (node->leaf) {
+        right->n = node->n - half;
+        memcpy(right->keys, &node->keys[half], right->n * sizeof(int));
+        memcpy(right->vals, &node->vals[half], right->n * sizeof(char *));
+        node->n = half;
+
+        right->prev = node;
+        right->next = node->next;
+        if (node->next) {
+            node->next->prev = right;
+        }
+
+        node->next = right;
+        *sep = right->keys[0];
+    } else {
+        // The middle key moves up into the parent
+        *sep = node->keys[half];
+        right->n = node->n - half - 1;
+        memcpy(right->keys, &node->keys[half + 1], right->n * sizeof(int));
+        memcpy(right->child, &node->child[half + 1], (right->n + 1) * sizeof(struct bnode *));
+        node->n = half;
+    }
+
+    return right;
+}
+
+// Inserts key into the subtree under node. If node has to be split, returns
+// the new sibling to be added to the parent, with its separator in *sep.
+static struct bnode *
+node_put(struct btree *t, struct bnode *node, int key, char *val, int *sep)
+{
+    if (node->leaf) {
+        int i = lower_bound(node, key);
+        if (i < node->n && node->keys[i] == key) {
+            node->vals[i] = val;
+            return NULL;
+        }
+
+        memmove(&node->keys[i + 1], &node->keys[i], (node->n - i) * sizeof(int));
+        memmove(&node->vals[i + 1], &node->vals[i], (node->n - i) * sizeof(char *));
+        node->keys[i] = key;
+        node->vals[i] = val;
+        node->n++;
+    } else {
+        int i = child_index(node, key);
+        int s;
+        struct bnode *right = node_put(t, node->child[i], key, val, &s);
+        if (!right) {
+            return NULL;
+        }
+
+        memmove(&node->keys[i + 1], &node->keys[i], (node->n - i) * sizeof(int));
+        memmove(&node->child[i + 2], &node->child[i + 1], (node->n - i) * sizeof(struct bnode *));
+        node->keys[i] = s;
+        node->child[i + 1] = right;
+        node->n++;
+    }
+
+    if (node->n <= BTREE_MAX) {
+        return NULL;
+    }
+
+    return node_split(t, node, sep);
+}
+
+// Removes key from the subtree under node. Returns 1 if node is left empty,
+// in which case it has been freed and must be dropped by its parent.
+static int
+node_delete(struct btree *t, struct bnode *node, int key)
+{
+    int i;
+    if (node->leaf) {
+        i = lower_bound(node, key);
+        if (i == node->n || node->keys[i] != key) {
+            return 0;
+        }
+
+        node->n--;
+        memmove(&node->keys[i], &node->keys[i + 1], (node->n - i) * sizeof(int));
+        memmove(&node->vals[i], &node->vals[i + 1], (node->n - i) * sizeof(char *));
+        if (node->n > 0) {
+            return 0;
+        }
+
+        if (node->prev) {
+            node->prev->next = node->next;
+        }
+
+        if (node->next) {
+            node->next->prev = node->prev;
+        }
+    } else {
+        i = child_index(node, key);
+        if (!node_delete(t, node->child[i], key)) {
+            return 0;
+        }
+
+        if (node->n > 0) {
+            // Drop the child along with the separator on one side of it; its
+            // neighbour's range simply widens to cover the now empty gap
+            int k = i > 0 ? i - 1 : 0;
+            memmove(&node->keys[k], &node->keys[k + 1], (node->n - k - 1) * sizeof(int));
+            memmove(&node->child[i], &node->child[i + 1], (node->n - i) * sizeof(struct bnode *));
+            node->n--;
+            return 0;
+        }
+    }
+
+    arena_free(t->arena, node, sizeof(*node));
+    return 1;
+}
+
+void
+btree_init(struct btree *t, struct arena *arena)
+{
+    t->root = NULL;
+    t->arena = arena;
+}
+
+void
+btree_put(struct btree *t, int key, char *val)
+{
+    if (!t->root) {
+        t->root = node_new(t, 1);
+    }
+
+    int sep;
+    struct bnode *right = node_put(t, t->root, key, val, &sep);
+    if (right) {
+        struct bnode *root = node_new(t, 0);
+        root->n = 1;
+        root->keys[0] = sep;
+        root->child[0] = t->root;
+        root->child[1] = right;
+        t->root = root;
+    }
+}
+
+// Nodes are not merged when they run low: a node is only removed once it is
+// empty. This keeps deletion simple at the cost of some space after heavy
+// deletes, which is given back by the next clear.
+void
+btree_delete(struct btree *t, int key)
+{
+    if (!t->root) {
+        return;
+    }
+
+    if (node_delete(t, t->root, key)) {
+        t->root = NULL;
+        return;
+    }
+
+    // Shorten the tree while the root has a single child
+    while (!t->root->leaf && t->root->n == 0) {
+        struct bnode *root = t->root;
+        t->root = root->child[0];
+        arena_free(t->arena, root, sizeof(*root));
+    }
+}
+
+// Positions iter on the first key not less than key
+void
+btree_seek(struct btree *t, struct btree_iter *iter, int key)
+{
+    struct bnode *node = t->root;
+    while (node && !node->leaf) {
+        node = node->child[child_index(node, key)];
+    }
+
+    iter->leaf = node;
+    iter->i = node ? lower_bound(node, key) : 0;
+}
+
+// Stores the next key and value in ascending order. Returns 0 at the end.
+int
+btree_next(struct btree_iter *iter, int *key, char **val)
+{
+    while (iter->leaf && iter->i >= iter->leaf->n) {
+        iter->leaf = iter->leaf->next;
+        iter->i = 0;
+    }
+
+    if (!iter->leaf) {
+        return 0;
+    }
+
+    *key = iter->leaf->keys[iter->i];
+    *val = iter->leaf->vals[iter->i];
+    iter->i++;
+    return 1;
+}
@@ -0,0 +1,42 @@
+#ifndef __BTREE_H__
+#define __BTREE_H__
+
+#include "arena.h"
+
+#define BTREE_MAX 32
+
+// A B+-tree over int keys. Leaves hold the keys and value pointers in sorted
+// arrays and are chained together, so a scan reads consecutive memory and
+// only touches the inner nodes once to find where to start.
+struct bnode {
+    int leaf;
+    int n;
+    // One spare slot lets a node overflow before it is split
+    int keys[BTREE_MAX + 1];
+    union {
+        struct bnode *child[BTREE_MAX + 2];
+        struct {
+            char *vals[BTREE_MAX + 1];
+            struct bnode *prev;
+            struct bnode *next;
+        };
+    };
+};
+
+struct btree {
+    struct bnode *root;
+    struct arena *arena;
+};
+
+struct btree_iter {
+    struct bnode *leaf;
+    int i;
+};
+
+void btree_init(struct btree *t, struct arena *arena);
+void btree_put(struct btree *t, int key, char *val);
+void btree_delete(struct btree *t, int key);
+void btree_seek(struct btree *t, struct btree_iter *iter, int key);
+int btree_next(struct btree_iter *iter, int *key, char **val);
+
+#endif // __BTREE_H__
@@ -0,0 +1,163 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cmd.h"
+#include "stats.h"
+
+int
+cmd_parse(struct cmd *cmd, char *str)
+{
+    char *s = str;
+    char *token = NULL;
+    char *type = NULL;
+    char *k = NULL;
+    char *v = NULL;
+    int i = 0;
+
+    while ((token = strsep(&s, ","))  != NULL) {
+        switch (i) {
+        case 0:
+            type = token;
+            break;
+        case 1:
+            k = token;
+            break;
+        case 2:
+            v = token;
+            break;
+        default:
+            fprintf(stderr, "Invalid command: '%s'\n", str);
+            return 1;
+        }
+        i++;
+    }
+
+    if (!strcmp(type, "p")) {
+        cmd->type = CMD_PUT;
+    } else if (!strcmp(type, "g")) {
+        cmd->type = CMD_GET;
+    } else if (!strcmp(type, "d")) {
+        cmd->type = CMD_DEL;
+    } else if (!strcmp(type, "c")) {
+        cmd->type = CMD_CLR;
+    } else if (!strcmp(type, "a")) {
+        cmd->type = CMD_ALL;
+    } else if (!strcmp(type, "s")) {
+        cmd->type = CMD_STATS;
+    } else if (!strcmp(type, "r")) {
+        // Both bounds are optional, a bare r lists everything in key order
+        cmd->type = CMD_RNG;
+        cmd->kv.k = k && *k ? atoi(k) : INT_MIN;
+        cmd->hi = v && *v ? atoi(v) : INT_MAX;
+        return 0;
+    } else {
+        fprintf(stderr, "Invalid command: '%s'\n", str);
+        return 1;
+    }
+
+    if (cmd->type == CMD_PUT || cmd->type == CMD_GET || cmd->type == CMD_DEL) {
+        if (k) {
+            cmd->kv.k = atoi(k);
+        } else {
+            fprintf(stderr, "Command is missing required key: '%s'\n", str);
+            return 1;
+        }
+    } else if (k) {
+        fprintf(stderr, "Command does not accept a key: '%s'\n", str);
+        return 1;
+    }
+
+    if (cmd->type == CMD_PUT) {
+        if (v) {
+            cmd->kv.v = v;
+        } else {
+            fprintf(stderr, "Command is missing required value: '%s'\n", str);
+            return 1;
+        }
+    } else if (v) {
+        fprintf(stderr, "Command does not accept a value: '%s'\n", str);
+        return 1;
+    }
+
+    return 0;
+}
+
+void
+cmd_print(struct cmd *cmd)
+{
+    switch (cmd->type) {
+    case CMD_PUT:
+        printf("Put: %d = %s\n", cmd->kv.k, cmd->kv.v);
+        break;
+    case CMD_GET:
+        printf("Get: %d\n", cmd->kv.k);
+        break;
+    case CMD_DEL:
+        printf("Delete: %d\n", cmd->kv.k);
+        break;
+    case CMD_CLR:
+        printf("Clear\n");
+        break;
+    case CMD_ALL:
+        printf("All\n");
+        break;
+    case CMD_RNG:
+        printf("Range: %d to %d\n", cmd->kv.k, cmd->hi);
+        break;
+    case CMD_STATS:
+        printf("Stats\n");
+        break;
+    }
+}
+
+void
+kv_print(FILE *out, int k, const char *v)
+{
+    if (v) {
+        fprintf(out, "%d,%s\n", k, v);
+    } else {
+        fprintf(out, "%d not found\n", k);
+    }
+}
+
+void
+cmd_handle(struct cmd *cmd, struct db *db, FILE *out)
+{
+    struct kv *kv = &cmd->kv;
+    switch (cmd->type) {
+    case CMD_PUT: {
+        db_insert(db, kv->k, kv->v);
+        break;
+    }
+    case CMD_GET:
+        kv_print(out, kv->k, db_get(db, kv->k));
+        break;
+    case CMD_CLR:
+        db_clear(db);
+        break;
+    case CMD_ALL: {
+        struct db_iter iter;
+        db_iter_init(db, &iter);
+        while ((kv = db_iter_next(&iter)) != NULL) {
+            fprintf(out, "%d,%s\n", kv->k, kv->v);
+        }
+        break;
+    }
+    case CMD_DEL:
+        db_delete(db, kv->k);
+        break;
+    case CMD_RNG: {
+        struct db_range range;
+        db_range_init(db, &range, kv->k, cmd->hi);
+        while ((kv = db_range_next(&range)) != NULL) {
+            fprintf(out, "%d,%s\n", kv->k, kv->v);
+        }
+        break;
+    }
+    case CMD_STATS:
+        stats_print(out, db, 1);
+        break;
+    }
+}
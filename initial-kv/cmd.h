@@ -0,0 +1,31 @@
+#ifndef __CMD_H__
+#define __CMD_H__
+
+#include <stdio.h>
+
+#include "db.h"
+
+struct cmd {
+    enum {
+        CMD_PUT,
+        CMD_GET,
+        CMD_CLR,
+        CMD_ALL,
+        CMD_DEL,
+        CMD_RNG,
+        CMD_STATS,
+    } type;
+    struct kv kv;
+
+    // CMD_RNG covers the keys from kv.k up to and including hi
+    int hi;
+};
+
+#define CMD_TYPES (CMD_STATS + 1)
+
+int cmd_parse(struct cmd *cmd, char *str);
+void cmd_print(struct cmd *cmd);
+void kv_print(FILE *out, int k, const char *v);
+void cmd_handle(struct cmd *cmd, struct db *db, FILE *out);
+
+#endif // __CMD_H__
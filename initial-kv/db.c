@@ -0,0 +1,762 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "db.h"
+
+#define MIN_CAPACITY 16
+
+// Number of slots moved from the old table into the new one by every mutation
+// while a resize is in progress. db_grow() sizes the new table so that this is
+// enough to drain the old one before the new one fills up in turn.
+#define MIGRATE_STEP 8
+
+// Marks a slot whose entry was deleted. Such a slot cannot simply be emptied
+// since that would cut short the probe sequences of keys stored after it.
+static char tombstone;
+#define TOMBSTONE (&tombstone)
+
+static size_t
+hash(int key, uint32_t seed)
+{
+    uint32_t h = (uint32_t)key ^ seed;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h;
+}
+
+static int
+slot_live(struct kv *kv)
+{
+    return kv->v && kv->v != TOMBSTONE;
+}
+
+// Returns the slot holding key in t, or NULL
+static struct kv *
+table_find(struct table *t, int key)
+{
+    if (!t->cap) {
+        return NULL;
+    }
+
+    size_t mask = t->cap - 1;
+    for (size_t n = hash(key, t->seed) & mask;; n = (n + 1) & mask) {
+        struct kv *kv = &t->slots[n];
+        if (!kv->v) {
+            return NULL;
+        }
+
+        if (kv->v != TOMBSTONE && kv->k == key) {
+            return kv;
+        }
+    }
+}
+
+// Returns the slot for key in t. If key is not present yet, the first free
+// slot on its probe sequence is claimed for it and returned with a NULL value.
+static struct kv *
+table_claim(struct table *t, int key)
+{
+    size_t mask = t->cap - 1;
+    struct kv *free = NULL;
+    for (size_t n = hash(key, t->seed) & mask;; n = (n + 1) & mask) {
+        struct kv *kv = &t->slots[n];
+        if (!kv->v) {
+            if (!free) {
+                free = kv;
+                t->used++;
+            }
+            break;
+        }
+
+        if (kv->v == TOMBSTONE) {
+            if (!free) {
+                free = kv;
+            }
+        } else if (kv->k == key) {
+            return kv;
+        }
+    }
+
+    free->k = key;
+    free->v = NULL;
+    t->len++;
+    return free;
+}
+
+static int
+db_owns(struct db *db, char *v)
+{
+    return v < db->borrowed || v >= db->borrowed + db->nborrowed;
+}
+
+static void
+db_free_value(struct db *db, char *v)
+{
+    if (db_owns(db, v)) {
+        arena_free(&db->arena, v, strlen(v) + 1);
+    }
+}
+
+static void
+table_remove(struct db *db, struct table *t, struct kv *kv)
+{
+    db_free_value(db, kv->v);
+    kv->v = TOMBSTONE;
+    t->len--;
+}
+
+static void
+table_alloc(struct table *t, size_t cap)
+{
+    t->slots = calloc(cap, sizeof(*t->slots));
+    if (!t->slots) {
+        perror("calloc");
+        exit(1);
+    }
+
+    t->cap = cap;
+    t->len = 0;
+    t->used = 0;
+
+    // Snapshots are written in slot order. Without a seed, a table smaller
+    // than the one that wrote the snapshot would be filled in order of home
+    // slot, which piles every insert onto the end of one long probe cluster.
+    t->seed = cap * 0x9e3779b9u;
+}
+
+// Moves up to nslots slots of the old table into the current one
+static void
+db_migrate(struct db *db, size_t nslots)
+{
+    struct table *old = &db->old;
+    if (!old->cap) {
+        return;
+    }
+
+    while (nslots-- && db->migrate < old->cap) {
+        struct kv *kv = &old->slots[db->migrate++];
+        if (slot_live(kv)) {
+            struct kv *slot = table_claim(&db->cur, kv->k);
+            slot->v = kv->v;
+            kv->v = TOMBSTONE;
+            old->len--;
+        }
+    }
+
+    if (db->migrate == old->cap) {
+        free(old->slots);
+        memset(old, 0, sizeof(*old));
+        db->migrate = 0;
+    }
+}
+
+// Starts moving the current table into a new one sized for its live entries.
+// The new table is at least half the size of the old one so that draining the
+// old table MIGRATE_STEP slots at a time finishes before the new one is full.
+static void
+db_grow(struct db *db)
+{
+    // Only one resize can be in flight at a time
+    db_migrate(db, SIZE_MAX);
+
+    size_t cap = MIN_CAPACITY;
+    while (cap < 2 * (db->cur.len + 1) || cap < db->cur.cap / 2) {
+        cap *= 2;
+    }
+
+    db->old = db->cur;
+    db->migrate = 0;
+    table_alloc(&db->cur, cap);
+}
+
+void
+db_init(struct db *db)
+{
+    memset(db, 0, sizeof(*db));
+    arena_init(&db->arena);
+    btree_init(&db->index, &db->arena);
+}
+
+// Returns the slot key is to be stored in. The slot still holds the previous
+// value for key, or NULL if there was none.
+static struct kv *
+db_claim(struct db *db, int key)
+{
+    db_migrate(db, MIGRATE_STEP);
+
+    if ((db->cur.used + 1) * 4 > db->cur.cap * 3) {
+        db_grow(db);
+    }
+
+    // The key must only ever be present in one of the tables
+    struct kv *kv = table_find(&db->old, key);
+    if (kv) {
+        table_remove(db, &db->old, kv);
+    }
+
+    return table_claim(&db->cur, key);
+}
+
+void
+db_insert(struct db *db, int key, const char *val)
+{
+    db_insert_len(db, key, val, strlen(val));
+}
+
+// Like db_insert(), for a value of len bytes that need not be NUL-terminated
+void
+db_insert_len(struct db *db, int key, const char *val, size_t len)
+{
+    struct kv *kv = db_claim(db, key);
+    if (kv->v) {
+        // Overwrite the previous value in place if the new one falls into the
+        // same size class, so the block stays correctly sized for freeing
+        if (db_owns(db, kv->v) && arena_size(strlen(kv->v) + 1) == arena_size(len + 1)) {
+            memmove(kv->v, val, len);
+            kv->v[len] = '\0';
+            return;
+        }
+
+        db_free_value(db, kv->v);
+    }
+
+    kv->v = arena_alloc(&db->arena, len + 1);
+    memcpy(kv->v, val, len);
+    kv->v[len] = '\0';
+    btree_put(&db->index, key, kv->v);
+}
+
+// Registers a mapped snapshot whose values are to be stored by reference
+void
+db_borrow(struct db *db, const char *base, size_t len)
+{
+    db->borrowed = base;
+    db->nborrowed = len;
+}
+
+// Stores val without copying it. val must lie within the range registered
+// with db_borrow().
+void
+db_insert_borrowed(struct db *db, int key, char *val)
+{
+    struct kv *kv = db_claim(db, key);
+    if (kv->v) {
+        db_free_value(db, kv->v);
+    }
+
+    kv->v = val;
+    btree_put(&db->index, key, val);
+}
+
+void
+db_delete(struct db *db, int key)
+{
+    db_migrate(db, MIGRATE_STEP);
+
+    struct table *t = &db->cur;
+    struct kv *kv = table_find(t, key);
+    if (!kv) {
+        t = &db->old;
+        kv = table_find(t, key);
+    }
+
+    if (kv) {
+        table_remove(db, t, kv);
+        btree_delete(&db->index, key);
+    }
+}
+
+const char *
+db_get(struct db *db, int key)
+{
+    struct kv *kv = table_find(&db->cur, key);
+    if (!kv) {
+        kv = table_find(&db->old, key);
+    }
+
+    if (kv) {
+        return kv->v;
+    }
+
+    return NULL;
+}
+
+size_t
+db_len(struct db *db)
+{
+    return db->cur.len + db->old.len;
+}
+
+static void
+table_stats(struct table *t, struct db_stats *st)
+{
+    size_t mask = t->cap - 1;
+    for (size_t n = 0; n < t->cap; n++) {
+        struct kv *kv = &t->slots[n];
+        if (!slot_live(kv)) {
+            st->tombstones += kv->v == TOMBSTONE;
+            continue;
+        }
+
+        size_t probe = ((n - hash(kv->k, t->seed)) & mask) + 1;
+        st->total_probe += probe;
+        if (probe > st->longest_probe) {
+            st->longest_probe = probe;
+        }
+    }
+
+    st->len += t->len;
+    st->cap += t->cap;
+}
+
+// Adds the shape of db's tables to st. This walks every slot.
+void
+db_stats(struct db *db, struct db_stats *st)
+{
+    table_stats(&db->cur, st);
+    table_stats(&db->old, st);
+    st->resizing |= db->old.cap != 0;
+}
+
+void
+db_clear(struct db *db)
+{
+    // Values and index nodes need not be freed one by one, they all go with
+    // the arena
+    free(db->old.slots);
+    free(db->cur.slots);
+    arena_release(&db->arena);
+
+    const char *borrowed = db->borrowed;
+    size_t nborrowed = db->nborrowed;
+    db_init(db);
+    db_borrow(db, borrowed, nborrowed);
+}
+
+void
+db_iter_init(struct db *db, struct db_iter *iter)
+{
+    iter->db = db;
+    iter->t = &db->old;
+    iter->n = 0;
+}
+
+struct kv *
+db_iter_next(struct db_iter *iter)
+{
+    while (1) {
+        while (iter->n < iter->t->cap) {
+            struct kv *kv = &iter->t->slots[iter->n++];
+            if (slot_live(kv)) {
+                return kv;
+            }
+        }
+
+        if (iter->t == &iter->db->cur) {
+            return NULL;
+        }
+
+        iter->t = &iter->db->cur;
+        iter->n = 0;
+    }
+}
+
+// Starts a scan over the keys from lo to hi inclusive, in ascending order
+void
+db_range_init(struct db *db, struct db_range *range, int lo, int hi)
+{
+    btree_seek(&db->index, &range->iter, lo);
+    range->hi = hi;
+}
+
+struct kv *
+db_range_next(struct db_range *range)
+{
+    struct kv *kv = &range->kv;
+    if (!btree_next(&range->iter, &kv->k, &kv->v) || kv->k > range->hi) {
+        return NULL;
+    }
+
+    return kv;
+}
+
+// Starts a scan in key order over the keys from lo to hi inclusive of several
+// databases at once
+void
+db_merge_init(struct db_merge *merge, struct db *dbs, size_t ndbs, int lo, int hi)
+{
+    merge->ranges = malloc(ndbs * sizeof(*merge->ranges));
+    merge->heads = malloc(ndbs * sizeof(*merge->heads));
+    if (!merge->ranges || !merge->heads) {
+        perror("malloc");
+        exit(1);
+    }
+
+    merge->n = ndbs;
+    for (size_t i = 0; i < ndbs; i++) {
+        db_range_init(&dbs[i], &merge->ranges[i], lo, hi);
+        merge->heads[i] = db_range_next(&merge->ranges[i]);
+    }
+}
+
+struct kv *
+db_merge_next(struct db_merge *merge)
+{
+    struct kv **min = NULL;
+    for (size_t i = 0; i < merge->n; i++) {
+        if (merge->heads[i] && (!min || merge->heads[i]->k < (*min)->k)) {
+            min = &merge->heads[i];
+        }
+    }
+
+    if (!min) {
+        return NULL;
+    }
+
+    merge->kv = **min;
+    *min = db_range_next(&merge->ranges[min - merge->heads]);
+    return &merge->kv;
+}
+
+void
+db_merge_free(struct db_merge *merge)
+{
+    free(merge->ranges);
+    free(merge->heads);
+}
+
+int
+kv_parse(struct kv *kv, char *str)
+{
+    char *s = str;
+    char *token = NULL;
+    int i = 0;
+
+    int k;
+    char *v;
+
+    while ((token = strsep(&s, ",")) != NULL) {
+        switch (i) {
+        case 0:
+            k = atoi(token);
+            break;
+        case 1:
+            v = token;
+            break;
+        default:
+            fprintf(stderr, "Invalid key-value pair: %s\n", str);
+            return 1;
+        }
+
+        i++;
+    }
+
+    if (i < 2) {
+        fprintf(stderr, "Invalid key-value pair: %s\n", str);
+        return 1;
+    }
+
+    kv->k = k;
+    kv->v = v;
+
+    return 0;
+}
+
+// Text snapshots smaller than this per thread are not worth splitting up when
+// db_read() picks the number of threads itself
+#define LOAD_MIN_CHUNK (4 * 1024 * 1024)
+
+// A parsed line whose value has yet to be inserted
+struct load_rec {
+    int k;
+    uint32_t len;
+    const char *v;
+};
+
+struct load_bucket {
+    struct load_rec *recs;
+    size_t len;
+    size_t cap;
+};
+
+// One thread's share of a parallel load. In the first phase it parses the
+// lines from start to end into one bucket per partition. In the second it
+// inserts the buckets of every thread into the partitions it owns.
+struct load_part {
+    struct load *load;
+    size_t id;
+    const char *start;
+    const char *end;
+    struct load_bucket *buckets;
+};
+
+struct load {
+    struct db *dbs;
+    size_t ndbs;
+    struct load_part *parts;
+    size_t nparts;
+};
+
+// Returns which of n partitions key belongs to. Databases split into several
+// partitions, like the shards of kvd, are split by this.
+size_t
+db_partition(int key, size_t n)
+{
+    return ((uint32_t)key * 2654435761u) % n;
+}
+
+static void
+load_add(struct load_bucket *b, int k, const char *v, size_t len)
+{
+    if (b->len == b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 1024;
+        b->recs = realloc(b->recs, b->cap * sizeof(*b->recs));
+        if (!b->recs) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    b->recs[b->len].k = k;
+    b->recs[b->len].len = len;
+    b->recs[b->len].v = v;
+    b->len++;
+}
+
+// Parses the lines of a chunk of a mapped text snapshot. Lines are validated
+// the way kv_parse() does, but nothing is copied: values are referenced in
+// the mapping. With no buckets, entries go straight into the databases.
+static void *
+load_parse(void *arg)
+{
+    struct load_part *part = arg;
+    struct load *load = part->load;
+    const char *p = part->start;
+    while (p < part->end) {
+        const char *nl = memchr(p, '\n', part->end - p);
+        const char *eol = nl ? nl : part->end;
+        const char *comma = memchr(p, ',', eol - p);
+        if (!comma || memchr(comma + 1, ',', eol - comma - 1)) {
+            fprintf(stderr, "Invalid key-value pair: %.*s\n", (int)(eol - p), p);
+            exit(1);
+        }
+
+        // Parsing stops at the comma, as atoi() would
+        int k = (int)strtol(p, NULL, 10);
+        const char *v = comma + 1;
+        size_t d = db_partition(k, load->ndbs);
+        if (part->buckets) {
+            load_add(&part->buckets[d], k, v, eol - v);
+        } else {
+            db_insert_len(&load->dbs[d], k, v, eol - v);
+        }
+
+        p = eol + 1;
+    }
+
+    return NULL;
+}
+
+// Fills the partitions owned by a thread. Buckets are taken in the order of
+// the chunks they were parsed from, so a key listed more than once ends up
+// with its last value.
+static void *
+load_insert(void *arg)
+{
+    struct load_part *part = arg;
+    struct load *load = part->load;
+    for (size_t d = part->id; d < load->ndbs; d += load->nparts) {
+        for (size_t i = 0; i < load->nparts; i++) {
+            struct load_bucket *b = &load->parts[i].buckets[d];
+            for (size_t j = 0; j < b->len; j++) {
+                db_insert_len(&load->dbs[d], b->recs[j].k, b->recs[j].v, b->recs[j].len);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Runs fn on every part, in threads of its own but for the first
+static void
+load_run(struct load *load, size_t nparts, void *(*fn)(void *))
+{
+    pthread_t *threads = malloc(nparts * sizeof(*threads));
+    if (!threads) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (size_t i = 1; i < nparts; i++) {
+        if (pthread_create(&threads[i], NULL, fn, &load->parts[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    fn(&load->parts[0]);
+    for (size_t i = 1; i < nparts; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+// Loads the text snapshot at filename into ndbs databases, split among them by
+// db_partition(). The file is parsed by nthreads threads, each taking a run of
+// whole lines, and the databases are then filled in parallel. With nthreads 0,
+// a thread is used for every few MiB of file, up to the number of CPUs.
+// Returns the size of the snapshot in bytes.
+off_t
+db_read(struct db *dbs, size_t ndbs, const char *filename, size_t nthreads)
+{
+    for (size_t i = 0; i < ndbs; i++) {
+        db_init(&dbs[i]);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            // File does not exist yet, simply return
+            return 0;
+        }
+
+        perror("open");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        perror("fstat");
+        exit(1);
+    }
+
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    if (close(fd)) {
+        perror("close");
+    }
+
+    if (nthreads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = size / LOAD_MIN_CHUNK + 1;
+        if (ncpus > 0 && nthreads > (size_t)ncpus) {
+            nthreads = ncpus;
+        }
+    }
+
+    // The file is parsed front to back, so the pages ahead are worth reading
+    // in early
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    struct load load = { dbs, ndbs, NULL, nthreads };
+    load.parts = calloc(nthreads, sizeof(*load.parts));
+    if (!load.parts) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // Chunks end just past a newline, so no line is split between threads
+    const char *end = base + size;
+    const char *p = base;
+    for (size_t i = 0; i < nthreads; i++) {
+        struct load_part *part = &load.parts[i];
+        part->load = &load;
+        part->id = i;
+        part->start = p;
+        const char *cut = base + size / nthreads * (i + 1);
+        if (i + 1 == nthreads) {
+            p = end;
+        } else if (cut > p) {
+            const char *nl = memchr(cut - 1, '\n', end - cut + 1);
+            p = nl ? nl + 1 : end;
+        }
+        part->end = p;
+
+        // A single thread can insert as it parses
+        if (nthreads > 1) {
+            part->buckets = calloc(ndbs, sizeof(*part->buckets));
+            if (!part->buckets) {
+                perror("calloc");
+                exit(1);
+            }
+        }
+    }
+
+    load_run(&load, nthreads, load_parse);
+    if (nthreads > 1) {
+        load_run(&load, nthreads < ndbs ? nthreads : ndbs, load_insert);
+    }
+
+    for (size_t i = 0; i < nthreads; i++) {
+        if (load.parts[i].buckets) {
+            for (size_t d = 0; d < ndbs; d++) {
+                free(load.parts[i].buckets[d].recs);
+            }
+            free(load.parts[i].buckets);
+        }
+    }
+
+    free(load.parts);
+    if (munmap(base, size)) {
+        perror("munmap");
+    }
+
+    return size;
+}
+
+// Writes the whole of the ndbs databases in dbs to filename. The snapshot is
+// written to a temporary file first and renamed into place so that a crash
+// never leaves a partially written snapshot behind.
+void
+db_write(struct db *dbs, size_t ndbs, const char *filename)
+{
+    char tmp[FILENAME_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        perror("fopen");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < ndbs; i++) {
+        struct db_iter iter;
+        struct kv *kv;
+        db_iter_init(&dbs[i], &iter);
+        while ((kv = db_iter_next(&iter)) != NULL) {
+            fprintf(fp, "%d,%s\n", kv->k, kv->v);
+        }
+    }
+
+    if (fclose(fp)) {
+        perror("fclose");
+        exit(1);
+    }
+
+    if (rename(tmp, filename)) {
+        perror("rename");
+        exit(1);
+    }
+}
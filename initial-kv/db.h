@@ -0,0 +1,100 @@
+#ifndef __DB_H__
+#define __DB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "arena.h"
+#include "btree.h"
+
+struct kv {
+    int k;
+    char *v;
+};
+
+// An open-addressing hash table with linear probing. Slots hold the key and
+// value pointer inline so a probe sequence walks consecutive memory.
+struct table {
+    struct kv *slots;
+    size_t cap;
+    size_t len;
+    size_t used;
+    uint32_t seed;
+};
+
+// Growing the table is done incrementally: when cur fills up it becomes old
+// and every subsequent mutation moves a few slots from old into the new cur,
+// so no single insert has to rehash the whole database.
+struct db {
+    struct table cur;
+    struct table old;
+    size_t migrate;
+    struct arena arena;
+
+    // Every key is also kept in key order for range scans
+    struct btree index;
+
+    // Values within this range live in a snapshot mapped by the caller. They
+    // are referenced in place and never freed by the table.
+    const char *borrowed;
+    size_t nborrowed;
+};
+
+struct db_iter {
+    struct db *db;
+    struct table *t;
+    size_t n;
+};
+
+struct db_range {
+    struct btree_iter iter;
+    int hi;
+    struct kv kv;
+};
+
+struct db_merge {
+    struct db_range *ranges;
+    struct kv **heads;
+    size_t n;
+    struct kv kv;
+};
+
+// Shape of the tables of a database, for sizing them and spotting keys that
+// hash badly. Probe lengths count the slots a successful lookup examines.
+struct db_stats {
+    size_t len;
+    size_t cap;
+    size_t tombstones;
+    size_t longest_probe;
+    size_t total_probe;
+    int resizing;
+};
+
+void db_init(struct db *db);
+void db_insert(struct db *db, int key, const char *val);
+void db_insert_len(struct db *db, int key, const char *val, size_t len);
+void db_borrow(struct db *db, const char *base, size_t len);
+void db_insert_borrowed(struct db *db, int key, char *val);
+void db_delete(struct db *db, int key);
+const char *db_get(struct db *db, int key);
+size_t db_len(struct db *db);
+void db_stats(struct db *db, struct db_stats *st);
+void db_clear(struct db *db);
+
+void db_iter_init(struct db *db, struct db_iter *iter);
+struct kv *db_iter_next(struct db_iter *iter);
+
+void db_range_init(struct db *db, struct db_range *range, int lo, int hi);
+struct kv *db_range_next(struct db_range *range);
+
+void db_merge_init(struct db_merge *merge, struct db *dbs, size_t ndbs, int lo, int hi);
+struct kv *db_merge_next(struct db_merge *merge);
+void db_merge_free(struct db_merge *merge);
+
+int kv_parse(struct kv *kv, char *str);
+size_t db_partition(int key, size_t n);
+off_t db_read(struct db *dbs, size_t ndbs, const char *filename, size_t nthreads);
+void db_write(struct db *dbs, size_t ndbs, const char *filename);
+
+#endif // __DB_H__
@@ -0,0 +1,85 @@
+// Measures insert and lookup throughput of the in-memory table.
+//
+//     make bench
+//     ./db_bench 1000 1000000 10000000
+//
+// Keys are inserted in a scattered order and looked up in a different one so
+// that neither pass walks the table sequentially.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "db.h"
+
+// Every size is run enough times to perform at least this many operations
+#define MIN_OPS 1000000
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Multiplying by an odd constant is a bijection on 32-bit integers, so this
+// yields n distinct keys in an order unrelated to i
+static int
+key(size_t i, uint32_t mult)
+{
+    return (int)((uint32_t)i * mult);
+}
+
+static void
+bench(size_t n)
+{
+    size_t rounds = n < MIN_OPS ? MIN_OPS / n : 1;
+    double insert = 0.0;
+    double lookup = 0.0;
+    size_t found = 0;
+
+    for (size_t r = 0; r < rounds; r++) {
+        struct db db;
+        db_init(&db);
+
+        double t0 = now();
+        for (size_t i = 0; i < n; i++) {
+            db_insert(&db, key(i, 2654435761u), "value");
+        }
+
+        double t1 = now();
+        for (size_t i = 0; i < n; i++) {
+            found += db_get(&db, key(n - 1 - i, 2654435761u)) != NULL;
+        }
+
+        double t2 = now();
+        insert += t1 - t0;
+        lookup += t2 - t1;
+        db_clear(&db);
+    }
+
+    if (found != n * rounds) {
+        fprintf(stderr, "lookups found %zu of %zu keys\n", found, n * rounds);
+        exit(1);
+    }
+
+    printf("%10zu keys: insert %7.2f Mops/s, lookup %7.2f Mops/s\n", n,
+        n * rounds / insert / 1e6, n * rounds / lookup / 1e6);
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s nkeys...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        bench(strtoull(argv[i], NULL, 10));
+    }
+
+    return 0;
+}
@@ -0,0 +1,480 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cmd.h"
+#include "db.h"
+#include "idx.h"
+#include "stats.h"
+
+// Bloom filter sizing: 10 bits and 7 probes per key give about 1% false
+// positives
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+
+static uint64_t
+bloom_hash(int key)
+{
+    uint64_t h = (uint32_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Returns the n-th of the bit positions key sets in a filter of nbits bits
+static uint64_t
+bloom_bit(uint64_t h, uint64_t n, uint64_t nbits)
+{
+    uint64_t h1 = h & 0xffffffff;
+    uint64_t h2 = (h >> 32) | 1;
+    return (h1 + n * h2) % nbits;
+}
+
+static int
+bloom_test(struct idx *idx, int key)
+{
+    uint64_t h = bloom_hash(key);
+    for (uint64_t n = 0; n < idx->nhashes; n++) {
+        uint64_t bit = bloom_bit(h, n, idx->nbits);
+        if (!(idx->bloom[bit / 64] & (1ull << (bit % 64)))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int
+idx_matches(const struct idx_header *hdr, struct stat *st)
+{
+    return hdr->db_ino == (uint64_t)st->st_ino
+        && hdr->db_size == (uint64_t)st->st_size
+        && hdr->db_mtime_sec == st->st_mtim.tv_sec
+        && hdr->db_mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+// Maps the index at filename for dbfile, a text snapshot or the log. Returns
+// -1 if there is no index or it was built from a different version of dbfile.
+int
+idx_open(struct idx *idx, const char *filename, const char *dbfile)
+{
+    // A missing file has no index
+    struct stat dbst;
+    int dbfd = open(dbfile, O_RDONLY);
+    if (dbfd < 0) {
+        if (errno == ENOENT) {
+            return -1;
+        }
+
+        perror("open");
+        exit(1);
+    }
+
+    if (fstat(dbfd, &dbst)) {
+        perror("fstat");
+        exit(1);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            close(dbfd);
+            return -1;
+        }
+
+        perror("open");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        perror("fstat");
+        exit(1);
+    }
+
+    size_t size = st.st_size;
+    void *base = NULL;
+    if (size >= sizeof(struct idx_header)) {
+        base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+    }
+
+    if (close(fd)) {
+        perror("close");
+    }
+
+    // Anything that does not look right is rebuilt rather than reported: the
+    // index holds nothing that is not also in the snapshot
+    const struct idx_header *hdr = base;
+    if (!base
+            || memcmp(hdr->magic, IDX_MAGIC, sizeof(hdr->magic))
+            || !idx_matches(hdr, &dbst)
+            || hdr->nbits == 0 || hdr->nbits % 64
+            || size != sizeof(*hdr) + hdr->nbits / 8 + hdr->count * sizeof(struct idx_entry)) {
+        if (base) {
+            munmap(base, size);
+        }
+        close(dbfd);
+        return -1;
+    }
+
+    idx->base = base;
+    idx->size = size;
+    idx->bloom = (const uint64_t *)(hdr + 1);
+    idx->nbits = hdr->nbits;
+    idx->nhashes = hdr->nhashes;
+    idx->index = (const struct idx_entry *)(idx->bloom + idx->nbits / 64);
+    idx->count = hdr->count;
+    idx->flags = hdr->flags;
+    idx->fd = dbfd;
+    idx->buf = NULL;
+    idx->bufcap = 0;
+
+    return 0;
+}
+
+void
+idx_close(struct idx *idx)
+{
+    if (munmap(idx->base, idx->size)) {
+        perror("munmap");
+    }
+
+    if (idx->fd >= 0 && close(idx->fd)) {
+        perror("close");
+    }
+
+    free(idx->buf);
+    memset(idx, 0, sizeof(*idx));
+}
+
+// Looks key up in the index and reads just its value from the indexed file
+// into *val, or sets it to NULL for a key the log deletes. Returns 0 if the
+// index has no entry for key. The value is only valid until the next call.
+int
+idx_find(struct idx *idx, int key, const char **val)
+{
+    *val = NULL;
+    if (!bloom_test(idx, key)) {
+        return 0;
+    }
+
+    const struct idx_entry *e = NULL;
+    size_t lo = 0;
+    size_t hi = idx->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->index[mid].k == key) {
+            e = &idx->index[mid];
+            break;
+        }
+
+        if (idx->index[mid].k < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!e) {
+        return 0;
+    }
+
+    if (e->len == IDX_DELETED) {
+        return 1;
+    }
+
+    if (e->len + 1 > idx->bufcap) {
+        idx->bufcap = e->len + 1;
+        idx->buf = realloc(idx->buf, idx->bufcap);
+        if (!idx->buf) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    if (pread(idx->fd, idx->buf, e->len, e->off) != e->len) {
+        perror("pread");
+        exit(1);
+    }
+
+    idx->buf[e->len] = '\0';
+    stats_read(e->len);
+    *val = idx->buf;
+    return 1;
+}
+
+// Looks key up in the index of a text snapshot, as idx_find() does. Returns
+// NULL if key has no value.
+const char *
+idx_get(struct idx *idx, int key)
+{
+    const char *val;
+    idx_find(idx, key, &val);
+    return val;
+}
+
+static int
+compare_entry(const void *a, const void *b)
+{
+    const struct idx_entry *x = a;
+    const struct idx_entry *y = b;
+    if (x->k != y->k) {
+        return (x->k > y->k) - (x->k < y->k);
+    }
+
+    return (x->off > y->off) - (x->off < y->off);
+}
+
+// Appends an entry for key to *index, which holds *count of *cap entries
+static void
+idx_add(struct idx_entry **index, size_t *count, size_t *cap, int key, uint32_t len,
+    uint64_t off)
+{
+    if (*count == *cap) {
+        *cap = *cap ? 2 * *cap : 1024;
+        *index = realloc(*index, *cap * sizeof(**index));
+        if (!*index) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    (*index)[*count].k = key;
+    (*index)[*count].len = len;
+    (*index)[*count].off = off;
+    (*count)++;
+}
+
+// Writes the index of the count entries in index, of the file described by
+// dbst, to filename. Frees index. Returns -1 if the index cannot be created.
+static int
+idx_write(const char *filename, struct stat *dbst, struct idx_entry *index, size_t count,
+    uint64_t flags)
+{
+    // A key listed more than once takes its last value, as with db_read()
+    if (count > 1) {
+        qsort(index, count, sizeof(*index), compare_entry);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (n > 0 && index[n - 1].k == index[i].k) {
+            n--;
+        }
+        index[n++] = index[i];
+    }
+    count = n;
+
+    struct idx_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IDX_MAGIC, sizeof(hdr.magic));
+    hdr.db_ino = dbst->st_ino;
+    hdr.db_size = dbst->st_size;
+    hdr.db_mtime_sec = dbst->st_mtim.tv_sec;
+    hdr.db_mtime_nsec = dbst->st_mtim.tv_nsec;
+    hdr.count = count;
+    hdr.flags = flags;
+    hdr.nbits = (count * BLOOM_BITS_PER_KEY + 63) / 64 * 64;
+    if (hdr.nbits == 0) {
+        hdr.nbits = 64;
+    }
+    hdr.nhashes = BLOOM_HASHES;
+
+    uint64_t *bloom = calloc(hdr.nbits / 64, sizeof(*bloom));
+    if (!bloom) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t h = bloom_hash(index[i].k);
+        for (uint64_t j = 0; j < hdr.nhashes; j++) {
+            uint64_t bit = bloom_bit(h, j, hdr.nbits);
+            bloom[bit / 64] |= 1ull << (bit % 64);
+        }
+    }
+
+    char tmp[FILENAME_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+    int ret = -1;
+    FILE *out = fopen(tmp, "w");
+    if (out) {
+        if (fwrite(&hdr, sizeof(hdr), 1, out) != 1
+                || fwrite(bloom, sizeof(*bloom), hdr.nbits / 64, out) != hdr.nbits / 64
+                || (count && fwrite(index, sizeof(*index), count, out) != count)) {
+            perror("fwrite");
+            exit(1);
+        }
+
+        if (fclose(out)) {
+            perror("fclose");
+            exit(1);
+        }
+
+        if (rename(tmp, filename)) {
+            perror("rename");
+            exit(1);
+        }
+
+        stats_written(sizeof(hdr) + hdr.nbits / 8 + count * sizeof(*index));
+        ret = 0;
+    }
+
+    free(bloom);
+    free(index);
+    return ret;
+}
+
+// Opens dbfile to be indexed into filename, filling in *dbst. Returns NULL if
+// there is no dbfile, after removing any index left over from an earlier one.
+static FILE *
+idx_source(const char *filename, const char *dbfile, struct stat *dbst)
+{
+    FILE *fp = fopen(dbfile, "r");
+    if (!fp) {
+        if (errno == ENOENT) {
+            if (unlink(filename) && errno != ENOENT) {
+                perror("unlink");
+            }
+            return NULL;
+        }
+
+        perror("fopen");
+        exit(1);
+    }
+
+    if (fstat(fileno(fp), dbst)) {
+        perror("fstat");
+        exit(1);
+    }
+
+    return fp;
+}
+
+// Indexes the text snapshot dbfile into filename, without keeping any of the
+// values in memory. Returns -1 if the index cannot be created, e.g. because
+// the directory is read-only, or if there is no snapshot to index, in which
+// case an index left over from an earlier one is removed.
+int
+idx_build(const char *filename, const char *dbfile)
+{
+    struct stat dbst;
+    FILE *fp = idx_source(filename, dbfile, &dbst);
+    if (!fp) {
+        return -1;
+    }
+
+    struct idx_entry *index = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t sz = 0;
+    uint64_t off = 0;
+    struct kv kv;
+    while ((sz = getline(&line, &linecap, fp)) > 0) {
+        size_t len = sz;
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        if (kv_parse(&kv, line)) {
+            exit(1);
+        }
+
+        idx_add(&index, &count, &cap, kv.k, strlen(kv.v), off + (kv.v - line));
+
+        off += sz;
+    }
+
+    if (sz < 0 && ferror(fp)) {
+        perror("getline");
+        exit(1);
+    }
+
+    free(line);
+    if (fclose(fp)) {
+        perror("fclose");
+    }
+
+    stats_read(off);
+    return idx_write(filename, &dbst, index, count, 0);
+}
+
+// Indexes the log at logfile into filename, as idx_build() does a text
+// snapshot, so that a get can find the last record of its key without
+// replaying the log. A final record without a trailing newline is ignored,
+// as log_replay() ignores it. Returns -1 as idx_build() does.
+int
+idx_build_log(const char *filename, const char *logfile)
+{
+    struct stat logst;
+    FILE *fp = idx_source(filename, logfile, &logst);
+    if (!fp) {
+        return -1;
+    }
+
+    struct idx_entry *index = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    uint64_t flags = 0;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t sz = 0;
+    uint64_t off = 0;
+    struct cmd cmd;
+    while ((sz = getline(&line, &linecap, fp)) > 0) {
+        if (line[sz - 1] != '\n') {
+            break;
+        }
+
+        line[sz - 1] = '\0';
+        if (cmd_parse(&cmd, line)) {
+            exit(1);
+        }
+
+        switch (cmd.type) {
+        case CMD_PUT:
+            idx_add(&index, &count, &cap, cmd.kv.k, strlen(cmd.kv.v), off + (cmd.kv.v - line));
+            break;
+        case CMD_DEL:
+            idx_add(&index, &count, &cap, cmd.kv.k, IDX_DELETED, off);
+            break;
+        case CMD_CLR:
+            // Nothing logged before a clear matters any more
+            count = 0;
+            flags |= IDX_CLEARED;
+            break;
+        default:
+            fprintf(stderr, "Invalid log record at offset %lld\n", (long long)off);
+            exit(1);
+        }
+
+        off += sz;
+    }
+
+    if (sz < 0 && ferror(fp)) {
+        perror("getline");
+        exit(1);
+    }
+
+    free(line);
+    if (fclose(fp)) {
+        perror("fclose");
+    }
+
+    stats_read(off);
+    return idx_write(filename, &logst, index, count, flags);
+}
@@ -0,0 +1,72 @@
+#ifndef __IDX_H__
+#define __IDX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A sidecar index lets single-key gets be answered from a text snapshot, or
+// from the log, without parsing all of it. It is laid out to be queried from
+// a memory mapping:
+//
+//     struct idx_header
+//     uint64_t[nbits / 64]         Bloom filter over the keys
+//     struct idx_entry[count]      sorted by key
+//
+// The header records the identity of the file the index was built from, so
+// an index left behind by an older version of it is never used. All integers
+// are stored in native byte order.
+//
+// An index of the log has an entry for the last record of each key since the
+// last clear, deletes included, and is flagged IDX_CLEARED if there was one.
+
+#define IDX_MAGIC "KVIDX02"
+
+// The log cleared the database, so keys it does not list have no value
+#define IDX_CLEARED 1
+
+// The entry of a key the log deletes
+#define IDX_DELETED UINT32_MAX
+
+struct idx_header {
+    char magic[8];
+    uint64_t db_ino;
+    uint64_t db_size;
+    int64_t db_mtime_sec;
+    int64_t db_mtime_nsec;
+    uint64_t count;
+    uint64_t nbits;
+    uint64_t nhashes;
+    uint64_t flags;
+};
+
+// Locates the value of key k: len bytes at offset off in the indexed file
+struct idx_entry {
+    int32_t k;
+    uint32_t len;
+    uint64_t off;
+};
+
+struct idx {
+    void *base;
+    size_t size;
+    const uint64_t *bloom;
+    uint64_t nbits;
+    uint64_t nhashes;
+    const struct idx_entry *index;
+    size_t count;
+    uint64_t flags;
+
+    // The indexed file, and room for the value last read from it
+    int fd;
+    char *buf;
+    size_t bufcap;
+};
+
+int idx_open(struct idx *idx, const char *filename, const char *dbfile);
+void idx_close(struct idx *idx);
+int idx_find(struct idx *idx, int key, const char **val);
+const char *idx_get(struct idx *idx, int key);
+int idx_build(const char *filename, const char *dbfile);
+int idx_build_log(const char *filename, const char *logfile);
+
+#endif // __IDX_H__
@@ -1,192 +1,171 @@
-#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define BUCKETS 64
-
-struct kv {
-    int k;
-    char *v;
-};
-
-struct entry {
-    struct kv kv;
-    struct entry *next;
-};
-
-struct db {
-    struct entry *entries[BUCKETS];
-};
-
-struct db_iter {
-    struct db *db;
-    size_t n;
-    struct entry *ent;
-};
-
-struct cmd {
-    enum {
-        CMD_PUT,
-        CMD_GET,
-        CMD_CLR,
-        CMD_ALL,
-        CMD_DEL,
-    } type;
-    struct kv kv;
+#include <unistd.h>
+
+#include "cmd.h"
+#include "db.h"
+#include "idx.h"
+#include "snap.h"
+#include "stats.h"
+#include "store.h"
+
+// Runs that only get keys leave the snapshot unloaded. Keys are looked up in
+// the index of the log first, and those it knows nothing about in the mapped
+// binary snapshot, or through the index of the text one. Without an index of
+// the log, it is replayed into this overlay instead.
+struct overlay {
+    struct db put;
+    struct db deleted;
+    int cleared;
+
+    // Takes the place of put, deleted and cleared if it is open
+    struct idx log;
+    int indexed;
 };
 
-int
-kv_parse(struct kv *kv, char *str)
+void
+overlay_apply(struct cmd *cmd, void *arg)
 {
-    char *s = str;
-    char *token = NULL;
-    int i = 0;
-
-    int k;
-    char *v;
-
-    while ((token = strsep(&s, ",")) != NULL) {
-        switch (i) {
-        case 0:
-            k = atoi(token);
-            break;
-        case 1:
-            v = token;
-            break;
-        default:
-            fprintf(stderr, "Invalid key-value pair: %s\n", str);
-            return 1;
-        }
-
-        i++;
-    }
-
-    if (i < 2) {
-        fprintf(stderr, "Invalid key-value pair: %s\n", str);
-        return 1;
+    struct overlay *o = arg;
+    switch (cmd->type) {
+    case CMD_PUT:
+        db_insert(&o->put, cmd->kv.k, cmd->kv.v);
+        db_delete(&o->deleted, cmd->kv.k);
+        break;
+    case CMD_DEL:
+        db_delete(&o->put, cmd->kv.k);
+        db_insert(&o->deleted, cmd->kv.k, "");
+        break;
+    case CMD_CLR:
+        db_clear(&o->put);
+        db_clear(&o->deleted);
+        o->cleared = 1;
+        break;
+    default:
+        break;
     }
-
-    kv->k = k;
-    kv->v = v;
-
-    return 0;
 }
 
-void
-db_insert(struct db *db, int key, char *val)
+const char *
+overlay_get(struct overlay *o, struct snap *snap, struct idx *idx, int key)
 {
-    size_t n = key % BUCKETS;
-    struct entry *cur = db->entries[n];
-    struct entry *parent = NULL;
-    while (cur) {
-        if (cur->kv.k == key) {
-            break;
+    const char *v = NULL;
+    if (o->indexed) {
+        if (idx_find(&o->log, key, &v) || (o->log.flags & IDX_CLEARED)) {
+            return v;
         }
-        parent = cur;
-        cur = cur->next;
-    }
-
-    if (!cur) {
-        cur = malloc(sizeof(*cur));
-        if (!cur) {
-            perror("malloc");
-            exit(1);
+    } else {
+        v = db_get(&o->put, key);
+        if (v || o->cleared || db_get(&o->deleted, key)) {
+            return v;
         }
+    }
 
-        cur->kv.k = key;
-        cur->next = NULL;
+    return snap ? snap_get(snap, key) : idx_get(idx, key);
+}
 
-        if (parent) {
-            parent->next = cur;
-        } else {
-            db->entries[n] = cur;
-        }
-    } else {
-        free(cur->kv.v);
+// Maps the index at filename of file, building it first with build if it is
+// missing or out of date. Returns -1 if there is no file or the index cannot
+// be built.
+int
+open_index(struct idx *idx, const char *filename, const char *file,
+    int (*build)(const char *, const char *))
+{
+    if (idx_open(idx, filename, file) == 0) {
+        return 0;
+    }
 
+    if (build(filename, file)) {
+        return -1;
     }
 
-    cur->kv.v = strdup(val);
+    return idx_open(idx, filename, file);
 }
 
 void
-db_delete(struct db *db, int key)
+run_readonly(struct cmd *cmds, int ncmds, struct snap *snap, struct idx *idx)
 {
-    size_t n = key % BUCKETS;
-    struct entry *cur = db->entries[n];
-    struct entry *parent = NULL;
-    while (cur) {
-        if (cur->kv.k == key) {
-            break;
-        }
-        parent = cur;
-        cur = cur->next;
+    struct overlay o;
+    db_init(&o.put);
+    db_init(&o.deleted);
+    o.cleared = 0;
+
+    uint64_t start = stats_now();
+    o.indexed = open_index(&o.log, LOG_IDX_FILE, LOG_FILE, idx_build_log) == 0;
+    if (!o.indexed) {
+        log_replay(LOG_FILE, overlay_apply, &o);
     }
+    stats_loaded(start);
 
-    if (!cur) {
-        return;
+    for (int i = 0; i < ncmds; i++) {
+        start = stats_now();
+        kv_print(stdout, cmds[i].kv.k, overlay_get(&o, snap, idx, cmds[i].kv.k));
+        stats_command(cmds[i].type, start);
     }
 
-    if (parent) {
-        parent->next = cur->next;
-    } else {
-        db->entries[n] = cur->next;
+    // The snapshot is never loaded, so there is no table to describe
+    if (getenv(STATS_ENV)) {
+        stats_print(stderr, NULL, 0);
     }
 
-    free(cur->kv.v);
-    free(cur);
+    if (o.indexed) {
+        idx_close(&o.log);
+    }
+    db_clear(&o.put);
+    db_clear(&o.deleted);
 }
 
-const char *
-db_get(struct db *db, int key)
+void
+run(struct cmd *cmds, int ncmds, struct snap *snap, size_t nthreads)
 {
-    size_t n = key % BUCKETS;
-    struct entry *cur = db->entries[n];
-    while (cur) {
-        if (cur->kv.k == key) {
-            break;
-        }
-        cur = cur->next;
+    struct store st;
+    store_open(&st, snap, nthreads);
+    for (int i = 0; i < ncmds; i++) {
+        store_handle(&st, &cmds[i]);
     }
 
-    if (cur) {
-        return cur->kv.v;
-    }
-
-    return NULL;
+    store_close(&st);
 }
 
-void
-db_read(struct db *db, const char *filename)
+// Streams commands, one per line, from fp. The database is loaded once and
+// synced every interval commands (0 for only at the end). Invalid lines are
+// reported and skipped. Returns the number of invalid lines.
+size_t
+run_batch(FILE *fp, size_t interval, struct snap *snap, size_t nthreads)
 {
-    memset(db, 0, sizeof(*db));
+    static char inbuf[1 << 16];
+    static char outbuf[1 << 16];
+    setvbuf(fp, inbuf, _IOFBF, sizeof(inbuf));
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        if (errno == ENOENT) {
-            // File does not exist yet, simply return
-            return;
-        }
-
-        perror("fopen");
-        exit(1);
-    }
+    struct store st;
+    store_open(&st, snap, nthreads);
 
     char *line = NULL;
     size_t linecap = 0;
     ssize_t sz = 0;
-    struct kv kv;
+    size_t n = 0;
+    size_t bad = 0;
+    struct cmd cmd;
     while ((sz = getline(&line, &linecap, fp)) > 0) {
         if (line[sz - 1] == '\n') {
             line[sz - 1] = '\0';
         }
 
-        if (kv_parse(&kv, line)) {
-            exit(1);
+        if (!line[0]) {
+            continue;
+        }
+
+        if (cmd_parse(&cmd, line)) {
+            bad++;
+            continue;
         }
 
-        db_insert(db, kv.k, kv.v);
+        store_handle(&st, &cmd);
+        if (interval && ++n % interval == 0) {
+            store_sync(&st);
+        }
     }
 
     if (sz < 0 && ferror(fp)) {
@@ -198,233 +177,130 @@ db_read(struct db *db, const char *filename)
         free(line);
     }
 
-    if (fclose(fp)) {
-        perror("fclose");
-    }
-}
+    store_close(&st);
 
-void
-db_write(struct db *db, const char *filename)
-{
-    FILE *fp = fopen(filename, "w");
-    if (!fp) {
-        perror("fopen");
+    if (fflush(stdout)) {
+        perror("fflush");
         exit(1);
     }
 
-    for (size_t n = 0; n < BUCKETS; n++) {
-        struct entry *cur = db->entries[n];
-        while (cur) {
-            fprintf(fp, "%d,%s\n", cur->kv.k, cur->kv.v);
-            cur = cur->next;
-        }
-    }
-
-    if (fclose(fp)) {
-        perror("fclose");
-    }
-}
-
-void
-db_clear(struct db *db)
-{
-    for (size_t n = 0; n < BUCKETS; n++) {
-        struct entry *cur = db->entries[n];
-        struct entry *tmp = NULL;
-        while (cur) {
-            tmp = cur->next;
-            free(cur->kv.v);
-            free(cur);
-            cur = tmp;
-        }
-
-        db->entries[n] = NULL;
-    }
+    return bad;
 }
 
 void
-db_iter_init(struct db *db, struct db_iter *iter)
+usage()
 {
-    iter->db = db;
-    iter->n = 0;
-    iter->ent = db->entries[0];
+    fprintf(stderr, "usage: kv [-j threads] command...\n"
+            "       kv [-j threads] [-i interval] -f file\n"
+            "       kv [-j threads] [-i interval] -\n");
 }
 
-struct kv *
-db_iter_next(struct db_iter *iter)
+int
+main(int argc, char *argv[])
 {
-    struct kv *kv = NULL;
-    struct entry *cur = iter->ent;
-    while (!cur) {
-        if (iter->n >= BUCKETS - 1) {
-            return NULL;
-        }
-
-        cur = iter->db->entries[++(iter->n)];
+    if (argc < 2) {
+        return 0;
     }
 
-    kv = &cur->kv;
-    iter->ent = cur->next;
-    return kv;
-}
-
-int
-cmd_parse(struct cmd *cmd, char *str)
-{
-    char *s = str;
-    char *token = NULL;
-    char *type = NULL;
-    char *k = NULL;
-    char *v = NULL;
-    int i = 0;
-
-    while ((token = strsep(&s, ","))  != NULL) {
-        switch (i) {
-        case 0:
-            type = token;
+    int c;
+    char *batch = NULL;
+    size_t interval = 0;
+    size_t nthreads = 0;
+    while ((c = getopt(argc, argv, "f:i:j:h")) != -1) {
+        switch (c) {
+        case 'f':
+            batch = optarg;
             break;
-        case 1:
-            k = token;
+        case 'i':
+            interval = strtoul(optarg, NULL, 10);
             break;
-        case 2:
-            v = token;
+        case 'j':
+            nthreads = strtoul(optarg, NULL, 10);
             break;
+        case 'h':
+            usage();
+            exit(0);
         default:
-            fprintf(stderr, "Invalid command: '%s'\n", str);
-            return 1;
+            usage();
+            exit(1);
         }
-        i++;
     }
 
-    if (!strcmp(type, "p")) {
-        cmd->type = CMD_PUT;
-    } else if (!strcmp(type, "g")) {
-        cmd->type = CMD_GET;
-    } else if (!strcmp(type, "d")) {
-        cmd->type = CMD_DEL;
-    } else if (!strcmp(type, "c")) {
-        cmd->type = CMD_CLR;
-    } else if (!strcmp(type, "a")) {
-        cmd->type = CMD_ALL;
-    } else {
-        fprintf(stderr, "Invalid command: '%s'\n", str);
-        return 1;
+    if (!batch && optind < argc && !strcmp(argv[optind], "-")) {
+        batch = "-";
+        optind++;
     }
 
-    if (cmd->type == CMD_PUT || cmd->type == CMD_GET || cmd->type == CMD_DEL) {
-        if (k) {
-            cmd->kv.k = atoi(k);
-        } else {
-            fprintf(stderr, "Command is missing required key: '%s'\n", str);
-            return 1;
-        }
-    } else if (k) {
-        fprintf(stderr, "Command does not accept a key: '%s'\n", str);
-        return 1;
+    if (batch && optind < argc) {
+        usage();
+        exit(1);
     }
 
-    if (cmd->type == CMD_PUT) {
-        if (v) {
-            cmd->kv.v = v;
-        } else {
-            fprintf(stderr, "Command is missing required value: '%s'\n", str);
-            return 1;
+    struct snap snap;
+    struct snap *snapp = snap_open(&snap, SNAP_FILE) == 0 ? &snap : NULL;
+
+    if (batch) {
+        FILE *fp = stdin;
+        if (strcmp(batch, "-")) {
+            fp = fopen(batch, "r");
+            if (!fp) {
+                perror(batch);
+                exit(1);
+            }
         }
-    } else if (v) {
-        fprintf(stderr, "Command does not accept a value: '%s'\n", str);
-        return 1;
-    }
-
-    return 0;
-}
-
-void
-cmd_print(struct cmd *cmd)
-{
-    switch (cmd->type) {
-    case CMD_PUT:
-        printf("Put: %d = %s\n", cmd->kv.k, cmd->kv.v);
-        break;
-    case CMD_GET:
-        printf("Get: %d\n", cmd->kv.k);
-        break;
-    case CMD_DEL:
-        printf("Delete: %d\n", cmd->kv.k);
-        break;
-    case CMD_CLR:
-        printf("Clear\n");
-        break;
-    case CMD_ALL:
-        printf("All\n");
-        break;
-    }
-}
 
-void
-cmd_handle(struct cmd *cmd, struct db *db)
-{
-    struct kv *kv = &cmd->kv;
-    switch (cmd->type) {
-    case CMD_PUT: {
-        db_insert(db, kv->k, kv->v);
-        break;
-    }
-    case CMD_GET: {
-        const char *v = db_get(db, kv->k);
-        if (v) {
-            printf("%d,%s\n", kv->k, v);
-        } else {
-            printf("%d not found\n", kv->k);
+        size_t bad = run_batch(fp, interval, snapp, nthreads);
+        if (fp != stdin) {
+            fclose(fp);
         }
-        break;
-    }
-    case CMD_CLR:
-        db_clear(db);
-        break;
-    case CMD_ALL: {
-        struct db_iter iter;
-        db_iter_init(db, &iter);
-        while ((kv = db_iter_next(&iter)) != NULL) {
-            printf("%d,%s\n", kv->k, kv->v);
+
+        if (snapp) {
+            snap_close(snapp);
         }
-        break;
-    }
-    case CMD_DEL:
-        db_delete(db, kv->k);
-        break;
+
+        return bad ? 1 : 0;
     }
-}
 
-int
-main(int argc, char *argv[])
-{
-    if (argc < 2) {
+    argc -= optind;
+    argv += optind;
+    if (argc < 1) {
         return 0;
     }
 
-    struct db db;
-    db_read(&db, "database.txt");
-
-    int rc = 0;
-    for (int i = 1; i < argc; i++) {
-        char *s = strdup(argv[i]);
-        struct cmd cmd;
-        int rc = cmd_parse(&cmd, argv[i]);
-        if (rc) {
-            free(s);
-            rc = 1;
+    // Commands are all parsed up front so that a run consisting only of gets
+    // can be recognized and answered without loading the database
+    struct cmd *cmds = malloc(argc * sizeof(*cmds));
+    if (!cmds) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int ncmds = 0;
+    int readonly = 1;
+    for (int i = 0; i < argc; i++) {
+        if (cmd_parse(&cmds[ncmds], argv[i])) {
             break;
         }
 
-        cmd_handle(&cmd, &db);
-        free(s);
+        readonly = readonly && cmds[ncmds].type == CMD_GET;
+        ncmds++;
     }
 
-    if (rc == 0) {
-        db_write(&db, "database.txt");
+    struct idx idx;
+    if (readonly && snapp) {
+        run_readonly(cmds, ncmds, snapp, NULL);
+    } else if (readonly && open_index(&idx, IDX_FILE, DB_FILE, idx_build) == 0) {
+        run_readonly(cmds, ncmds, NULL, &idx);
+        idx_close(&idx);
+    } else {
+        run(cmds, ncmds, snapp, nthreads);
+    }
+
+    if (snapp) {
+        snap_close(snapp);
     }
 
-    db_clear(&db);
+    free(cmds);
 
-    return rc;
+    return 0;
 }
@@ -0,0 +1,54 @@
+// kvconv: converts a kv database snapshot between the text and the binary
+// format.
+//
+//     kvconv -b database.txt database.kvs      text to binary
+//     kvconv -t database.kvs database.txt      binary to text
+//
+// kv loads database.kvs in preference to database.txt whenever it exists, so
+// remove the file converted from once done. Records pending in database.log
+// are independent of the snapshot format and need no conversion.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "snap.h"
+
+void
+usage()
+{
+    fprintf(stderr, "usage: kvconv -b|-t infile outfile\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc != 4) {
+        usage();
+        exit(1);
+    }
+
+    struct db db;
+    if (!strcmp(argv[1], "-b")) {
+        db_read(&db, 1, argv[2], 0);
+        snap_write(&db, 1, argv[3]);
+        db_clear(&db);
+    } else if (!strcmp(argv[1], "-t")) {
+        struct snap snap;
+        if (snap_open(&snap, argv[2])) {
+            perror(argv[2]);
+            exit(1);
+        }
+
+        snap_load(&snap, &db);
+        db_write(&db, 1, argv[3]);
+        db_clear(&db);
+        snap_close(&snap);
+    } else {
+        usage();
+        exit(1);
+    }
+
+    return 0;
+}
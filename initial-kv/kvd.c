@@ -0,0 +1,432 @@
+// kvd: serves the kv database over TCP to many clients at once.
+//
+//     kvd [-p port] [-s shards] [-i interval] [-t threads]
+//
+// Clients send commands in kv syntax, one per line, and may pipeline them.
+// Every command is answered with the lines kv would print for it followed by
+// an empty line, so puts, deletes and clears are answered with just the empty
+// line.
+//
+// The database stays in memory, split into shards by key. Each shard has its
+// own reader/writer lock: gets never wait for each other, and puts and deletes
+// only wait for operations on the same shard. Mutations are appended to the
+// log as with kv, but only flushed by a background thread every interval
+// seconds, which also checkpoints once the log has grown large enough.
+//
+// A text database is loaded by threads threads, by default one per CPU for
+// large files, straight into the shards.
+//
+// kv must not be run on the same database while kvd is running.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cmd.h"
+#include "db.h"
+#include "snap.h"
+#include "stats.h"
+#include "store.h"
+
+// Longest command line accepted from a client
+#define MAXLINE (64 * 1024)
+
+static struct db *dbs;
+static pthread_rwlock_t *locks;
+static size_t nshards = 16;
+
+// Lock order: shards in ascending order, then log_lock
+static struct store st;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+shard_of(int key)
+{
+    return db_partition(key, nshards);
+}
+
+static void
+lock_all(int write)
+{
+    for (size_t i = 0; i < nshards; i++) {
+        if (write) {
+            pthread_rwlock_wrlock(&locks[i]);
+        } else {
+            pthread_rwlock_rdlock(&locks[i]);
+        }
+    }
+}
+
+static void
+unlock_all(void)
+{
+    for (size_t i = 0; i < nshards; i++) {
+        pthread_rwlock_unlock(&locks[i]);
+    }
+}
+
+static void
+log_record(struct cmd *cmd)
+{
+    pthread_mutex_lock(&log_lock);
+    log_append(&st.log, cmd);
+    pthread_mutex_unlock(&log_lock);
+}
+
+// Output goes to an in-memory stream, so printing while holding shard locks
+// never waits on a client
+static void
+handle(char *line, FILE *out)
+{
+    struct cmd cmd;
+    if (cmd_parse(&cmd, line)) {
+        fprintf(out, "bad command\n\n");
+        return;
+    }
+
+    uint64_t start = stats_now();
+    size_t s;
+    switch (cmd.type) {
+    case CMD_GET:
+        s = shard_of(cmd.kv.k);
+        pthread_rwlock_rdlock(&locks[s]);
+        cmd_handle(&cmd, &dbs[s], out);
+        pthread_rwlock_unlock(&locks[s]);
+        break;
+    case CMD_PUT:
+    case CMD_DEL:
+        // Only commands on a single key set cmd.kv.k
+        s = shard_of(cmd.kv.k);
+        pthread_rwlock_wrlock(&locks[s]);
+        cmd_handle(&cmd, &dbs[s], out);
+        log_record(&cmd);
+        pthread_rwlock_unlock(&locks[s]);
+        break;
+    case CMD_CLR:
+        lock_all(1);
+        for (size_t i = 0; i < nshards; i++) {
+            db_clear(&dbs[i]);
+        }
+        log_record(&cmd);
+        unlock_all();
+        break;
+    case CMD_ALL:
+        lock_all(0);
+        for (size_t i = 0; i < nshards; i++) {
+            cmd_handle(&cmd, &dbs[i], out);
+        }
+        unlock_all();
+        break;
+    case CMD_RNG: {
+        struct db_merge merge;
+        struct kv *kv;
+        lock_all(0);
+        db_merge_init(&merge, dbs, nshards, cmd.kv.k, cmd.hi);
+        while ((kv = db_merge_next(&merge)) != NULL) {
+            fprintf(out, "%d,%s\n", kv->k, kv->v);
+        }
+        db_merge_free(&merge);
+        unlock_all();
+        break;
+    }
+    case CMD_STATS:
+        lock_all(0);
+        stats_print(out, dbs, nshards);
+        unlock_all();
+        break;
+    }
+
+    stats_command(cmd.type, start);
+    fputc('\n', out);
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Serves one client. Every complete line that has arrived is handled before
+// the answers are sent back in a single write, so pipelined commands share
+// system calls.
+static void *
+serve(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char *buf = malloc(MAXLINE);
+    char *outbuf = NULL;
+    size_t outlen = 0;
+    FILE *out = open_memstream(&outbuf, &outlen);
+    if (!buf || !out) {
+        perror("malloc");
+        exit(1);
+    }
+
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + len, MAXLINE - len)) > 0) {
+        len += n;
+
+        char *line = buf;
+        char *nl;
+        while ((nl = memchr(line, '\n', buf + len - line)) != NULL) {
+            *nl = '\0';
+            if (nl > line && nl[-1] == '\r') {
+                nl[-1] = '\0';
+            }
+
+            handle(line, out);
+            line = nl + 1;
+        }
+
+        len -= line - buf;
+        memmove(buf, line, len);
+
+        // The answers to the lines before an overlong one go out first:
+        // those commands have taken effect
+        fflush(out);
+        if (outlen > 0 && write_all(fd, outbuf, outlen)) {
+            break;
+        }
+
+        if (len == MAXLINE) {
+            fprintf(stderr, "kvd: command line too long\n");
+            break;
+        }
+
+        fseek(out, 0, SEEK_SET);
+    }
+
+    fclose(out);
+    free(outbuf);
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+// Flushes the log, folding it into a new snapshot once it has grown as large
+// as the snapshot itself. Readers carry on during a checkpoint, writers wait
+// for it.
+static void
+sync_all(void)
+{
+    pthread_mutex_lock(&log_lock);
+    int checkpoint = st.log.size >= LOG_MIN_CHECKPOINT && st.log.size >= st.snapshot_size;
+    if (!checkpoint && st.log.fp && fflush(st.log.fp)) {
+        perror("fflush");
+        exit(1);
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    if (!checkpoint) {
+        return;
+    }
+
+    lock_all(0);
+    pthread_mutex_lock(&log_lock);
+    st.snapshot_size = log_checkpoint(&st.log, dbs, nshards, st.write, st.filename);
+    pthread_mutex_unlock(&log_lock);
+    unlock_all();
+}
+
+static void *
+persist(void *arg)
+{
+    unsigned interval = *(unsigned *)arg;
+    while (1) {
+        sleep(interval);
+        sync_all();
+    }
+
+    return NULL;
+}
+
+// Waits for SIGINT or SIGTERM and exits once every mutation is in the log
+static void *
+shutdown_on_signal(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+    sigwait(set, &sig);
+
+    lock_all(1);
+    pthread_mutex_lock(&log_lock);
+    log_close(&st.log);
+    if (getenv(STATS_ENV)) {
+        stats_print(stderr, dbs, nshards);
+    }
+    exit(0);
+}
+
+// Loads the database the way kv does, spread over the shards
+static void
+load(size_t nthreads)
+{
+    struct snap snap;
+    struct snap *snapp = snap_open(&snap, SNAP_FILE) == 0 ? &snap : NULL;
+
+    dbs = malloc(nshards * sizeof(*dbs));
+    locks = malloc(nshards * sizeof(*locks));
+    if (!dbs || !locks) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Without writer preference a steady stream of gets would keep puts to a
+    // shard waiting indefinitely
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (size_t i = 0; i < nshards; i++) {
+        pthread_rwlock_init(&locks[i], &attr);
+    }
+    pthread_rwlockattr_destroy(&attr);
+
+    store_open_partitioned(&st, snapp, dbs, nshards, nthreads);
+    if (snapp) {
+        snap_close(snapp);
+    }
+}
+
+static int
+open_listen_fd(int port)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Eliminates "Address already in use" error from bind
+    int optval = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt");
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons((unsigned short)port);
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind");
+        return -1;
+    }
+
+    if (listen(listen_fd, 1024) < 0) {
+        perror("listen");
+        return -1;
+    }
+
+    return listen_fd;
+}
+
+void
+usage()
+{
+    fprintf(stderr, "usage: kvd [-p port] [-s shards] [-i interval] [-t threads]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c;
+    int port = 10001;
+    unsigned interval = 1;
+    size_t nthreads = 0;
+
+    while ((c = getopt(argc, argv, "p:s:i:t:h")) != -1) {
+        switch (c) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            nshards = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            nthreads = strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    if (nshards < 1 || interval < 1) {
+        usage();
+        exit(1);
+    }
+
+    // Signals are taken by shutdown_on_signal() alone, and a client going
+    // away mid-write must not kill the server
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    load(nthreads);
+
+    int listen_fd = open_listen_fd(port);
+    if (listen_fd < 0) {
+        exit(1);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, persist, &interval)
+            || pthread_create(&thread, NULL, shutdown_on_signal, &set)) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        int conn_fd = accept(listen_fd, NULL, NULL);
+        if (conn_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            perror("accept");
+            exit(1);
+        }
+
+        if (pthread_create(&thread, &attr, serve, (void *)(intptr_t)conn_fd)) {
+            perror("pthread_create");
+            close(conn_fd);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+// kvload: drives a running kvd with a mix of gets and puts and reports the
+// throughput and latency it observed.
+//
+//     kvload [-h host] [-p port] [-c connections] [-n requests] [-k keys] [-w percent]
+//
+// Every connection is served by its own thread that sends a request, waits
+// for the answer and sends the next one. Keys are drawn uniformly from 0 to
+// keys - 1, and percent of the requests are puts.
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *host = "localhost";
+static const char *port = "10001";
+static long nrequests = 10000;
+static int nkeys = 100000;
+static int put_percent = 10;
+
+struct client {
+    pthread_t thread;
+    unsigned seed;
+    double *latencies;
+    long n;
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+connect_to_server(void)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        exit(1);
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+    if (fd < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    return fd;
+}
+
+// Reads until the empty line that ends an answer. Answers to single-key
+// commands are short enough to fit in buf.
+static void
+read_answer(int fd, char *buf, size_t size)
+{
+    size_t len = 0;
+    while (1) {
+        ssize_t n = read(fd, buf + len, size - len);
+        if (n <= 0) {
+            fprintf(stderr, "kvload: connection closed by server\n");
+            exit(1);
+        }
+
+        len += n;
+        if ((len == 1 && buf[0] == '\n')
+                || (len >= 2 && buf[len - 1] == '\n' && buf[len - 2] == '\n')) {
+            return;
+        }
+
+        if (len == size) {
+            fprintf(stderr, "kvload: answer too long\n");
+            exit(1);
+        }
+    }
+}
+
+static void *
+run(void *arg)
+{
+    struct client *c = arg;
+    int fd = connect_to_server();
+    char req[64];
+    char buf[4096];
+
+    for (long i = 0; i < c->n; i++) {
+        int key = rand_r(&c->seed) % nkeys;
+        int len;
+        if (rand_r(&c->seed) % 100 < put_percent) {
+            len = snprintf(req, sizeof(req), "p,%d,value%d\n", key, rand_r(&c->seed));
+        } else {
+            len = snprintf(req, sizeof(req), "g,%d\n", key);
+        }
+
+        double start = now();
+        if (write(fd, req, len) != len) {
+            perror("write");
+            exit(1);
+        }
+
+        read_answer(fd, buf, sizeof(buf));
+        c->latencies[i] = now() - start;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double
+percentile(double *sorted, long n, double p)
+{
+    long i = (long)(p / 100 * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+void
+usage()
+{
+    fprintf(stderr, "usage: kvload [-h host] [-p port] [-c connections] [-n requests] "
+        "[-k keys] [-w percent]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c;
+    int nclients = 4;
+
+    while ((c = getopt(argc, argv, "h:p:c:n:k:w:")) != -1) {
+        switch (c) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'n':
+            nrequests = atol(optarg);
+            break;
+        case 'k':
+            nkeys = atoi(optarg);
+            break;
+        case 'w':
+            put_percent = atoi(optarg);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    if (nclients < 1 || nrequests < nclients || nkeys < 1) {
+        usage();
+        exit(1);
+    }
+
+    struct client *clients = calloc(nclients, sizeof(*clients));
+    double *latencies = malloc(nrequests * sizeof(*latencies));
+    if (!clients || !latencies) {
+        perror("malloc");
+        exit(1);
+    }
+
+    double start = now();
+    long offset = 0;
+    for (int i = 0; i < nclients; i++) {
+        struct client *cl = &clients[i];
+        cl->seed = i + 1;
+        cl->n = nrequests / nclients + (i < nrequests % nclients);
+        cl->latencies = latencies + offset;
+        offset += cl->n;
+        if (pthread_create(&cl->thread, NULL, run, cl)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    double elapsed = now() - start;
+
+    qsort(latencies, nrequests, sizeof(*latencies), compare_double);
+    printf("%ld requests over %d connections in %.2f s: %.0f ops/s\n",
+        nrequests, nclients, elapsed, nrequests / elapsed);
+    printf("latency p50 %.1f us, p99 %.1f us, max %.1f us\n",
+        percentile(latencies, nrequests, 50) * 1e6,
+        percentile(latencies, nrequests, 99) * 1e6,
+        latencies[nrequests - 1] * 1e6);
+
+    free(latencies);
+    free(clients);
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Measures how loading a text snapshot scales with the number of threads.
+//
+//     make bench
+//     ./load_bench database.txt 1 4 16 32
+//
+// Every thread count is timed loading into a single table, as kv does, and
+// into one partition per thread, as kvd does with its shards.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "db.h"
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench(const char *filename, size_t ndbs, size_t nthreads, size_t *len)
+{
+    struct db *dbs = malloc(ndbs * sizeof(*dbs));
+    if (!dbs) {
+        perror("malloc");
+        exit(1);
+    }
+
+    double t0 = now();
+    db_read(dbs, ndbs, filename, nthreads);
+    double t1 = now();
+
+    *len = 0;
+    for (size_t i = 0; i < ndbs; i++) {
+        *len += db_len(&dbs[i]);
+        db_clear(&dbs[i]);
+    }
+
+    free(dbs);
+    return t1 - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s file nthreads...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        size_t nthreads = strtoull(argv[i], NULL, 10);
+        size_t len1, lenn;
+        double single = bench(argv[1], 1, nthreads, &len1);
+        double parted = bench(argv[1], nthreads, nthreads, &lenn);
+        if (len1 != lenn) {
+            fprintf(stderr, "loaded %zu keys into one table but %zu into %zu\n",
+                len1, lenn, nthreads);
+            exit(1);
+        }
+
+        printf("%3zu threads: %zu keys, 1 table %6.2f s, %zu partitions %6.2f s\n",
+            nthreads, len1, single, nthreads, parted);
+    }
+
+    return 0;
+}
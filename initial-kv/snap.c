@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snap.h"
+
+// Maps the snapshot at filename. Returns -1 if the file does not exist.
+int
+snap_open(struct snap *snap, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return -1;
+        }
+
+        perror("open");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        perror("fstat");
+        exit(1);
+    }
+
+    size_t size = st.st_size;
+    if (size < sizeof(struct snap_header)) {
+        fprintf(stderr, "%s: not a snapshot\n", filename);
+        exit(1);
+    }
+
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    if (close(fd)) {
+        perror("close");
+    }
+
+    const struct snap_header *hdr = base;
+    size_t avail = size - sizeof(*hdr);
+    if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic))
+            || hdr->count > avail / sizeof(struct snap_entry)
+            || hdr->heap_size != avail - hdr->count * sizeof(struct snap_entry)) {
+        fprintf(stderr, "%s: not a snapshot\n", filename);
+        exit(1);
+    }
+
+    snap->base = base;
+    snap->size = size;
+    snap->index = (const struct snap_entry *)(hdr + 1);
+    snap->count = hdr->count;
+    snap->heap = (char *)(snap->index + snap->count);
+
+    return 0;
+}
+
+void
+snap_close(struct snap *snap)
+{
+    if (munmap(snap->base, snap->size)) {
+        perror("munmap");
+    }
+
+    memset(snap, 0, sizeof(*snap));
+}
+
+// Looks key up by binary search over the mapped index, without loading
+// anything else
+const char *
+snap_get(struct snap *snap, int key)
+{
+    size_t lo = 0;
+    size_t hi = snap->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct snap_entry *e = &snap->index[mid];
+        if (e->k == key) {
+            return snap->heap + e->off;
+        }
+
+        if (e->k < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+// Fills db with the entries of the snapshot. Values are not copied: db refers
+// to them inside the mapping until they are overwritten or deleted.
+void
+snap_load(struct snap *snap, struct db *db)
+{
+    db_init(db);
+    db_borrow(db, snap->heap, snap->size - (snap->heap - (char *)snap->base));
+    for (size_t i = 0; i < snap->count; i++) {
+        db_insert_borrowed(db, snap->index[i].k, snap->heap + snap->index[i].off);
+    }
+}
+
+// Writes the whole of the ndbs databases in dbs to filename as a binary
+// snapshot. Like db_write(), the file is written under a temporary name and
+// renamed into place.
+void
+snap_write(struct db *dbs, size_t ndbs, const char *filename)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < ndbs; i++) {
+        count += db_len(&dbs[i]);
+    }
+
+    struct snap_entry *index = malloc(count * sizeof(*index) + 1);
+    if (!index) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // The ordered indexes already yield the entries sorted by key
+    struct db_merge merge;
+    struct kv *kv;
+    struct snap_header hdr = { SNAP_MAGIC, count, 0 };
+    size_t n = 0;
+    db_merge_init(&merge, dbs, ndbs, INT_MIN, INT_MAX);
+    while ((kv = db_merge_next(&merge)) != NULL) {
+        index[n].k = kv->k;
+        index[n].len = strlen(kv->v);
+        index[n].off = hdr.heap_size;
+        hdr.heap_size += index[n].len + 1;
+        n++;
+    }
+
+    db_merge_free(&merge);
+
+    char tmp[FILENAME_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        perror("fopen");
+        exit(1);
+    }
+
+    int err = fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+        || fwrite(index, sizeof(*index), count, fp) != count;
+    db_merge_init(&merge, dbs, ndbs, INT_MIN, INT_MAX);
+    for (n = 0; n < count && !err; n++) {
+        kv = db_merge_next(&merge);
+        err = fwrite(kv->v, index[n].len + 1, 1, fp) != 1;
+    }
+
+    db_merge_free(&merge);
+
+    if (err) {
+        perror("fwrite");
+        exit(1);
+    }
+
+    if (fclose(fp)) {
+        perror("fclose");
+        exit(1);
+    }
+
+    if (rename(tmp, filename)) {
+        perror("rename");
+        exit(1);
+    }
+
+    free(index);
+}
@@ -0,0 +1,46 @@
+#ifndef __SNAP_H__
+#define __SNAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "db.h"
+
+// A binary snapshot is laid out so that it can be queried straight from a
+// memory mapping:
+//
+//     struct snap_header
+//     struct snap_entry[count]     sorted by key
+//     value heap                   heap_size bytes of NUL-terminated values
+//
+// All integers are stored in native byte order.
+
+#define SNAP_MAGIC "KVSNAP1"
+
+struct snap_header {
+    char magic[8];
+    uint64_t count;
+    uint64_t heap_size;
+};
+
+struct snap_entry {
+    int32_t k;
+    uint32_t len;
+    uint64_t off;
+};
+
+struct snap {
+    void *base;
+    size_t size;
+    const struct snap_entry *index;
+    size_t count;
+    char *heap;
+};
+
+int snap_open(struct snap *snap, const char *filename);
+void snap_close(struct snap *snap);
+const char *snap_get(struct snap *snap, int key);
+void snap_load(struct snap *snap, struct db *db);
+void snap_write(struct db *dbs, size_t ndbs, const char *filename);
+
+#endif // __SNAP_H__
@@ -0,0 +1,164 @@
+#include <time.h>
+
+#include "stats.h"
+
+struct stats stats;
+
+static const char *cmd_names[CMD_TYPES] = {
+    [CMD_PUT] = "put",
+    [CMD_GET] = "get",
+    [CMD_CLR] = "clear",
+    [CMD_ALL] = "all",
+    [CMD_DEL] = "delete",
+    [CMD_RNG] = "range",
+    [CMD_STATS] = "stats",
+};
+
+static void
+add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+get(uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Returns a timestamp in nanoseconds to pass to the functions below
+uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+bucket_of(uint64_t nanos)
+{
+    size_t b = 0;
+    while (nanos >>= 1) {
+        b++;
+    }
+
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+// Records a command of the given type that started at start
+void
+stats_command(int type, uint64_t start)
+{
+    uint64_t nanos = stats_now() - start;
+    add(&stats.count[type], 1);
+    add(&stats.nanos[type], nanos);
+    add(&stats.hist[type][bucket_of(nanos)], 1);
+
+    uint64_t max = get(&stats.max[type]);
+    while (nanos > max && !__atomic_compare_exchange_n(&stats.max[type], &max, nanos,
+                0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void
+stats_read(uint64_t n)
+{
+    add(&stats.bytes_read, n);
+}
+
+void
+stats_written(uint64_t n)
+{
+    add(&stats.bytes_written, n);
+}
+
+void
+stats_loaded(uint64_t start)
+{
+    __atomic_store_n(&stats.load_nanos, stats_now() - start, __ATOMIC_RELAXED);
+}
+
+void
+stats_checkpointed(uint64_t start)
+{
+    add(&stats.checkpoints, 1);
+    add(&stats.checkpoint_nanos, stats_now() - start);
+}
+
+// Returns the upper bound in microseconds of the bucket that holds the given
+// fraction of the latencies in hist
+static double
+percentile(uint64_t *hist, uint64_t count, double p)
+{
+    uint64_t seen = 0;
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        seen += get(&hist[b]);
+        if (seen >= p * count) {
+            return (double)((uint64_t)2 << b) / 1000;
+        }
+    }
+
+    return (double)((uint64_t)2 << (STATS_BUCKETS - 1)) / 1000;
+}
+
+// Prints the counters and the shape of the ndbs databases in dbs, one
+// "name value" pair per line
+void
+stats_print(FILE *out, struct db *dbs, size_t ndbs)
+{
+    for (int t = 0; t < CMD_TYPES; t++) {
+        uint64_t count = get(&stats.count[t]);
+        fprintf(out, "cmd.%s.count %llu\n", cmd_names[t], (unsigned long long)count);
+        if (!count) {
+            continue;
+        }
+
+        fprintf(out, "cmd.%s.mean_us %.3f\n", cmd_names[t],
+            (double)get(&stats.nanos[t]) / count / 1000);
+        fprintf(out, "cmd.%s.p50_us %.3f\n", cmd_names[t], percentile(stats.hist[t], count, 0.5));
+        fprintf(out, "cmd.%s.p99_us %.3f\n", cmd_names[t], percentile(stats.hist[t], count, 0.99));
+        fprintf(out, "cmd.%s.max_us %.3f\n", cmd_names[t], (double)get(&stats.max[t]) / 1000);
+
+        // The histogram as upper bound in nanoseconds and count, for the
+        // buckets that are not empty
+        fprintf(out, "cmd.%s.hist", cmd_names[t]);
+        for (size_t b = 0; b < STATS_BUCKETS; b++) {
+            uint64_t n = get(&stats.hist[t][b]);
+            if (n) {
+                fprintf(out, " %llu:%llu", (unsigned long long)2 << b, (unsigned long long)n);
+            }
+        }
+        fputc('\n', out);
+    }
+
+    if (ndbs) {
+        struct db_stats st = { 0 };
+        size_t nchunks = 0;
+        size_t reserved = 0;
+        size_t used = 0;
+        for (size_t i = 0; i < ndbs; i++) {
+            db_stats(&dbs[i], &st);
+            nchunks += dbs[i].arena.nchunks;
+            reserved += dbs[i].arena.reserved;
+            used += dbs[i].arena.used;
+        }
+
+        fprintf(out, "table.keys %zu\n", st.len);
+        fprintf(out, "table.slots %zu\n", st.cap);
+        fprintf(out, "table.tombstones %zu\n", st.tombstones);
+        fprintf(out, "table.load_factor %.3f\n", st.cap ? (double)st.len / st.cap : 0.0);
+        fprintf(out, "table.longest_probe %zu\n", st.longest_probe);
+        fprintf(out, "table.mean_probe %.3f\n", st.len ? (double)st.total_probe / st.len : 0.0);
+        fprintf(out, "table.resizing %d\n", st.resizing);
+        fprintf(out, "arena.chunks %zu\n", nchunks);
+        fprintf(out, "arena.reserved_bytes %zu\n", reserved);
+        fprintf(out, "arena.used_bytes %zu\n", used);
+    }
+
+    fprintf(out, "io.bytes_read %llu\n", (unsigned long long)get(&stats.bytes_read));
+    fprintf(out, "io.bytes_written %llu\n", (unsigned long long)get(&stats.bytes_written));
+    fprintf(out, "time.load_ms %.3f\n", (double)get(&stats.load_nanos) / 1e6);
+    fprintf(out, "time.checkpoints %llu\n", (unsigned long long)get(&stats.checkpoints));
+    fprintf(out, "time.checkpoint_ms %.3f\n", (double)get(&stats.checkpoint_nanos) / 1e6);
+}
@@ -0,0 +1,43 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cmd.h"
+#include "db.h"
+
+// Setting this in the environment makes kv and kvd print their statistics to
+// stderr when they exit
+#define STATS_ENV "KV_STATS"
+
+// Latencies are counted in power-of-two buckets of nanoseconds: bucket i
+// holds those below 2^(i+1) ns, the last one everything longer
+#define STATS_BUCKETS 40
+
+// Counters for the whole process. They are updated atomically, so threads
+// can share them.
+struct stats {
+    uint64_t count[CMD_TYPES];
+    uint64_t nanos[CMD_TYPES];
+    uint64_t max[CMD_TYPES];
+    uint64_t hist[CMD_TYPES][STATS_BUCKETS];
+
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t load_nanos;
+    uint64_t checkpoints;
+    uint64_t checkpoint_nanos;
+};
+
+extern struct stats stats;
+
+uint64_t stats_now(void);
+void stats_command(int type, uint64_t start);
+void stats_read(uint64_t n);
+void stats_written(uint64_t n);
+void stats_loaded(uint64_t start);
+void stats_checkpointed(uint64_t start);
+void stats_print(FILE *out, struct db *dbs, size_t ndbs);
+
+#endif // __STATS_H__
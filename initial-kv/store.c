@@ -0,0 +1,312 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "idx.h"
+#include "stats.h"
+#include "store.h"
+
+// Replays the mutations recorded in the log at filename by passing each of
+// them to apply. Returns the length of the valid prefix of the log: a final
+// record without a trailing newline is the remains of an interrupted append
+// and is ignored.
+off_t
+log_replay(const char *filename, void (*apply)(struct cmd *, void *), void *arg)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+
+        perror("fopen");
+        exit(1);
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t sz = 0;
+    off_t size = 0;
+    struct cmd cmd;
+    while ((sz = getline(&line, &linecap, fp)) > 0) {
+        if (line[sz - 1] != '\n') {
+            break;
+        }
+
+        line[sz - 1] = '\0';
+        if (cmd_parse(&cmd, line)) {
+            exit(1);
+        }
+
+        if (cmd.type != CMD_PUT && cmd.type != CMD_DEL && cmd.type != CMD_CLR) {
+            fprintf(stderr, "Invalid log record at offset %lld\n", (long long)size);
+            exit(1);
+        }
+
+        apply(&cmd, arg);
+
+        size += sz;
+    }
+
+    if (sz < 0 && ferror(fp)) {
+        perror("getline");
+        exit(1);
+    }
+
+    if (line) {
+        free(line);
+    }
+
+    if (fclose(fp)) {
+        perror("fclose");
+    }
+
+    stats_read(size);
+    return size;
+}
+
+// Prepares the log at filename for appending. size is the length of the valid
+// prefix as returned by log_replay(); anything after it is cut off so new
+// records are not glued onto a torn one. The file itself is only opened when
+// the first record is appended, so read-only runs never touch it.
+void
+log_open(struct log *log, const char *filename, off_t size)
+{
+    struct stat st;
+    if (stat(filename, &st) == 0 && st.st_size > size) {
+        if (truncate(filename, size)) {
+            perror("truncate");
+            exit(1);
+        }
+    }
+
+    log->filename = filename;
+    log->fp = NULL;
+    log->size = size;
+}
+
+// Appends a record for cmd to the log if it modifies the database
+void
+log_append(struct log *log, struct cmd *cmd)
+{
+    if (cmd->type != CMD_PUT && cmd->type != CMD_DEL && cmd->type != CMD_CLR) {
+        return;
+    }
+
+    if (!log->fp) {
+        log->fp = fopen(log->filename, "a");
+        if (!log->fp) {
+            perror("fopen");
+            exit(1);
+        }
+    }
+
+    int n = 0;
+    switch (cmd->type) {
+    case CMD_PUT:
+        n = fprintf(log->fp, "p,%d,%s\n", cmd->kv.k, cmd->kv.v);
+        break;
+    case CMD_DEL:
+        n = fprintf(log->fp, "d,%d\n", cmd->kv.k);
+        break;
+    case CMD_CLR:
+        n = fprintf(log->fp, "c\n");
+        break;
+    default:
+        break;
+    }
+
+    if (n < 0) {
+        perror("fprintf");
+        exit(1);
+    }
+
+    log->size += n;
+    stats_written(n);
+}
+
+// Folds the log into a fresh snapshot of the ndbs databases in dbs, written
+// to filename by write, and empties it. Returns the size of the snapshot.
+off_t
+log_checkpoint(struct log *log, struct db *dbs, size_t ndbs,
+    snapshot_writer write, const char *filename)
+{
+    uint64_t start = stats_now();
+    write(dbs, ndbs, filename);
+
+    struct stat sb;
+    if (stat(filename, &sb)) {
+        perror("stat");
+        exit(1);
+    }
+
+    if (log->fp) {
+        if (fflush(log->fp)) {
+            perror("fflush");
+            exit(1);
+        }
+    }
+
+    if (truncate(log->filename, 0) && errno != ENOENT) {
+        perror("truncate");
+        exit(1);
+    }
+
+    log->size = 0;
+    stats_written(sb.st_size);
+    stats_checkpointed(start);
+    return sb.st_size;
+}
+
+// Closes the log and, if anything was appended to it, indexes it for the
+// read-only runs that follow, so that their gets cost the same however long
+// the log has grown. This reads the log once more, which a run that wrote to
+// it has already paid for in replaying it.
+void
+log_close(struct log *log)
+{
+    if (!log->fp) {
+        return;
+    }
+
+    if (fclose(log->fp)) {
+        perror("fclose");
+        exit(1);
+    }
+
+    log->fp = NULL;
+    idx_build_log(LOG_IDX_FILE, log->filename);
+}
+
+void
+db_apply(struct cmd *cmd, void *db)
+{
+    cmd_handle(cmd, db, stdout);
+}
+
+// Writes a text snapshot along with its index, so that the first get after a
+// checkpoint does not have to index it again
+static void
+db_write_indexed(struct db *dbs, size_t ndbs, const char *filename)
+{
+    db_write(dbs, ndbs, filename);
+    idx_build(IDX_FILE, filename);
+}
+
+// Loads the database, from the binary snapshot if there is one, and replays
+// the log on top of it
+void
+store_open(struct store *st, struct snap *snap, size_t nthreads)
+{
+    uint64_t start = stats_now();
+    if (snap) {
+        snap_load(snap, &st->db);
+        st->snapshot_size = snap->size;
+        st->write = snap_write;
+        st->filename = SNAP_FILE;
+    } else {
+        st->snapshot_size = db_read(&st->db, 1, DB_FILE, nthreads);
+        st->write = db_write_indexed;
+        st->filename = DB_FILE;
+    }
+
+    stats_read(st->snapshot_size);
+    log_open(&st->log, LOG_FILE, log_replay(LOG_FILE, db_apply, &st->db));
+    stats_loaded(start);
+}
+
+struct partitions {
+    struct db *dbs;
+    size_t ndbs;
+};
+
+static void
+partitions_apply(struct cmd *cmd, void *arg)
+{
+    struct partitions *p = arg;
+    if (cmd->type == CMD_CLR) {
+        for (size_t i = 0; i < p->ndbs; i++) {
+            db_clear(&p->dbs[i]);
+        }
+    } else {
+        db_apply(cmd, &p->dbs[db_partition(cmd->kv.k, p->ndbs)]);
+    }
+}
+
+// Like store_open(), but loads the database into ndbs databases split by
+// db_partition() for callers that lock them separately. st->db is left empty.
+// A text snapshot is loaded straight into the partitions, a binary one is
+// redistributed from st->db.
+void
+store_open_partitioned(struct store *st, struct snap *snap, struct db *dbs, size_t ndbs,
+    size_t nthreads)
+{
+    uint64_t start = stats_now();
+    if (snap) {
+        store_open(st, snap, nthreads);
+        for (size_t i = 0; i < ndbs; i++) {
+            db_init(&dbs[i]);
+        }
+
+        struct db_iter iter;
+        struct kv *kv;
+        db_iter_init(&st->db, &iter);
+        while ((kv = db_iter_next(&iter)) != NULL) {
+            db_insert(&dbs[db_partition(kv->k, ndbs)], kv->k, kv->v);
+        }
+
+        db_clear(&st->db);
+        stats_loaded(start);
+        return;
+    }
+
+    db_init(&st->db);
+    st->snapshot_size = db_read(dbs, ndbs, DB_FILE, nthreads);
+    st->write = db_write_indexed;
+    st->filename = DB_FILE;
+
+    stats_read(st->snapshot_size);
+
+    struct partitions p = { dbs, ndbs };
+    log_open(&st->log, LOG_FILE, log_replay(LOG_FILE, partitions_apply, &p));
+    stats_loaded(start);
+}
+
+void
+store_handle(struct store *st, struct cmd *cmd)
+{
+    uint64_t start = stats_now();
+    cmd_handle(cmd, &st->db, stdout);
+    log_append(&st->log, cmd);
+    stats_command(cmd->type, start);
+}
+
+// Pushes buffered log records out to the file, checkpointing if the log has
+// grown large enough
+void
+store_sync(struct store *st)
+{
+    // Mutations only cost an append to the log. Once the log has grown as
+    // large as the snapshot, rewriting the snapshot is paid for by the appends
+    // it saves on subsequent replays.
+    if (st->log.size >= LOG_MIN_CHECKPOINT && st->log.size >= st->snapshot_size) {
+        st->snapshot_size = log_checkpoint(&st->log, &st->db, 1, st->write, st->filename);
+    } else if (st->log.fp && fflush(st->log.fp)) {
+        perror("fflush");
+        exit(1);
+    }
+}
+
+void
+store_close(struct store *st)
+{
+    store_sync(st);
+    log_close(&st->log);
+    if (getenv(STATS_ENV)) {
+        stats_print(stderr, &st->db, 1);
+    }
+    db_clear(&st->db);
+}
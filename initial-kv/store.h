@@ -0,0 +1,53 @@
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "cmd.h"
+#include "db.h"
+#include "snap.h"
+
+#define DB_FILE "database.txt"
+#define SNAP_FILE "database.kvs"
+#define LOG_FILE "database.log"
+#define IDX_FILE "database.idx"
+#define LOG_IDX_FILE "database.log.idx"
+
+// Never checkpoint a log smaller than this, no matter how small the snapshot
+#define LOG_MIN_CHECKPOINT (64 * 1024)
+
+typedef void (*snapshot_writer)(struct db *dbs, size_t ndbs, const char *filename);
+
+struct log {
+    const char *filename;
+    FILE *fp;
+    off_t size;
+};
+
+// The database as loaded by a run that modifies it
+struct store {
+    struct db db;
+    struct log log;
+    off_t snapshot_size;
+    snapshot_writer write;
+    const char *filename;
+};
+
+off_t log_replay(const char *filename, void (*apply)(struct cmd *, void *), void *arg);
+void log_open(struct log *log, const char *filename, off_t size);
+void log_append(struct log *log, struct cmd *cmd);
+off_t log_checkpoint(struct log *log, struct db *dbs, size_t ndbs,
+    snapshot_writer write, const char *filename);
+void log_close(struct log *log);
+
+void db_apply(struct cmd *cmd, void *db);
+
+void store_open(struct store *st, struct snap *snap, size_t nthreads);
+void store_open_partitioned(struct store *st, struct snap *snap, struct db *dbs, size_t ndbs,
+    size_t nthreads);
+void store_handle(struct store *st, struct cmd *cmd);
+void store_sync(struct store *st);
+void store_close(struct store *st);
+
+#endif // __STORE_H__
@@ -1,7 +1,7 @@
 #! /bin/bash
 
-if ! [[ -x kv ]]; then
-    echo "kv executable does not exist"
+if ! [[ -x kv && -x kvconv ]]; then
+    echo "kv and kvconv executables do not exist"
     exit 1
 fi
 